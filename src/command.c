@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <util/crc16.h>  // crc8 of binary framed commands
 #include <util/delay.h>  // used for tiny halts, e.g. to have the SPI
                          // slave preparation time before the master sends
 
@@ -56,8 +57,8 @@
 #define CMD_RTC_SIZE 0
 // example: 0x01 -
 #define CMD_SENSE_SIZE 0
-// example: 0x01 -
-#define CMD_SETTINGS_SIZE 0
+// example: 0x01 - g - 000006553500000008000000109765... - 0x02
+#define CMD_SETTINGS_SIZE (5 * SET_FIELDS + CMD_CONTROL_SIZE)
 // example: 0x01 -
 #define CMD_LOG_SIZE 0
 // example: 0x01 -
@@ -68,6 +69,22 @@
 #define CMD_SOUND_SIZE (3 + CMD_CONTROL_SIZE)
 // example: 0x01 -
 #define CMD_MSG_SIZE 0
+// example: 0x01 - n - 1 - 0x02
+#define CMD_FRAMING_SIZE (1 + CMD_CONTROL_SIZE)
+
+#ifdef EASYRIDER_MCU2
+// SPI master engine: max bytes per burst, afterwards the SS pin is released
+// for a while, so the SI_LI sense on that pin doesn't get blocked by traffic
+#define CMD_SPI_BURST 64
+// gap between 2 bytes in a burst, gives the slave ISR time to reload SPDR
+#define CMD_SPI_GAP_US 5
+// gap in timer2 ticks, prescaled with 8
+#define CMD_SPI_GAP_TICKS (((CMD_SPI_GAP_US) * (F_CPU / 1000000UL)) / 8)
+#endif
+
+// worst case size of a binary framed command with a payload of n bytes, every
+// byte after CMD_BSTART might need an escape byte
+#define CMD_BIN_SIZE(n) (1 + 2 * ((n) + 3))
 
 /* proto1{{{*/
 
@@ -106,15 +123,22 @@ static uint8_t get_mcu_in_byte(void);
 static void set_mcu_in_byte(uint8_t bt);
 static uint8_t get_mcu_out_byte(void);
 static void set_mcu_out_byte(uint8_t bt);
+static void set_mcu_out_frame(uint8_t cmd, const void* payload, uint8_t len);
 static uint8_t mcu_in_available(void);
 static uint8_t mcu_out_available(void);
 static void command_launch(uint8_t cmd, tCMDInterface cmd_interface);
+static void command_parse(uint8_t in_byte);
 
 // all single char commands, used for validation
 static const char* g_all_cmds = ALL_CMDS;
 
 static volatile t_cmd_status g_in_status = IDLE;   // status of incoming command
 static volatile t_cmd_status g_out_status = IDLE;  // status of outgoing command
+
+static uint8_t g_in_length;  // number of bytes in g_in_payload, including the
+                             // command byte (binary payloads aren't terminated)
+static uint8_t g_in_binary;  // current incoming command was binary framed
+static uint8_t g_bin_framing;  // binary framing negotiated with the other mcu
 /*}}}*/
 #ifdef EASYRIDER_MCU2
 extern volatile uint16_t g_state;  // current state
@@ -123,7 +147,41 @@ extern volatile uint16_t g_state;  // current state
 static char g_timestamp[TS_SIZE];  // [0-15], 16 ascii chars ->
                                    // [Dddmmyyhhmmssmmm] + NULL
 extern RTCDate g_datetime;         // date/time from RTC
-static void send_cmd(void);
+static volatile uint8_t g_spi_burst;  // bytes left in the current burst
+static volatile uint16_t g_spi_bytes;  // bytes transferred this second
+static uint16_t g_spi_throughput;      // bytes transferred last second
+// [Dddmmyyhhmmssmmm] weekday, day, month, year, hours, mins, secs, ms
+#define TS_FIELDS 8
+static const tFixedField g_ts_layout[TS_FIELDS] PROGMEM = {
+    {0, 1}, {1, 2}, {3, 2}, {5, 2}, {7, 2}, {9, 2}, {11, 2}, {13, 3}};
+static uint16_t g_ts_cache[TS_FIELDS];  // field values rendered in g_timestamp
+static uint64_t g_epoch_ms;   // epoch ms at the start of the cached second
+static uint8_t g_epoch_date[6];  // date/time fields of the cached epoch
+// days before each month in a non-leap year
+static const uint16_t g_month_days[] PROGMEM = {0,   31,  59,  90,  120, 151,
+                                                181, 212, 243, 273, 304, 334};
+static uint8_t g_log_request;  // a log request is being answered
+static uint8_t g_log_credit;   // mcu1 has room for the next log record
+static uint16_t g_log_wait;    // ms waited for that credit so far
+#define LOG_CREDIT_TIMEOUT 1000  // ms, the next record goes without credit
+// CMD_LOG request payload: [ddMMYYYYhhmm] day, month, year, optional hour and
+// minute to start at
+#define LOG_FIELDS 5
+static const tFixedField g_log_layout[LOG_FIELDS] PROGMEM = {
+    {0, 2}, {2, 2}, {4, 4}, {8, 2}, {10, 2}};
+static void spi_burst_start(void);
+static void spi_burst_next(void);
+extern tSettings g_settings;    // active settings
+static uint8_t g_settings_request;  // a settings request is being answered
+// CMD_SETTINGS request payload: pairs of [ffvvvvv] setting id and new value
+#define SETTINGS_PAIR 7
+static const tFixedField g_settings_pair[2] PROGMEM = {{0, 2}, {2, 5}};
+static void command_log_handler(void);
+static void command_log_process(void);
+static void command_settings_handler(void);
+static void command_settings_process(void);
+static uint16_t command_util_get_date(void);
+static uint16_t command_util_get_minute(void);
 #endif
 #ifdef EASYRIDER_MCU1
 extern void set_sound(uint8_t status);
@@ -135,8 +193,17 @@ static void command_data_handler(void);
 static void command_state_handler(void);
 static void command_gps_handler(void);
 static void command_sound_handler(void);
+static void command_relay_handler(uint8_t cmd, tCMDInterface cmd_interface);
+static void command_log_credit(void);
+static uint8_t g_log_owed;  // log record relayed, mcu2 waits for its credit
 #endif
+// CMD_STATS payload: [xxxyyyzzzCCCCVVVVVTTTTRRRRRG] xyz accelerometer,
+// current, voltage, temperature, rpm and gear
+#define STATS_FIELDS 8
+static const tFixedField g_stats_layout[STATS_FIELDS] PROGMEM = {
+    {0, 3}, {3, 3}, {6, 3}, {9, 4}, {13, 5}, {18, 4}, {22, 5}, {27, 1}};
 static void command_stats_handler(void);
+static void command_framing_handler(void);
 extern volatile uint16_t g_accelx;  // X-axis voltage of accelerometer
 extern volatile uint16_t g_accely;  // Y-axis voltage of accelerometer
 extern volatile uint16_t g_accelz;  // Z-axis voltage of accelerometer
@@ -223,6 +290,33 @@ uint8_t mcu_out_available() {
                                          // return count of bytes inbetween
 }
 
+// put a byte after CMD_BSTART in the outgoing buffer, escape it when needed
+static void set_mcu_out_escaped(uint8_t bt) {
+  if (bt == CMD_NOOP || bt == CMD_ESC || bt == CMD_BSTART) {
+    set_mcu_out_byte(CMD_ESC);
+    bt ^= CMD_ESC_XOR;
+  }
+  set_mcu_out_byte(bt);
+}
+
+// put a complete binary framed command in the outgoing buffer
+// NOTE: check for CMD_BIN_SIZE(len) free space first
+void set_mcu_out_frame(uint8_t cmd, const void* payload, uint8_t len) {
+  const uint8_t* ptr = (const uint8_t*)payload;
+  uint8_t crc;
+  set_mcu_out_byte(CMD_BSTART);
+  crc = _crc_ibutton_update(0, len + 1);
+  set_mcu_out_escaped(len + 1);
+  crc = _crc_ibutton_update(crc, cmd);
+  set_mcu_out_escaped(cmd);
+  while (len--) {
+    crc = _crc_ibutton_update(crc, *ptr);
+    set_mcu_out_escaped(*ptr);
+    ptr++;
+  }
+  set_mcu_out_escaped(crc);
+}
+
 // initialize all interface communication protocols
 void command_init() {
   uart_init_0();
@@ -241,10 +335,28 @@ void command_init() {
 #ifdef EASYRIDER_MCU2
   _delay_ms(
       1);  // short delay to give the slave mcu enough time to setup his SPI
+  memset((void*)g_ts_cache, 0xFF, sizeof(g_ts_cache));  // force full render
+  g_timestamp[TS_SIZE - 1] = '\0';
   g_spi_state = SPI_OFF;  // init to SPI off
   spi_init(g_spi_state, SPI_CLOCK_DIV4, SPI_MODE0, SPI_MSBFIRST,
            SPI_NO_INTERRUPT);
+#if CMD_SPI_GAP_TICKS > 1
+  // Configure timer 2 (8-bit) as one-shot CTC timer for the SPI inter-byte
+  // gap, it's only clocked during a gap
+  TCCR2A = (1 << WGM21);    // CTC Mode
+  TCCR2B = 0;               // stopped
+  OCR2A = CMD_SPI_GAP_TICKS - 1;
+  TIMSK2 |= (1 << OCIE2A);  // Enable Compare A interrupt
+#endif
   ds1307_init();  // RTC
+  gps_setup();    // GPS, configures itself in the background
+  fat32_init();   // SD card, before the mcu link starts using the SPI bus
+#ifdef EASY_TRACE
+  uart_put_str_1("FAT32: ");
+  uart_put_int_1(fat32_status());
+  uart_put_str_1("\r\n");
+#endif
+  command_trigger_framing(CMD_IF_IC);  // negotiate binary framing with mcu1
 #endif
 }
 
@@ -262,90 +374,199 @@ ISR(SPI_STC_vect) {
 #endif
 
 #ifdef EASYRIDER_MCU2
-// transceive SPI polling function: send/receive a byte from the queue
-void send_cmd() {
+// start a new interrupt driven SPI burst as master, the SPI/timer2 interrupts
+// drain the out queue from here on
+void spi_burst_start() {
+  g_spi_state = SPI_MASTER;
+  spi_init(g_spi_state, SPI_CLOCK_DIV4, SPI_MODE0, SPI_MSBFIRST,
+           SPI_INTERRUPT);
+  spi_enable();
+  spi_mcu_start();
+  g_spi_burst = CMD_SPI_BURST;
+  spi_burst_next();
+}
+
+// transceive the next byte of the burst
+void spi_burst_next() {
   g_out_byte = get_mcu_out_byte();
-  g_in_byte = spi_communicate(g_out_byte);
-  if (g_in_byte != CMD_NOOP) {
+  g_spi_burst--;
+  spi_set(g_out_byte);
+}
+
+// SPI byte transferred interrupt
+// save the incoming byte and continue the burst after the inter-byte gap,
+// or end the burst when there's nothing left to send and receive
+ISR(SPI_STC_vect) {
+  g_in_byte = spi_get();
+  g_spi_bytes++;
+  if (g_in_byte != CMD_NOOP) {  // don't save No Op bytes
     set_mcu_in_byte(g_in_byte);
   }
-  _delay_us(5);
+  // outgoing data available or slave is still sending a command byte
+  if (g_spi_burst && ((mcu_out_available()) || (g_in_byte != CMD_NOOP))) {
+#if CMD_SPI_GAP_TICKS > 1
+    TCNT2 = 0;
+    TIFR2 = (1 << OCF2A);  // clear a pending compare match
+    TCCR2B = (1 << CS21);  // start gap timer, prescale 8
+#else
+    spi_burst_next();
+#endif
+  } else {  // end of burst, disable SPI
+    spi_mcu_stop();
+    spi_disable();
+    g_spi_state = SPI_OFF;
+    spi_init(g_spi_state, SPI_CLOCK_DIV4, SPI_MODE0, SPI_MSBFIRST,
+             SPI_NO_INTERRUPT);
+  }
+}
+
+#if CMD_SPI_GAP_TICKS > 1
+// inter-byte gap elapsed, one-shot
+ISR(TIMER2_COMPA_vect) {
+  TCCR2B = 0;  // stop gap timer
+  spi_burst_next();
 }
 #endif
 
+// bytes per second the SPI master engine transferred during the last second
+uint16_t command_spi_throughput() { return g_spi_throughput; }
+#endif
+
+// parse incoming command bytes, both ascii and binary framed commands
+static void command_parse(uint8_t in_byte) {
+  static uint8_t x;    // index for g_in_payload
+  static uint8_t crc;  // running crc8 of a binary framed command
+  static uint8_t esc;  // previous byte was CMD_ESC
+  if (g_in_status >= BIN_LEN) {  // binary frame: undo escaping first
+    if (esc) {
+      esc = 0;
+      in_byte ^= CMD_ESC_XOR;
+    } else if (in_byte == CMD_ESC) {
+      esc = 1;
+      return;
+    } else if (in_byte == CMD_BSTART) {  // found a re-start -> ignore
+                                         // current incomplete cmd
+      g_in_status = BIN_LEN;
+      return;
+    }
+  }
+  switch (g_in_status) {
+    case IDLE:
+      if (in_byte == CMD_START) {
+        g_in_status = START;
+      } else if (in_byte == CMD_BSTART) {
+        g_in_status = BIN_LEN;
+        esc = 0;
+      }
+      break;
+    case BIN_LEN:
+      if (in_byte && in_byte < CMD_PAYLOAD_SIZE) {
+        g_in_length = in_byte;
+        crc = _crc_ibutton_update(0, in_byte);
+        x = 0;
+        g_in_status = BIN_DATA;
+      } else {
+        g_in_status = IDLE;  // reset, invalid length
+      }
+      break;
+    case BIN_DATA:
+      crc = _crc_ibutton_update(crc, in_byte);
+      g_in_payload[x] = in_byte;
+      x++;
+      if (x >= g_in_length) {
+        g_in_status = BIN_CRC;
+      }
+      break;
+    case BIN_CRC:
+      if (in_byte == crc && strchr(g_all_cmds, g_in_payload[0]) != NULL) {
+        g_in_payload[x] = '\0';
+        g_in_binary = 1;
+        command_launch(g_in_payload[0], CMD_IF_IC);  // process command now
+      }
+      g_in_status = IDLE;  // reset
+      break;
+    case START:
+      if (strchr(g_all_cmds, in_byte) != NULL) {  // check for valid command
+        g_in_status = CMD;
+        x = 0;
+        g_in_payload[x] =
+            in_byte;  // command byte is always the first char of payload
+        x++;
+      } else {
+        g_in_status = IDLE;  // reset, no CMD found after START
+      }
+      break;
+    case CMD:
+      if (in_byte == CMD_STOP) {  // stop byte found
+        g_in_payload[x] = '\0';
+        g_in_length = x;
+        g_in_binary = 0;
+        command_launch(g_in_payload[0], CMD_IF_IC);  // process command now
+        g_in_status = IDLE;                          // reset
+      } else if (in_byte == CMD_START) {  // found a re-start -> ignore
+                                          // current incomplete cmd
+        g_in_status = START;
+      } else if (in_byte == CMD_BSTART) {  // binary re-start
+        g_in_status = BIN_LEN;
+        esc = 0;
+      } else if (x < CMD_PAYLOAD_SIZE - 1) {  // fill payload
+        g_in_payload[x] = in_byte;
+        x++;
+      } else {
+        g_in_status = IDLE;  // reset, buffer overflowed
+      }
+      break;
+    default:
+      g_in_status = IDLE;  // reset, undefined state
+  }
+}
+
 // process commands to be transmitted
 // also toggle SPI off when there's no communication needed
 void command_process() {
-  static uint8_t x;  // index for g_in_payload
-  uint8_t in_byte;
 #ifdef EASYRIDER_MCU2
+  static uint8_t seconds;  // last second of the throughput measurement
   // out buffer is empty, go to IDLE state
   if (!mcu_out_available()) g_out_status = IDLE;
-  // outgoing data available or slave is still sending a command byte
-  if ((mcu_out_available()) || (g_in_byte != CMD_NOOP)) {
-    if (g_spi_state == SPI_OFF) {  // start SPI as master
-      g_spi_state = SPI_MASTER;
-      spi_init(g_spi_state, SPI_CLOCK_DIV4, SPI_MODE0, SPI_MSBFIRST,
-               SPI_NO_INTERRUPT);
-      spi_enable();
-      spi_mcu_start();
-    }
-    send_cmd();                         // send 1 byte at a time
-  } else if (g_spi_state != SPI_OFF) {  // disable SPI
-    spi_mcu_stop();
-    spi_disable();
-    g_spi_state = SPI_OFF;
-    spi_init(g_spi_state, SPI_CLOCK_DIV4, SPI_MODE0, SPI_MSBFIRST,
-             SPI_NO_INTERRUPT);
+  // outgoing data available or slave is still sending a command byte,
+  // start a new burst when the previous one has ended
+  if (g_spi_state == SPI_OFF &&
+      ((mcu_out_available()) || (g_in_byte != CMD_NOOP))) {
+    spi_burst_start();
+  }
+  if (seconds != g_datetime.seconds) {  // new RTC second, measure throughput
+    seconds = g_datetime.seconds;
+    cli();
+    g_spi_throughput = g_spi_bytes;
+    g_spi_bytes = 0;
+    sei();
+#ifdef EASY_TRACE
+    uart_put_str_1("SPI_THROUGHPUT: ");
+    uart_put_int_1(g_spi_throughput);
+    uart_put_str_1(" B/s\r\n");
+#endif
   }
 #endif
   // in bytes available
   if (mcu_in_available()) {
-    in_byte = get_mcu_in_byte();
-    switch (g_in_status) {
-      case IDLE:
-        if (in_byte == CMD_START) {
-          g_in_status = START;
-        }
-        break;
-      case START:
-        if (strchr(g_all_cmds, in_byte) != NULL) {  // check for valid command
-          g_in_status = CMD;
-          x = 0;
-          g_in_payload[x] =
-              in_byte;  // command byte is always the first char of payload
-          x++;
-        } else {
-          g_in_status = IDLE;  // reset, no CMD found after START
-        }
-        break;
-      case CMD:
-        if (in_byte == CMD_STOP) {  // stop byte found
-          g_in_payload[x] = '\0';
-          command_launch(g_in_payload[0], CMD_IF_IC);  // process command now
-          g_in_status = IDLE;                          // reset
-        } else if (in_byte == CMD_START) {  // found a re-start -> ignore
-                                            // current incomplete cmd
-          g_in_status = START;
-        } else if (x < CMD_PAYLOAD_SIZE - 1) {  // fill payload
-          g_in_payload[x] = in_byte;
-          x++;
-        } else {
-          g_in_status = IDLE;  // reset, buffer overflowed
-        }
-        break;
-      default:
-        g_in_status = IDLE;  // reset, undefined state
-    }
+    command_parse(get_mcu_in_byte());
   }
 #ifdef EASYRIDER_MCU1
   // process wifi messages
   wifi_process();
+  // let mcu2 send the next log record
+  command_log_credit();
   // serial_process();
 #endif
 #ifdef EASYRIDER_MCU2
   // process gps messages
   gps_process();
+  // write buffered SD card sectors
+  fat32_process();
+  // answer a log request
+  command_log_process();
+  // answer a settings request
+  command_settings_process();
 #endif
 }
 /*}}}*/
@@ -377,6 +598,13 @@ void command_launch(uint8_t cmd, tCMDInterface cmd_interface) {
     case CMD_SOUND:
       command_sound_handler();
       break;
+    case CMD_SETTINGS:
+    case CMD_LOG:
+      command_relay_handler(cmd, cmd_interface);
+      break;
+    case CMD_FRAMING:
+      command_framing_handler();
+      break;
     default:;
       ;
 #ifdef EASY_TRACE
@@ -393,6 +621,15 @@ void command_launch(uint8_t cmd, tCMDInterface cmd_interface) {
     case CMD_STATS:
       command_stats_handler();
       break;
+    case CMD_SETTINGS:
+      command_settings_handler();
+      break;
+    case CMD_LOG:
+      command_log_handler();
+      break;
+    case CMD_FRAMING:
+      command_framing_handler();
+      break;
     default:;
       ;
 #ifdef EASY_TRACE
@@ -405,7 +642,16 @@ void command_launch(uint8_t cmd, tCMDInterface cmd_interface) {
 #ifdef EASYRIDER_MCU2
 // onchange trigger -> has prio
 uint8_t command_trigger_state(tCMDInterface cmd_interface) {
-  if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
+  if (cmd_interface == CMD_IF_IC && g_bin_framing) {  // binary framed
+    tCmdState rec;
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) < CMD_BIN_SIZE(sizeof(rec))) {
+      return 0;
+    }
+    g_out_status = BUSY;
+    command_util_get_bin_timestamp(&rec.ts);
+    rec.state = g_state;
+    set_mcu_out_frame(CMD_STATE, &rec, sizeof(rec));
+  } else if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
     if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_STATE_SIZE) {
       g_out_status = BUSY;
       g_out_payload[0] = '\0';
@@ -441,9 +687,39 @@ uint8_t command_trigger_state(tCMDInterface cmd_interface) {
   return 1;
 }
 
+// fills the binary GPS record with the latest valid location received
+static void command_util_get_bin_gps(tCmdGps* rec) {
+  memset((void*)rec, 0, sizeof(*rec));
+  command_util_get_bin_timestamp(&rec->ts);
+  if (gps_status) {
+    rec->fix = gps_msg.location.fix;
+    rec->sv_count = gps_msg.location.sv_count;
+    rec->latitude = gps_msg.location.latitude;
+    rec->longitude = gps_msg.location.longitude;
+    rec->sealevel_alt = gps_msg.location.sealevel_alt;
+    rec->vel_x = gps_msg.location.ecef_vel.x;
+    rec->vel_y = gps_msg.location.ecef_vel.y;
+    rec->vel_z = gps_msg.location.ecef_vel.z;
+  }
+}
+
 // periodic trigger
 uint8_t command_trigger_gps(tCMDInterface cmd_interface) {
-  if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
+  if (cmd_interface == CMD_IF_SD) {  // ride log, always binary
+    tCmdGps rec;
+    command_util_get_bin_gps(&rec);
+    return logger_record(CMD_GPS, &rec, sizeof(rec), command_util_get_date(),
+                         command_util_get_minute()) == FAT32_OK;
+  } else if (cmd_interface == CMD_IF_IC && g_bin_framing) {  // binary framed
+    tCmdGps rec;
+    if (g_out_status == BUSY) return 0;
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) < CMD_BIN_SIZE(sizeof(rec))) {
+      return 0;
+    }
+    g_out_status = BUSY;
+    command_util_get_bin_gps(&rec);
+    set_mcu_out_frame(CMD_GPS, &rec, sizeof(rec));
+  } else if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
     if (g_out_status == BUSY) return 0;
     if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_GPS_SIZE) {
       g_out_status = BUSY;
@@ -490,7 +766,13 @@ uint8_t command_trigger_stats(tCMDInterface cmd_interface) {
 
 // give sound command to MCU1's buzzer
 uint8_t command_trigger_sound(uint8_t status, tCMDInterface cmd_interface) {
-  if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
+  if (cmd_interface == CMD_IF_IC && g_bin_framing) {  // binary framed
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) < CMD_BIN_SIZE(1)) {
+      return 0;
+    }
+    g_out_status = BUSY;
+    set_mcu_out_frame(CMD_SOUND, &status, 1);
+  } else if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
     if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_SOUND_SIZE) {
       g_out_status = BUSY;
       char tmp_sound_status[4];
@@ -517,6 +799,28 @@ uint8_t command_trigger_sound(uint8_t status, tCMDInterface cmd_interface) {
   }
   return 1;
 }
+
+// ask mcu1 to switch to binary framing, mcu1 answers with its capability
+// the negotiation itself is always ascii framed
+uint8_t command_trigger_framing(tCMDInterface cmd_interface) {
+  if (cmd_interface == CMD_IF_IC) {  // mcu intercommunication
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_FRAMING_SIZE) {
+      set_mcu_out_byte(CMD_START);
+      set_mcu_out_byte(CMD_FRAMING);
+#ifdef CMD_BINARY
+      set_mcu_out_byte(CMD_FRAMING_BINARY);
+#else
+      set_mcu_out_byte(CMD_FRAMING_ASCII);
+#endif
+      set_mcu_out_byte(CMD_STOP);
+    } else {
+      return 0;
+    }
+  } else if (cmd_interface == CMD_IF_DEBUG) {  // debug over uart1
+    uart_put_str_1("TRACE_FRAMING\r\n");
+  }
+  return 1;
+}
 #endif
 
 #ifdef EASYRIDER_MCU1
@@ -525,129 +829,25 @@ uint8_t command_trigger_sound(uint8_t status, tCMDInterface cmd_interface) {
 // idx:      [0123456789012345678901234567]
 // xyz accelerometer, current, voltage, temperature, rpm and gear
 void command_stats_handler() {
-  char tmp_stat[6];
-  g_out_payload[0] = '\0';
-  memset((void*)g_out_payload, 0x30,
-         CMD_PAYLOAD_SIZE);  // prefill with ascii 0's
-  // xxx x-accelerometer
-  utoa(g_accelx, tmp_stat, 10);
-  if (g_accelx < 10) {
-    g_out_payload[2] = tmp_stat[0];
-  } else if (g_accelx < 100) {
-    g_out_payload[1] = tmp_stat[0];
-    g_out_payload[2] = tmp_stat[1];
-  } else {
-    g_out_payload[0] = tmp_stat[0];
-    g_out_payload[1] = tmp_stat[1];
-    g_out_payload[2] = tmp_stat[2];
-  }
-  // yyy x-accelerometer
-  utoa(g_accely, tmp_stat, 10);
-  if (g_accely < 10) {
-    g_out_payload[5] = tmp_stat[0];
-  } else if (g_accely < 100) {
-    g_out_payload[3] = tmp_stat[0];
-    g_out_payload[4] = tmp_stat[1];
-  } else {
-    g_out_payload[3] = tmp_stat[0];
-    g_out_payload[4] = tmp_stat[1];
-    g_out_payload[5] = tmp_stat[2];
-  }
-  // zzz x-accelerometer
-  utoa(g_accelz, tmp_stat, 10);
-  if (g_accelz < 10) {
-    g_out_payload[8] = tmp_stat[0];
-  } else if (g_accelz < 100) {
-    g_out_payload[6] = tmp_stat[0];
-    g_out_payload[7] = tmp_stat[1];
-  } else {
-    g_out_payload[6] = tmp_stat[0];
-    g_out_payload[7] = tmp_stat[1];
-    g_out_payload[8] = tmp_stat[2];
-  }
-  // CCCC current consumption in mA
-  utoa(g_current, tmp_stat, 10);
-  if (g_current < 10) {
-    g_out_payload[12] = tmp_stat[0];
-  } else if (g_current < 100) {
-    g_out_payload[11] = tmp_stat[0];
-    g_out_payload[12] = tmp_stat[1];
-  } else if (g_current < 1000) {
-    g_out_payload[10] = tmp_stat[0];
-    g_out_payload[11] = tmp_stat[1];
-    g_out_payload[12] = tmp_stat[2];
-  } else {
-    g_out_payload[9] = tmp_stat[0];
-    g_out_payload[10] = tmp_stat[1];
-    g_out_payload[11] = tmp_stat[2];
-    g_out_payload[12] = tmp_stat[3];
-  }
-  // VVVVV voltage in mV
-  utoa(g_voltage, tmp_stat, 10);
-  if (g_voltage < 10) {
-    g_out_payload[17] = tmp_stat[0];
-  } else if (g_voltage < 100) {
-    g_out_payload[16] = tmp_stat[0];
-    g_out_payload[17] = tmp_stat[1];
-  } else if (g_voltage < 1000) {
-    g_out_payload[15] = tmp_stat[0];
-    g_out_payload[16] = tmp_stat[1];
-    g_out_payload[17] = tmp_stat[2];
-  } else if (g_voltage < 10000) {
-    g_out_payload[14] = tmp_stat[0];
-    g_out_payload[15] = tmp_stat[1];
-    g_out_payload[16] = tmp_stat[2];
-    g_out_payload[17] = tmp_stat[3];
-  } else {
-    g_out_payload[13] = tmp_stat[0];
-    g_out_payload[14] = tmp_stat[1];
-    g_out_payload[15] = tmp_stat[2];
-    g_out_payload[16] = tmp_stat[3];
-    g_out_payload[17] = tmp_stat[4];
-  }
-  // TTTT temperature in mCelsius
-  utoa(g_temperature, tmp_stat, 10);
-  if (g_temperature < 10) {
-    g_out_payload[21] = tmp_stat[0];
-  } else if (g_temperature < 100) {
-    g_out_payload[20] = tmp_stat[0];
-    g_out_payload[21] = tmp_stat[1];
-  } else if (g_temperature < 1000) {
-    g_out_payload[19] = tmp_stat[0];
-    g_out_payload[20] = tmp_stat[1];
-    g_out_payload[21] = tmp_stat[2];
-  } else {
-    g_out_payload[18] = tmp_stat[0];
-    g_out_payload[19] = tmp_stat[1];
-    g_out_payload[20] = tmp_stat[2];
-    g_out_payload[21] = tmp_stat[3];
-  }
-  // RRRRR rpm
-  utoa(g_rpm, tmp_stat, 10);
-  if (g_rpm < 10) {
-    g_out_payload[26] = tmp_stat[0];
-  } else if (g_rpm < 100) {
-    g_out_payload[25] = tmp_stat[0];
-    g_out_payload[26] = tmp_stat[1];
-  } else if (g_rpm < 1000) {
-    g_out_payload[24] = tmp_stat[0];
-    g_out_payload[25] = tmp_stat[1];
-    g_out_payload[26] = tmp_stat[2];
-  } else if (g_rpm < 10000) {
-    g_out_payload[23] = tmp_stat[0];
-    g_out_payload[24] = tmp_stat[1];
-    g_out_payload[25] = tmp_stat[2];
-    g_out_payload[26] = tmp_stat[3];
-  } else {
-    g_out_payload[22] = tmp_stat[0];
-    g_out_payload[23] = tmp_stat[1];
-    g_out_payload[24] = tmp_stat[2];
-    g_out_payload[25] = tmp_stat[3];
-    g_out_payload[26] = tmp_stat[4];
-  }
-  // G gear selection
-  utoa(g_gear, tmp_stat, 10);
-  g_out_payload[27] = tmp_stat[0];
+  uint16_t stats[STATS_FIELDS] = {g_accelx, g_accely, g_accelz, g_current,
+                                  g_voltage, g_temperature, g_rpm, g_gear};
+  if (g_bin_framing) {  // binary framed, no ascii conversions needed
+    tCmdStats rec;
+    rec.accelx = g_accelx;
+    rec.accely = g_accely;
+    rec.accelz = g_accelz;
+    rec.current = g_current;
+    rec.voltage = g_voltage;
+    rec.temperature = g_temperature;
+    rec.rpm = g_rpm;
+    rec.gear = g_gear;
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_BIN_SIZE(sizeof(rec))) {
+      set_mcu_out_frame(CMD_STATS, &rec, sizeof(rec));
+    }
+    return;
+  }
+  // [xxxyyyzzzCCCCVVVVVTTTTRRRRRG]
+  fixed_ascii_fields(g_out_payload, g_stats_layout, stats, STATS_FIELDS);
   g_out_payload[28] = '\0';
   // CMD_STATS command
   if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_STATS_SIZE) {
@@ -662,9 +862,19 @@ void command_stats_handler() {
   }
 }
 
-// incoming data from mcu2, passed directly to wifi
+// incoming data from mcu2, passed directly to wifi while a client listens
 void command_data_handler() {
-  wifi_dispatch(g_in_payload);
+  if (!wifi_connected()) {
+    return;
+  }
+  if (g_in_binary) {  // forward binary records as-is
+    wifi_dispatch_record_bin(g_in_payload, g_in_length);
+#ifdef EASY_TRACE
+    uart_put_str_1("WIFI_DISPATCH CMD_DATA: binary\r\n");
+#endif
+    return;
+  }
+  wifi_dispatch_record(g_in_payload);
 #ifdef EASY_TRACE
   uart_put_str_1("WIFI_DISPATCH CMD_DATA: ");
   uart_put_str_1(g_in_payload);
@@ -672,9 +882,19 @@ void command_data_handler() {
 #endif
 }
 
-// incoming data from mcu2, passed directly to wifi
+// incoming data from mcu2, passed directly to wifi while a client listens
 void command_state_handler() {
-  wifi_dispatch(g_in_payload);
+  if (!wifi_connected()) {
+    return;
+  }
+  if (g_in_binary) {  // forward binary records as-is
+    wifi_dispatch_record_bin(g_in_payload, g_in_length);
+#ifdef EASY_TRACE
+    uart_put_str_1("WIFI_DISPATCH CMD_STATE: binary\r\n");
+#endif
+    return;
+  }
+  wifi_dispatch_record(g_in_payload);
 #ifdef EASY_TRACE
   uart_put_str_1("WIFI_DISPATCH CMD_STATE: ");
   uart_put_str_1(g_in_payload);
@@ -682,9 +902,19 @@ void command_state_handler() {
 #endif
 }
 
-// incoming data from mcu2, passed directly to wifi
+// incoming data from mcu2, passed directly to wifi while a client listens
 void command_gps_handler() {
-  wifi_dispatch(g_in_payload);
+  if (!wifi_connected()) {
+    return;
+  }
+  if (g_in_binary) {  // forward binary records as-is
+    wifi_dispatch_record_bin(g_in_payload, g_in_length);
+#ifdef EASY_TRACE
+    uart_put_str_1("WIFI_DISPATCH CMD_GPS: binary\r\n");
+#endif
+    return;
+  }
+  wifi_dispatch_record(g_in_payload);
 #ifdef EASY_TRACE
   uart_put_str_1("WIFI_DISPATCH CMD_GPS: ");
   uart_put_str_1(g_in_payload);
@@ -692,9 +922,59 @@ void command_gps_handler() {
 #endif
 }
 
+// log and settings requests from the app are passed on to mcu2, the frames
+// mcu2 answers with go directly to wifi
+void command_relay_handler(uint8_t cmd, tCMDInterface cmd_interface) {
+  if (cmd_interface == CMD_IF_EXT) {
+    const char* ptr = &g_ext_payload[1];
+    uint8_t len = strlen(ptr);
+    if (g_bin_framing) {
+      if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_BIN_SIZE(len)) {
+        set_mcu_out_frame(cmd, ptr, len);
+      }
+    } else if ((CMD_BUFFER_SIZE - mcu_out_available()) >=
+               len + CMD_CONTROL_SIZE) {
+      set_mcu_out_byte(CMD_START);
+      set_mcu_out_byte(cmd);
+      while (*ptr) {
+        set_mcu_out_byte(*ptr);
+        ptr++;
+      }
+      set_mcu_out_byte(CMD_STOP);
+    }
+    return;
+  }
+  if (cmd == CMD_LOG) {  // a record is owed a credit, an empty frame ends
+    g_log_owed = (g_in_length > 1);
+  }
+  if (g_in_binary) {  // forward binary records as-is
+    wifi_dispatch_bin(g_in_payload, g_in_length);
+    return;
+  }
+  wifi_dispatch(g_in_payload);
+}
+
+// log answers are paced by wifi: mcu2 sends the next record after an empty
+// CMD_LOG frame, which goes out once the tx ring has room for that record.
+// Without a client the records are let through, they're skipped anyway
+void command_log_credit() {
+  // room for CMD_LOG, CMD_CODE and the largest record
+  if (!g_log_owed || (wifi_connected() && !wifi_room(sizeof(tCmdGps) + 2))) {
+    return;
+  }
+  if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_BIN_SIZE(0)) {
+    set_mcu_out_frame(CMD_LOG, NULL, 0);
+    g_log_owed = 0;
+  }
+}
+
 // incoming data from mcu2, trigger a sound
 void command_sound_handler() {
   char status[4];
+  if (g_in_binary) {  // single status byte
+    set_sound(g_in_payload[1]);
+    return;
+  }
   strlcpy(status, &g_in_payload[1], 4);
   set_sound(atoi(status));  // status 0-255
 #ifdef EASY_TRACE
@@ -703,12 +983,51 @@ void command_sound_handler() {
   uart_put_str_1("\r\n");
 #endif
 }
+
+// incoming framing request from mcu2, answer with our own capability
+void command_framing_handler() {
+#ifdef CMD_BINARY
+  g_bin_framing = (g_in_payload[1] == CMD_FRAMING_BINARY);
+#endif
+  if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_FRAMING_SIZE) {
+    set_mcu_out_byte(CMD_START);
+    set_mcu_out_byte(CMD_FRAMING);
+    set_mcu_out_byte(g_bin_framing ? CMD_FRAMING_BINARY : CMD_FRAMING_ASCII);
+    set_mcu_out_byte(CMD_STOP);
+  }
+#ifdef EASY_TRACE
+  uart_put_str_1("DISPATCH CMD_FRAMING: ");
+  uart_put_int_1(g_bin_framing);
+  uart_put_str_1("\r\n");
+#endif
+}
 #endif
 
 #ifdef EASYRIDER_MCU2
 // process incoming stats, apply a timestamp
 // and send it back as a CMD_DATA command
 void command_stats_handler() {
+  if (g_in_binary) {  // binary framed, no ascii conversions needed
+    tCmdData rec;
+    if (g_in_length != sizeof(rec.stats) + 1) return;  // invalid record
+    memcpy((void*)&rec.stats, &g_in_payload[1], sizeof(rec.stats));
+    command_util_get_bin_timestamp(&rec.ts);
+    logger_record(CMD_DATA, &rec, sizeof(rec), command_util_get_date(),
+                  command_util_get_minute());  // ride log, if riding
+    if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_BIN_SIZE(sizeof(rec))) {
+      set_mcu_out_frame(CMD_DATA, &rec, sizeof(rec));
+    }
+    // save some MCU1 stats for further checks
+    g_gear = rec.stats.gear;
+    g_accelx = rec.stats.accelx;
+    g_accely = rec.stats.accely;
+    g_accelz = rec.stats.accelz;
+    return;
+  }
+  if (g_bin_framing) {  // mcu1 fell back to ascii (e.g. it got reset)
+    g_bin_framing = 0;
+    command_trigger_framing(CMD_IF_IC);
+  }
   if ((CMD_BUFFER_SIZE - mcu_out_available()) >= CMD_DATA_SIZE) {
     g_out_payload[0] = '\0';
     command_util_get_timestamp();        // update timestamp
@@ -724,19 +1043,29 @@ void command_stats_handler() {
     }
     set_mcu_out_byte(CMD_STOP);
   }
+  // the ride log keeps binary records, whatever the framing
+  uint16_t stats[STATS_FIELDS];
+  if (!fixed_ascii_parse(&g_in_payload[1], g_stats_layout, stats,
+                         STATS_FIELDS)) {
+    return;  // invalid record
+  }
+  tCmdData rec;
+  rec.stats.accelx = stats[0];
+  rec.stats.accely = stats[1];
+  rec.stats.accelz = stats[2];
+  rec.stats.current = stats[3];
+  rec.stats.voltage = stats[4];
+  rec.stats.temperature = stats[5];
+  rec.stats.rpm = stats[6];
+  rec.stats.gear = stats[7];
+  command_util_get_bin_timestamp(&rec.ts);
+  logger_record(CMD_DATA, &rec, sizeof(rec), command_util_get_date(),
+                command_util_get_minute());  // ride log, if riding
   // save some MCU1 stats for further checks
-  char l_gear[2];
-  char l_accelx[4];
-  char l_accely[4];
-  char l_accelz[4];
-  strlcpy(l_gear, &g_in_payload[28], 2);
-  strlcpy(l_accelx, &g_in_payload[1], 4);
-  strlcpy(l_accely, &g_in_payload[4], 4);
-  strlcpy(l_accelz, &g_in_payload[7], 4);
-  g_gear = atoi(l_gear);
-  g_accelx = atoi(l_accelx);
-  g_accely = atoi(l_accely);
-  g_accelz = atoi(l_accelz);
+  g_gear = rec.stats.gear;
+  g_accelx = rec.stats.accelx;
+  g_accely = rec.stats.accely;
+  g_accelz = rec.stats.accelz;
 #ifdef EASY_TRACE
   uart_put_str_1("g_gear: ");
   uart_put_int_1(g_gear);
@@ -753,77 +1082,207 @@ void command_stats_handler() {
 #endif
 }
 
-/*command_util_get_timestamp(){{{*/
-// creates the ascii representation of the timestamp
-// 16 parts: [Dddmmyyhhmmssmmm]
-// idx:      [0123456789012345]
-void command_util_get_timestamp() {
-  char tmp_ts[4];
-  memset((void*)g_timestamp, 0x30, TS_SIZE);  // prefill with 0's
-  // weekday 1-7
-  utoa(g_datetime.weekday, tmp_ts, 10);
-  g_timestamp[0] = tmp_ts[0];
-  // day of month 1-31
-  utoa(g_datetime.day, tmp_ts, 10);
-  if (g_datetime.day > 9) {
-    g_timestamp[1] = tmp_ts[0];
-    g_timestamp[2] = tmp_ts[1];
-  } else {
-    g_timestamp[2] = tmp_ts[0];
+// opens the ride log on the SD card, number: bootup number for the file name.
+// FAT32_CLOSED when logging is off (SET_SD_LOG), records are skipped then
+uint8_t command_log_start(uint16_t number) {
+  if (!g_settings.sd_log) {
+    return FAT32_CLOSED;
   }
-  // month 1-12
-  utoa(g_datetime.month, tmp_ts, 10);
-  if (g_datetime.month > 9) {
-    g_timestamp[3] = tmp_ts[0];
-    g_timestamp[4] = tmp_ts[1];
-  } else {
-    g_timestamp[4] = tmp_ts[0];
+  return logger_start(
+      command_util_get_date(),
+      FAT32_TIME(g_datetime.hours, g_datetime.minutes, g_datetime.seconds),
+      number);
+}
+
+// closes the ride log, frees the unused part of its reservation and indexes it
+uint8_t command_log_stop() { return logger_stop(); }
+
+// log request from mcu1: [ddMMYYYY] or [ddMMYYYYhhmm], looks the day up in the
+// log index, command_log_process() streams the records back. An empty CMD_LOG
+// during an answer is mcu1's credit for the next record
+void command_log_handler() {
+  uint16_t values[LOG_FIELDS] = {0, 0, 0, 0, 0};
+  if (g_log_request && g_in_length == 1) {
+    g_log_credit = 1;
+    return;
   }
-  // year 0-99
-  utoa(g_datetime.year, tmp_ts, 10);
-  if (g_datetime.year > 9) {
-    g_timestamp[5] = tmp_ts[0];
-    g_timestamp[6] = tmp_ts[1];
-  } else {
-    g_timestamp[6] = tmp_ts[0];
+  g_log_request = 1;
+  g_log_credit = 1;
+  g_log_wait = 0;
+  if (g_in_length >= 9 && g_bin_framing &&
+      fixed_ascii_parse(&g_in_payload[1], g_log_layout, values,
+                        g_in_length >= 13 ? LOG_FIELDS : 3)) {
+    logger_find(FAT32_DATE(values[2], values[1], values[0]),
+                values[3] * 60 + values[4]);
   }
-  // hours 0-23
-  utoa(g_datetime.hours, tmp_ts, 10);
-  if (g_datetime.hours > 9) {
-    g_timestamp[7] = tmp_ts[0];
-    g_timestamp[8] = tmp_ts[1];
-  } else {
-    g_timestamp[8] = tmp_ts[0];
+#ifdef EASY_TRACE
+  uart_put_str_1("CMD_LOG: ");
+  uart_put_int_1(values[0]);
+  uart_put_str_1("-");
+  uart_put_int_1(values[1]);
+  uart_put_str_1("-");
+  uart_put_int_1(values[2]);
+  uart_put_str_1("\r\n");
+#endif
+}
+
+// answers a log request, one record per credit from mcu1 whenever the out
+// buffer has room left next to the periodic records: CMD_LOG frames with the
+// CMD_CODE and PAYLOAD of a logged record, an empty CMD_LOG frame ends the
+// answer. Records are binary, without binary framing the answer is empty
+void command_log_process() {
+  static uint16_t ms;  // millisecond mcu1 was polled last
+  const uint8_t* rec;
+  uint8_t length;
+  if (!g_log_request) {
+    return;
   }
-  // mins 0-59
-  utoa(g_datetime.minutes, tmp_ts, 10);
-  if (g_datetime.minutes > 9) {
-    g_timestamp[9] = tmp_ts[0];
-    g_timestamp[10] = tmp_ts[1];
-  } else {
-    g_timestamp[10] = tmp_ts[0];
+  if (!g_log_credit) {
+    // the slave only talks when clocked: poll it every ms for the credit, a
+    // mcu1 that doesn't send one gets the next record after the timeout
+    if (ms != g_datetime.milliseconds) {
+      ms = g_datetime.milliseconds;
+      if (++g_log_wait >= LOG_CREDIT_TIMEOUT) {
+        g_log_credit = 1;
+      } else if (g_spi_state == SPI_OFF) {
+        spi_burst_start();
+      }
+    }
+    return;
   }
-  // secs 0-59
-  utoa(g_datetime.seconds, tmp_ts, 10);
-  if (g_datetime.seconds > 9) {
-    g_timestamp[11] = tmp_ts[0];
-    g_timestamp[12] = tmp_ts[1];
-  } else {
-    g_timestamp[12] = tmp_ts[0];
-  }
-  // ms 0-999
-  utoa(g_datetime.milliseconds, tmp_ts, 10);
-  if (g_datetime.milliseconds > 99) {
-    g_timestamp[13] = tmp_ts[0];
-    g_timestamp[14] = tmp_ts[1];
-    g_timestamp[15] = tmp_ts[2];
-  } else if (g_datetime.milliseconds > 9) {
-    g_timestamp[14] = tmp_ts[0];
-    g_timestamp[15] = tmp_ts[1];
+  if ((CMD_BUFFER_SIZE - mcu_out_available()) <
+      CMD_BIN_SIZE(LOGGER_RECORD_SIZE) + CMD_BIN_SIZE(sizeof(tCmdGps))) {
+    return;
+  }
+  length = g_bin_framing ? logger_next(&rec) : 0;
+  if (length) {
+    set_mcu_out_frame(CMD_LOG, rec, length);
+    g_log_credit = 0;
+    g_log_wait = 0;
+    return;
+  }
+  g_log_request = 0;
+  if (g_bin_framing) {
+    set_mcu_out_frame(CMD_LOG, NULL, 0);
   } else {
-    g_timestamp[15] = tmp_ts[0];
+    set_mcu_out_byte(CMD_START);
+    set_mcu_out_byte(CMD_LOG);
+    set_mcu_out_byte(CMD_STOP);
   }
-  // terminate
-  g_timestamp[TS_SIZE - 1] = '\0';
+}
+
+// settings request from mcu1: empty to fetch the settings, or one or more
+// [ffvvvvv] pairs of setting id and new value. New values take effect right
+// away and are stored in a single EEPROM write, invalid pairs are skipped.
+// command_settings_process() answers with all settings
+void command_settings_handler() {
+  uint16_t values[2];
+  uint8_t i;
+  for (i = 1; i + SETTINGS_PAIR <= g_in_length; i += SETTINGS_PAIR) {
+    if (fixed_ascii_parse(&g_in_payload[i], g_settings_pair, values, 2)) {
+      set_setting(&g_settings, values[0], values[1]);
+    }
+  }
+  update_settings(&g_settings);
+  g_settings_request = 1;
+#ifdef EASY_TRACE
+  uart_put_str_1("CMD_SETTINGS: ");
+  uart_put_int_1((g_in_length - 1) / SETTINGS_PAIR);
+  uart_put_str_1("\r\n");
+#endif
+}
+
+// answers a settings request with the values of all runtime settings, ordered
+// by setting id: 16 bit words when binary framed, otherwise 5 digits each
+void command_settings_process() {
+  uint16_t values[SET_FIELDS];
+  char ascii[5 * SET_FIELDS];
+  uint8_t i;
+  if (!g_settings_request ||
+      (CMD_BUFFER_SIZE - mcu_out_available()) <
+          (g_bin_framing ? CMD_BIN_SIZE(sizeof(values)) : CMD_SETTINGS_SIZE)) {
+    return;
+  }
+  g_settings_request = 0;
+  for (i = 0; i < SET_FIELDS; i++) {
+    values[i] = get_setting(&g_settings, i);
+  }
+  if (g_bin_framing) {
+    set_mcu_out_frame(CMD_SETTINGS, values, sizeof(values));
+    return;
+  }
+  set_mcu_out_byte(CMD_START);
+  set_mcu_out_byte(CMD_SETTINGS);
+  for (i = 0; i < SET_FIELDS; i++) {
+    fixed_ascii_uint16(&ascii[5 * i], values[i], 5);
+  }
+  for (i = 0; i < sizeof(ascii); i++) {
+    set_mcu_out_byte(ascii[i]);
+  }
+  set_mcu_out_byte(CMD_STOP);
+}
+
+// RTC date as FAT32_DATE, for the log file name and index
+uint16_t command_util_get_date() {
+  return FAT32_DATE(2000 + g_datetime.year, g_datetime.month, g_datetime.day);
+}
+
+// minute of the day, for the log index
+uint16_t command_util_get_minute() {
+  return g_datetime.hours * 60 + g_datetime.minutes;
+}
+
+// framing answer of mcu1, switch to binary when both sides are capable
+void command_framing_handler() {
+#ifdef CMD_BINARY
+  g_bin_framing = (g_in_payload[1] == CMD_FRAMING_BINARY);
+#endif
+#ifdef EASY_TRACE
+  uart_put_str_1("CMD_FRAMING: ");
+  uart_put_int_1(g_bin_framing);
+  uart_put_str_1("\r\n");
+#endif
+}
+
+// fills the binary representation of the timestamp: epoch milliseconds
+void command_util_get_bin_timestamp(tCmdTimestamp* ts) {
+  ts->epoch_ms = command_util_get_epoch_ms();
+}
+
+/*command_util_get_timestamp(){{{*/
+// creates the ascii representation of the timestamp
+// 16 parts: [Dddmmyyhhmmssmmm]
+// idx:      [0123456789012345]
+// the string is cached, only the digits of changed fields get re-rendered:
+// mostly just the mmm digits, the ss digits once per RTC second, etc.
+void command_util_get_timestamp() {
+  uint16_t ts[TS_FIELDS] = {
+      g_datetime.weekday, g_datetime.day,     g_datetime.month,
+      g_datetime.year,    g_datetime.hours,   g_datetime.minutes,
+      g_datetime.seconds, g_datetime.milliseconds};
+  fixed_ascii_fields_changed(g_timestamp, g_ts_layout, ts, g_ts_cache,
+                             TS_FIELDS);
 } /*}}}*/
+
+// milliseconds since 1970-01-01 00:00:00 of the current RTC date/time (year
+// 0-99 -> 2000-2099), the date math only runs when a new second is reached
+uint64_t command_util_get_epoch_ms() {
+  uint8_t date[6] = {g_datetime.seconds, g_datetime.minutes, g_datetime.hours,
+                     g_datetime.day,     g_datetime.month,   g_datetime.year};
+  uint16_t ms;
+  if (memcmp(date, g_epoch_date, sizeof(date))) {  // new second (or RTC set)
+    uint32_t days;
+    memcpy(g_epoch_date, date, sizeof(date));
+    // 10957 days from 1970 to 2000, every 4th year since 2000 is a leap year
+    days = 10957UL + 365UL * date[5] + ((date[5] + 3) >> 2) +
+           pgm_read_word(&g_month_days[(date[4] + 11) % 12]) + date[3] - 1;
+    if (!(date[5] & 0x03) && date[4] > 2) days++;  // past feb 29th
+    g_epoch_ms = ((uint64_t)days * 86400UL + date[2] * 3600UL +
+                  date[1] * 60U + date[0]) * 1000U;
+  }
+  cli();  // milliseconds are updated from the TIMER3 interrupt
+  ms = g_datetime.milliseconds;
+  sei();
+  return g_epoch_ms + ms;
+}
 #endif
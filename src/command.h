@@ -20,9 +20,11 @@
 #define COMMAND_H_INCLUDED
 
 #include "ds1307.h"  // RTC lib for ds1307 clock chip
+#include "logger.h"  // ride log on the SD card (mcu2)
+#include "settings.h"  // settings in EEPROM, changeable at runtime (mcu2)
 #include "spi.h"  // SPI bus for mcu intercommunication (mcu1/mcu2) and SD card (mcu2)
-#include "usart_0.h"  // UART0 for Wifly WiFi communication (mcu1) / GPS (mcu2)
-#include "usart_1.h"  // UART1 for shell and debugging (mcu1/mcu2)
+#include "usart.h"  // UART0 for Wifly WiFi communication (mcu1) / GPS (mcu2),
+                    // UART1 for shell and debugging (mcu1/mcu2)
 #include "util.h"     // util functions
 #include "venus.h"    // GPS lib for Venus 638FLPx SkyTraq board
 #include "wifi.h"     // communicating over UART0 <-> WiFi (mcu1)
@@ -42,9 +44,23 @@ typedef enum {
 #define CMD_START 0x01  // start flag of command
 #define CMD_STOP 0x02   // stop flag of command
 #define CMD_NOOP 0x03   // out buffer empty, just send No Operation bytes
+#define CMD_BSTART 0x04  // start flag of a binary framed command
+#define CMD_ESC 0x10     // escape flag inside a binary framed command
+#define CMD_ESC_XOR 0x20  // escaped bytes are xor'ed with this value
+
+// binary framing, negotiated by mcu2 via CMD_FRAMING at startup:
+//
+// Package: CMD_BSTART - LEN - CMD_CODE - PAYLOAD BYTES (LEN-1) - CRC8
+//
+// LEN counts the command byte plus payload bytes, the CRC8 (Dallas/iButton)
+// covers LEN, CMD_CODE and the payload. Every byte after CMD_BSTART that equals
+// CMD_NOOP, CMD_BSTART or CMD_ESC is sent as CMD_ESC followed by the byte
+// xor'ed with CMD_ESC_XOR, since No Operation bytes are dropped by the SPI
+// transceivers and an unescaped CMD_BSTART always restarts the frame.
+// All multi-byte payload fields are fixed-width little-endian.
 
 // command bytes, single letter, to keep into the ascii set
-#define ALL_CMDS "abcdefghijkl"
+#define ALL_CMDS "abcdefghijkln"
 #define CMD_STATE 'a'
 #define CMD_STATS 'b'
 #define CMD_DATA 'c'
@@ -57,8 +73,63 @@ typedef enum {
 #define CMD_PINCODE 'j'
 #define CMD_SOUND 'k'
 #define CMD_MSG 'l'
+#define CMD_FRAMING 'n'
+
+#define CMD_FRAMING_ASCII '0'   // CMD_FRAMING payload: ascii framing only
+#define CMD_FRAMING_BINARY '1'  // CMD_FRAMING payload: binary framing capable
+
+typedef enum {
+  IDLE,
+  BUSY,
+  START,
+  CMD,
+  BIN_LEN,   // binary frame: waiting for the length byte
+  BIN_DATA,  // binary frame: filling command byte and payload
+  BIN_CRC    // binary frame: waiting for the checksum byte
+} t_cmd_status;
+
+// binary payload records, also used as-is by the app when binary framing is on
+// timestamp: 8 bytes instead of the 16 ascii chars [Dddmmyyhhmmssmmm]
+typedef struct {
+  uint64_t epoch_ms;  // milliseconds since 1970-01-01 00:00:00 (RTC time)
+} tCmdTimestamp;
+
+// CMD_STATS: 15 bytes instead of 28 ascii chars
+typedef struct {
+  uint16_t accelx;       // X-axis voltage of accelerometer
+  uint16_t accely;       // Y-axis voltage of accelerometer
+  uint16_t accelz;       // Z-axis voltage of accelerometer
+  uint16_t current;      // board current consumption in mA
+  uint16_t voltage;      // battery voltage in mV
+  uint16_t temperature;  // board ambient temperature in mCelsius
+  uint16_t rpm;          // RPM of engine
+  uint8_t gear;          // current gear or neutral
+} tCmdStats;
+
+// CMD_STATE: 10 bytes instead of 33 ascii chars
+typedef struct {
+  tCmdTimestamp ts;
+  uint16_t state;
+} tCmdState;
+
+// CMD_DATA: 23 bytes instead of 44 ascii chars
+typedef struct {
+  tCmdTimestamp ts;
+  tCmdStats stats;
+} tCmdData;
 
-typedef enum { IDLE, BUSY, START, CMD } t_cmd_status;
+// CMD_GPS: 34 bytes instead of up to 91 ascii chars
+typedef struct {
+  tCmdTimestamp ts;
+  uint8_t fix;            // fix mode: 0 = no fix, 1,2,3 = 2D,3D,3D+DGPS
+  uint8_t sv_count;       // # of satellites in view
+  int32_t latitude;       // latitude coors, N > 0, S < 0
+  int32_t longitude;      // longitude coors, E > 0, W < 0
+  uint32_t sealevel_alt;  // height above sea level
+  int32_t vel_x;          // ECEF x,y,z velocities
+  int32_t vel_y;
+  int32_t vel_z;
+} tCmdGps;
 
 void command_init(void);
 void command_process(void);
@@ -68,7 +139,13 @@ uint8_t command_trigger_stats(tCMDInterface cmd_interface);
 uint8_t command_trigger_state(tCMDInterface cmd_interface);
 uint8_t command_trigger_sound(uint8_t status, tCMDInterface cmd_interface);
 uint8_t command_trigger_gps(tCMDInterface cmd_interface);
+uint8_t command_trigger_framing(tCMDInterface cmd_interface);
+uint8_t command_log_start(uint16_t number);
+uint8_t command_log_stop(void);
+uint16_t command_spi_throughput(void);
 void command_util_get_timestamp(void);
+uint64_t command_util_get_epoch_ms(void);
+void command_util_get_bin_timestamp(tCmdTimestamp *ts);
 #endif
 #ifdef EASYRIDER_MCU1
 void command_dispatch(const char *data);
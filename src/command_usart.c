@@ -33,15 +33,15 @@ static uint8_t g_command_status;
 void command_usart_input(uint8_t event, char *cmd) {
   uint8_t status, current;
   if (event == 0) {
-    if (uart_available()) { // data ready
-      current = uart_get();
+    if (uart_available_1()) { // data ready
+      current = uart_get_1();
       status = command_usart_parse(&current);
       if (status == CHAR_NORMAL) {
         if (g_buffer_pos >= B_SIZE) { // reset when full
           g_buffer_pos = 0;
         }
         // NEEDED? TODO
-        uart_put(current); // echo valid char back
+        uart_put_1(current); // echo valid char back
 
         g_buffer[g_buffer_pos] = current; // add to buffer
         g_command_status = CMD_IN_PROCESS;
@@ -63,16 +63,16 @@ void command_usart_input(uint8_t event, char *cmd) {
 
 void command_usart_output(const char *cmd, uint8_t flashmem, uint8_t clear) {
   if (clear == 1 || clear == 3) {
-    uart_put_str("\x1B[2J\x0D"); // clear entire screen
+    uart_put_str_1("\x1B[2J\x0D"); // clear entire screen
   }
   if (flashmem) {
-    uart_put_str_P(cmd);
+    uart_put_str_P_1(cmd);
   } else {
-    uart_put_str(cmd);
+    uart_put_str_1(cmd);
   }
   if (clear == 2 || clear == 3) {
-    uart_put_str("\x1B[1B"); // next line
-    uart_put_str("\x1B[2K\x0D"); // clear line and CR
+    uart_put_str_1("\x1B[1B"); // next line
+    uart_put_str_1("\x1B[2K\x0D"); // clear line and CR
   }
 }
 
@@ -1,158 +1,885 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
 
+#include "fat32.h"
 
+#define FAT32_RETRIES 0xFFFF  // blocking block operations, SD_BUSY polls
+#define FAT32_SCAN 256         // FAT sectors searched for a contiguous run
 
+#define FAT32_SECTOR SD_BLOCK_SIZE
+#define FAT32_ENTRIES (FAT32_SECTOR / 4)   // FAT entries per sector
+#define FAT32_DIRENTS (FAT32_SECTOR / 32)  // directory entries per sector
+#define FAT32_MASK 0x0FFFFFFFUL            // upper 4 bits of an entry reserved
+#define FAT32_EOC 0x0FFFFFF8UL             // end of chain and beyond
+#define FAT32_FSINFO_LEAD 0x41615252UL
+#define FAT32_FSINFO_STRUCT 0x61417272UL
+#define FAT32_UNKNOWN 0xFFFFFFFFUL
 
+// boot sector/BPB, partition table and FSInfo offsets
+#define BPB_BYTES_PER_SECTOR 0x0B
+#define BPB_SECTORS_PER_CLUSTER 0x0D
+#define BPB_RESERVED 0x0E
+#define BPB_FATS 0x10
+#define BPB_FAT_SIZE_16 0x16
+#define BPB_TOTAL_SECTORS 0x20
+#define BPB_FAT_SIZE 0x24
+#define BPB_ROOT_CLUSTER 0x2C
+#define BPB_FSINFO 0x30
+#define MBR_TYPE 0x1C2  // first partition
+#define MBR_LBA 0x1C6
+#define FSINFO_STRUCT 484
+#define FSINFO_FREE 488
+#define FSINFO_HINT 492
 
+// directory entry offsets
+#define DIR_ATTR 11
+#define DIR_CREATE_TIME 14
+#define DIR_CREATE_DATE 16
+#define DIR_ACCESS_DATE 18
+#define DIR_CLUSTER_HI 20
+#define DIR_WRITE_TIME 22
+#define DIR_WRITE_DATE 24
+#define DIR_CLUSTER_LO 26
+#define DIR_SIZE 28
+#define DIR_FREE 0xE5
+#define DIR_END 0x00
+#define DIR_SKIP 0x18     // volume label/directory, includes long name parts
+#define DIR_ARCHIVE 0x20
 
+typedef struct {
+  uint32_t fat_lba;     // first sector of the first FAT
+  uint32_t fat_size;    // sectors per FAT
+  uint32_t data_lba;    // sector of cluster 2
+  uint32_t clusters;    // highest cluster number + 1
+  uint32_t root;        // first cluster of the root directory
+  uint32_t free_hint;   // where to start looking for a free cluster
+  uint8_t fats;         // FAT copies
+  uint8_t cluster_size; // sectors per cluster
+  uint8_t status;       // FAT32_* of the volume/open file
+} tFat32;
 
+typedef struct {
+  uint32_t dir_lba;   // directory sector holding the entry
+  uint8_t dir_index;  // entry in that sector
+  uint32_t first;     // first cluster, 0 for an empty file
+  uint32_t cluster;   // cluster of the sector to write, 0 if still unknown
+  uint32_t prev;      // the cluster before it, to link a new one to
+  uint32_t sector;    // file sector to write next
+  uint32_t size;      // bytes accepted by fat32_write()
+  uint32_t dir_size;  // size in the directory entry
+  uint32_t link;      // cluster the reserved run follows, 0 if it's the first
+  uint32_t run_first; // reserved contiguous run, 0 when there's none
+  uint32_t run_last;
+  uint16_t used;      // bytes in the sector being filled
+  uint8_t fill;       // sector buffer being filled
+  uint8_t pending;    // full sector buffers waiting for fat32_process()
+} tFat32File;
 
+static tFat32 g_fat;
+static tFat32File g_file;
+static uint8_t g_sector[2][FAT32_SECTOR];  // file data, double buffered
+static uint8_t g_work[FAT32_SECTOR];       // FAT/directory sector cache
+static uint32_t g_work_lba;
 
-#include "fat32.h"
+static uint16_t get16(const uint8_t *p);
+static uint32_t get32(const uint8_t *p);
+static void put16(uint8_t *p, uint16_t v);
+static void put32(uint8_t *p, uint32_t v);
+static uint8_t block_read(uint32_t lba, uint8_t *buf);
+static uint8_t block_write(uint32_t lba, const uint8_t *buf);
+static uint8_t work_read(uint32_t lba);
+static uint32_t cluster_lba(uint32_t cluster);
+static uint8_t fat_get(uint32_t cluster, uint32_t *next);
+static uint8_t fat_set(uint32_t cluster, uint32_t next);
+static uint8_t fat_fill(uint32_t first, uint32_t last, uint8_t chain);
+static uint8_t fat_alloc(uint32_t prev, uint32_t *cluster);
+static uint8_t fat_find_run(uint32_t *first, uint32_t *count);
+static uint32_t file_next(uint32_t cluster);
+static uint8_t file_cluster(void);
+static uint8_t file_flush(void);
+static uint8_t file_drain(void);
+static uint8_t file_trim(void);
+static uint8_t file_tail(uint32_t last);
+static uint8_t dir_update(uint32_t size);
+static uint8_t dir_find(const uint8_t *name, uint32_t *lba, uint8_t *index,
+                        uint8_t create);
+static void dir_name(uint8_t *dst, const char *name);
 
-uint16_t SWAP16(uint16_t x) { return ((x&0xff)<<8 | (x>>8)); }
-uint32_t SWAP32(uint32_t x) { return ((x&0xff)<<24 | ((x&0xff00)<<8) | ((x&0xff0000)>>8) | ((x&0xff000000)>>24)); }
-
-uint8_t gps_read(uint8_t c);
-void gps_csv(void);
-void process_location(void);
-
-// one time setup to configure GPS Venus chip
-void gps_setup() {
-}
-
-// swap little-endian to big-endian for better number processing
-void process_location() {
-  gps_msg.location.gps_week = SWAP16(gps_msg.location.gps_week);
-  gps_msg.location.gps_tow = SWAP32(gps_msg.location.gps_tow);
-  gps_msg.location.latitude = SWAP32(gps_msg.location.latitude);
-  gps_msg.location.longitude = SWAP32(gps_msg.location.longitude);
-  gps_msg.location.ellipsoid_alt = SWAP32(gps_msg.location.ellipsoid_alt);
-  gps_msg.location.sealevel_alt = SWAP32(gps_msg.location.sealevel_alt);
-  gps_msg.location.gdop = SWAP16(gps_msg.location.gdop);
-  gps_msg.location.pdop = SWAP16(gps_msg.location.pdop);
-  gps_msg.location.hdop = SWAP16(gps_msg.location.hdop);
-  gps_msg.location.vdop = SWAP16(gps_msg.location.vdop);
-  gps_msg.location.tdop = SWAP16(gps_msg.location.tdop);
-  gps_msg.location.ecef_coor.x = SWAP32(gps_msg.location.ecef_coor.x);
-  gps_msg.location.ecef_coor.y = SWAP32(gps_msg.location.ecef_coor.y);
-  gps_msg.location.ecef_coor.z = SWAP32(gps_msg.location.ecef_coor.z);
-  gps_msg.location.ecef_vel.x = SWAP32(gps_msg.location.ecef_vel.x);
-  gps_msg.location.ecef_vel.y = SWAP32(gps_msg.location.ecef_vel.y);
-  gps_msg.location.ecef_vel.z = SWAP32(gps_msg.location.ecef_vel.z);
-}
-
-// reads and processes the incoming binary messages byte by byte (from GPS -> mcu via uart)
-uint8_t gps_read(uint8_t c) {
-  static uint8_t state = 0;
-  static uint8_t checksum = 0;
-  static uint8_t payload_idx = 0;
-
-  switch(state) {
-    case 0: // look for fixed first byte 
-      if (c == 0xA0) state++;
-      break;
-    case 1: // look for fixed 2nd byte 
-      if (c == 0xA1) {
-        state++;
-      } else {
-        state = 0; // reset to start state
+// little-endian on-disk fields
+static uint16_t get16(const uint8_t *p) { return p[0] | (uint16_t)p[1] << 8; }
+
+static uint32_t get32(const uint8_t *p) {
+  return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+// blocking block operations for the FAT and directory updates, waiting for
+// the bus and the card
+static uint8_t block_read(uint32_t lba, uint8_t *buf) {
+  uint16_t tries = FAT32_RETRIES;
+  uint8_t status;
+  while ((status = sd_read_block(lba, buf)) == SD_BUSY && --tries)
+    ;
+  return status == SD_OK ? FAT32_OK : FAT32_ERROR;
+}
+
+static uint8_t block_write(uint32_t lba, const uint8_t *buf) {
+  uint16_t tries = FAT32_RETRIES;
+  uint8_t status;
+  while ((status = sd_write_block(lba, buf)) == SD_BUSY && --tries)
+    ;
+  return status == SD_OK ? FAT32_OK : FAT32_ERROR;
+}
+
+// reads a sector into the work cache, writes go through block_write(g_work)
+static uint8_t work_read(uint32_t lba) {
+  if (lba == g_work_lba) {
+    return FAT32_OK;
+  }
+  g_work_lba = FAT32_UNKNOWN;
+  if (block_read(lba, g_work) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  g_work_lba = lba;
+  return FAT32_OK;
+}
+
+static uint32_t cluster_lba(uint32_t cluster) {
+  return g_fat.data_lba + (cluster - 2) * g_fat.cluster_size;
+}
+
+// reads the FAT entry of a cluster
+static uint8_t fat_get(uint32_t cluster, uint32_t *next) {
+  if (work_read(g_fat.fat_lba + cluster / FAT32_ENTRIES) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  *next = get32(&g_work[(cluster % FAT32_ENTRIES) * 4]) & FAT32_MASK;
+  return FAT32_OK;
+}
+
+// updates the FAT entry of a cluster in all FAT copies
+static uint8_t fat_set(uint32_t cluster, uint32_t next) {
+  uint32_t lba = g_fat.fat_lba + cluster / FAT32_ENTRIES;
+  uint8_t *entry = &g_work[(cluster % FAT32_ENTRIES) * 4];
+  uint8_t i;
+  for (i = 0; i < g_fat.fats; i++, lba += g_fat.fat_size) {
+    if (work_read(lba) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+    put32(entry, (get32(entry) & ~FAT32_MASK) | next);
+    if (block_write(lba, g_work) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  }
+  return FAT32_OK;
+}
+
+// sets the FAT entries of a cluster range in all FAT copies, one write per FAT
+// sector: chained to the next cluster (the last one ends the chain) or free
+static uint8_t fat_fill(uint32_t first, uint32_t last, uint8_t chain) {
+  uint32_t lba, end, c;
+  uint8_t *entry;
+  uint8_t i;
+  while (first <= last) {
+    end = first - first % FAT32_ENTRIES + FAT32_ENTRIES - 1;
+    if (end > last) {
+      end = last;
+    }
+    lba = g_fat.fat_lba + first / FAT32_ENTRIES;
+    for (i = 0; i < g_fat.fats; i++, lba += g_fat.fat_size) {
+      if (work_read(lba) != FAT32_OK) {
+        return FAT32_ERROR;
       }
-      break;
-    case 2: // read payload high byte, not used since payload will never exceed 0xFF
-      state++;
-      break;
-    case 3: // read payload low byte
-      gps_msg.length = c;  
-      state++;
-      break;
-    case 4: // read message ID
-      gps_msg.id = checksum = c;
-      payload_idx = 0; 
-      if (--gps_msg.length > 0) {
-        state++; // go to state which reads payload message
-      } else {
-        state = 6; // no message besides msg ID, skip read state
+      for (c = first; c <= end; c++) {
+        entry = &g_work[(c % FAT32_ENTRIES) * 4];
+        put32(entry, (get32(entry) & ~FAT32_MASK) |
+                         (chain ? (c == last ? FAT32_MASK : c + 1) : 0));
       }
-      break;
-    case 5: // read bytes of the payload
-      if (payload_idx < VENUS_MAX_PAYLOAD) {
-        gps_msg.body[payload_idx] = c;
+      if (block_write(lba, g_work) != FAT32_OK) {
+        return FAT32_ERROR;
       }
-      checksum ^= c; // update checksum
-      payload_idx++;
-      if (payload_idx >= gps_msg.length) state++; // done reading msg bytes
+    }
+    first = end + 1;
+  }
+  return FAT32_OK;
+}
+
+// takes a free cluster as end of chain and links prev to it (unless 0)
+static uint8_t fat_alloc(uint32_t prev, uint32_t *cluster) {
+  uint32_t c = g_fat.free_hint;
+  uint32_t n, next;
+  for (n = g_fat.clusters - 2; n; n--, c++) {
+    if (c >= g_fat.clusters) {
+      c = 2;
+    }
+    if (fat_get(c, &next) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+    if (next == 0) {
       break;
-    case 6: // checksum check 
-      if(c == checksum) { 
-        state++; 
-      } else { // checksum failed, go to starting state
-        state = 0; 
-        return VENUS_BADCR; 
+    }
+  }
+  if (!n) {
+    return FAT32_FULL;
+  }
+  if (fat_set(c, FAT32_MASK) != FAT32_OK ||
+      (prev && fat_set(prev, c) != FAT32_OK)) {
+    return FAT32_ERROR;
+  }
+  g_fat.free_hint = c + 1;
+  *cluster = c;
+  return FAT32_OK;
+}
+
+// looks for count free clusters in a row from the free hint on, a limited
+// number of FAT sectors: settles for the longest run seen then
+static uint8_t fat_find_run(uint32_t *first, uint32_t *count) {
+  uint32_t c = g_fat.free_hint;
+  uint32_t n = (uint32_t)FAT32_SCAN * FAT32_ENTRIES;
+  uint32_t start = 0, length = 0, best = 0, next;
+  if (n > g_fat.clusters - 2) {
+    n = g_fat.clusters - 2;
+  }
+  for (; n && best < *count; n--, c++) {
+    if (c >= g_fat.clusters) {  // wrapped, a run doesn't continue at 2
+      c = 2;
+      length = 0;
+    }
+    if (fat_get(c, &next) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+    if (next) {
+      length = 0;
+    } else {
+      if (!length++) {
+        start = c;
       }
+      if (length > best) {
+        best = length;
+        *first = start;
+      }
+    }
+  }
+  if (!best) {
+    return FAT32_FULL;
+  }
+  *count = best;
+  return FAT32_OK;
+}
+
+// the cluster after this one when it's known without the FAT: inside the
+// reserved run, 0 otherwise
+static uint32_t file_next(uint32_t cluster) {
+  if (g_file.run_first) {
+    if (cluster == g_file.link) {
+      return g_file.run_first;
+    }
+    if (cluster >= g_file.run_first && cluster < g_file.run_last) {
+      return cluster + 1;
+    }
+  }
+  return 0;
+}
+
+// makes sure the cluster of the sector to write is known, allocates the next
+// one at a cluster boundary. Blocking, writes the FAT
+static uint8_t file_cluster() {
+  uint32_t cluster;
+  uint8_t status;
+  if (g_file.cluster) {
+    return FAT32_OK;
+  }
+  status = fat_alloc(g_file.prev, &cluster);
+  if (status == FAT32_OK) {
+    g_file.cluster = cluster;
+    if (!g_file.prev) {
+      g_file.first = cluster;
+    }
+  }
+  return status;
+}
+
+// writes the oldest full sector buffer, SD_BUSY when the bus or card isn't
+// available right now
+static uint8_t file_flush() {
+  uint8_t status = file_cluster();
+  if (status != FAT32_OK) {
+    return status;
+  }
+  status = sd_write_stream(
+      cluster_lba(g_file.cluster) + g_file.sector % g_fat.cluster_size,
+      g_sector[(g_file.fill - g_file.pending) & 1]);
+  if (status == SD_OK) {
+    g_file.pending--;
+    if (++g_file.sector % g_fat.cluster_size == 0) {
+      g_file.prev = g_file.cluster;
+      g_file.cluster = file_next(g_file.prev);
+    }
+  }
+  return status;
+}
+
+// writes everything buffered, including the partial sector, and waits for the
+// card to finish
+static uint8_t file_drain() {
+  uint16_t tries = FAT32_RETRIES;
+  uint8_t status = FAT32_OK;
+  while (g_file.pending && tries--) {
+    status = file_flush();
+    if (status != SD_OK && status != SD_BUSY) {
+      g_fat.status = status;
+      return status;
+    }
+  }
+  if (g_file.pending) {
+    return FAT32_BUSY;
+  }
+  if (g_file.used) {  // rewritten once the sector is full
+    status = file_cluster();
+    if (status == FAT32_OK) {
+      status = block_write(cluster_lba(g_file.cluster) +
+                               g_file.sector % g_fat.cluster_size,
+                           g_sector[g_file.fill]);
+    }
+    if (status != FAT32_OK) {
+      g_fat.status = status;
+      return status;
+    }
+  }
+  tries = FAT32_RETRIES;
+  while ((status = sd_sync()) == SD_BUSY && --tries)
+    ;
+  return status == SD_OK ? FAT32_OK : FAT32_ERROR;
+}
+
+// gives the unused part of the reserved run back, the file ends at its last
+// cluster holding data. Only when closing: the file can't grow into it anymore
+static uint8_t file_trim() {
+  uint32_t last = g_file.prev;  // last cluster with data, 0 for none
+  uint32_t first = g_file.run_first;
+  if (!first) {
+    return FAT32_OK;
+  }
+  g_file.run_first = 0;
+  if (g_file.cluster && (g_file.used || g_file.sector % g_fat.cluster_size)) {
+    last = g_file.cluster;
+  } else if (!last) {  // nothing written, an empty file can have a cluster
+    last = g_file.link;
+  }
+  if (last >= first && last <= g_file.run_last) {  // partly used
+    first = last + 1;
+    if (fat_set(last, FAT32_MASK) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  } else if (last == g_file.link) {  // nothing written into the run
+    if (!g_file.link) {
+      g_file.first = 0;
+    } else if (fat_set(g_file.link, FAT32_MASK) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  } else {  // used up, the file continued with allocated clusters
+    return FAT32_OK;
+  }
+  if (first > g_file.run_last) {
+    return FAT32_OK;
+  }
+  if (first < g_fat.free_hint) {
+    g_fat.free_hint = first;
+  }
+  return fat_fill(first, g_file.run_last, 0);
+}
+
+// frees the chain behind the last cluster holding data (0 for none). After a
+// power loss the reserved run is still linked in while the directory entry only
+// has the checkpointed size: without this a new run would be linked to the
+// file's end and the rest of the old one lost for good. Freed run by run, one
+// write per FAT sector
+static uint8_t file_tail(uint32_t last) {
+  uint32_t first = g_file.first;
+  uint32_t end, next;
+  if (last && fat_get(last, &first) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  if (first < 2 || first >= g_fat.clusters) {  // the chain ends with the data
+    return FAT32_OK;
+  }
+  // cut the chain behind the data first, an interrupted free loses nothing
+  if (last) {
+    if (fat_set(last, FAT32_MASK) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  } else {
+    g_file.first = 0;
+    if (dir_update(0) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  }
+  if (g_file.cluster == first) {  // at a cluster boundary, allocated again
+    g_file.cluster = 0;
+  }
+  while (first >= 2 && first < g_fat.clusters) {
+    for (end = first;; end = next) {
+      if (fat_get(end, &next) != FAT32_OK) {
+        return FAT32_ERROR;
+      }
+      if (next != end + 1) {
+        break;
+      }
+    }
+    if (fat_fill(first, end, 0) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+    if (first < g_fat.free_hint) {
+      g_fat.free_hint = first;
+    }
+    first = next;
+  }
+  return FAT32_OK;
+}
+
+// writes the first cluster and the size into the directory entry
+static uint8_t dir_update(uint32_t size) {
+  uint8_t *entry;
+  if (work_read(g_file.dir_lba) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  entry = &g_work[g_file.dir_index * 32];
+  put16(&entry[DIR_CLUSTER_HI], g_file.first >> 16);
+  put16(&entry[DIR_CLUSTER_LO], g_file.first);
+  put32(&entry[DIR_SIZE], size);
+  if (block_write(g_file.dir_lba, g_work) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  g_file.dir_size = size;
+  return FAT32_OK;
+}
+
+// converts "name.ext" into the padded, upper case 8.3 directory name
+static void dir_name(uint8_t *dst, const char *name) {
+  uint8_t i = 0;
+  memset(dst, ' ', 11);
+  for (; *name && i < 11; name++) {
+    if (*name == '.') {
+      i = 8;
+    } else {
+      dst[i++] = (*name >= 'a' && *name <= 'z') ? *name - 'a' + 'A' : *name;
+    }
+  }
+}
+
+// looks up the name in the root directory. Sets lba/index to the entry or to
+// a free one, returns FAT32_OK when found, FAT32_CLOSED when it's free. A full
+// directory gets extended when create is set
+static uint8_t dir_find(const uint8_t *name, uint32_t *lba, uint8_t *index,
+                        uint8_t create) {
+  uint32_t cluster = g_fat.root;
+  uint32_t sector, next;
+  uint8_t *entry;
+  uint8_t s, e, status;
+  *lba = 0;
+  while (1) {
+    for (s = 0; s < g_fat.cluster_size; s++) {
+      sector = cluster_lba(cluster) + s;
+      if (work_read(sector) != FAT32_OK) {
+        return FAT32_ERROR;
+      }
+      for (e = 0; e < FAT32_DIRENTS; e++) {
+        entry = &g_work[e * 32];
+        if (entry[0] == DIR_END || entry[0] == DIR_FREE) {
+          if (!*lba) {
+            *lba = sector;
+            *index = e;
+          }
+          if (entry[0] == DIR_END) {  // nothing in use after this one
+            return FAT32_CLOSED;
+          }
+        } else if (!(entry[DIR_ATTR] & DIR_SKIP) && !memcmp(entry, name, 11)) {
+          *lba = sector;
+          *index = e;
+          return FAT32_OK;
+        }
+      }
+    }
+    if (fat_get(cluster, &next) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+    if (next < 2 || next >= FAT32_EOC) {
       break;
-    case 7:
-      if (c == 0x0d) state++; // first end of msg byte found: CR
-      break;
-    case 8: 
-      state = 0;
-      if (gps_msg.id == VENUS_GPS_LOCATION) { // post-process binary message to a usable format
-        process_location();
-        gps_csv();
+    }
+    cluster = next;
+  }
+  if (*lba || !create) {
+    return FAT32_CLOSED;
+  }
+  // no free entry left, add a cleared cluster to the directory
+  status = fat_alloc(cluster, &next);
+  if (status != FAT32_OK) {
+    return status;
+  }
+  g_work_lba = FAT32_UNKNOWN;
+  memset(g_work, 0, FAT32_SECTOR);
+  sector = cluster_lba(next);
+  for (s = 0; s < g_fat.cluster_size; s++) {
+    if (block_write(sector + s, g_work) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  }
+  *lba = sector;
+  *index = 0;
+  return FAT32_CLOSED;
+}
+
+// initializes the card and mounts the first FAT32 volume, either the first
+// partition or an unpartitioned card
+uint8_t fat32_init() {
+  uint32_t volume = 0;
+  uint32_t next;
+  memset(&g_fat, 0, sizeof(g_fat));
+  memset(&g_file, 0, sizeof(g_file));
+  g_fat.status = FAT32_ERROR;
+  g_work_lba = FAT32_UNKNOWN;
+  if (sd_init() != SD_OK || work_read(0) != FAT32_OK) {
+    return g_fat.status;
+  }
+  if (g_work[0] != 0xEB && g_work[0] != 0xE9) {  // no boot sector: MBR
+    if (g_work[MBR_TYPE] != 0x0B && g_work[MBR_TYPE] != 0x0C) {
+      return g_fat.status;
+    }
+    volume = get32(&g_work[MBR_LBA]);
+    if (work_read(volume) != FAT32_OK) {
+      return g_fat.status;
+    }
+  }
+  if (get16(&g_work[BPB_BYTES_PER_SECTOR]) != FAT32_SECTOR ||
+      get16(&g_work[BPB_FAT_SIZE_16]) != 0 ||  // FAT12/16
+      g_work[BPB_SECTORS_PER_CLUSTER] == 0) {
+    return g_fat.status;
+  }
+  g_fat.cluster_size = g_work[BPB_SECTORS_PER_CLUSTER];
+  g_fat.fats = g_work[BPB_FATS];
+  g_fat.fat_size = get32(&g_work[BPB_FAT_SIZE]);
+  g_fat.fat_lba = volume + get16(&g_work[BPB_RESERVED]);
+  g_fat.data_lba = g_fat.fat_lba + g_fat.fats * g_fat.fat_size;
+  g_fat.clusters = (get32(&g_work[BPB_TOTAL_SECTORS]) + volume -
+                    g_fat.data_lba) / g_fat.cluster_size + 2;
+  if (g_fat.clusters > g_fat.fat_size * FAT32_ENTRIES) {
+    g_fat.clusters = g_fat.fat_size * FAT32_ENTRIES;
+  }
+  g_fat.root = get32(&g_work[BPB_ROOT_CLUSTER]);
+  g_fat.free_hint = 2;
+  // FSInfo: start at the hinted free cluster, the free count isn't kept up to
+  // date so it's marked unknown
+  next = volume + get16(&g_work[BPB_FSINFO]);
+  if (work_read(next) == FAT32_OK && get32(g_work) == FAT32_FSINFO_LEAD &&
+      get32(&g_work[FSINFO_STRUCT]) == FAT32_FSINFO_STRUCT) {
+    if (get32(&g_work[FSINFO_HINT]) >= 2 &&
+        get32(&g_work[FSINFO_HINT]) < g_fat.clusters) {
+      g_fat.free_hint = get32(&g_work[FSINFO_HINT]);
+    }
+    if (get32(&g_work[FSINFO_FREE]) != FAT32_UNKNOWN) {
+      put32(&g_work[FSINFO_FREE], FAT32_UNKNOWN);
+      block_write(next, g_work);
+    }
+  }
+  g_fat.status = FAT32_CLOSED;
+  return g_fat.status;
+}
+
+// opens a file in the root directory for appending, creates it when it doesn't
+// exist. The date/time stamps only go into a new directory entry
+uint8_t fat32_open(const char *name, uint16_t date, uint16_t time) {
+  uint8_t dir[11];
+  uint8_t *entry;
+  uint8_t status, index;
+  uint32_t n, next, lba, last;
+  if (g_fat.status == FAT32_OK) {
+    fat32_close();
+  }
+  if (g_fat.status != FAT32_CLOSED) {
+    return g_fat.status;
+  }
+  memset(&g_file, 0, sizeof(g_file));
+  dir_name(dir, name);
+  status = dir_find(dir, &lba, &index, 1);
+  if (status == FAT32_ERROR || status == FAT32_FULL) {
+    return status;
+  }
+  g_file.dir_lba = lba;
+  g_file.dir_index = index;
+  if (work_read(g_file.dir_lba) != FAT32_OK) {
+    return FAT32_ERROR;
+  }
+  entry = &g_work[g_file.dir_index * 32];
+  if (status == FAT32_CLOSED) {  // new entry
+    memset(entry, 0, 32);
+    memcpy(entry, dir, 11);
+    entry[DIR_ATTR] = DIR_ARCHIVE;
+    put16(&entry[DIR_CREATE_TIME], time);
+    put16(&entry[DIR_CREATE_DATE], date);
+    put16(&entry[DIR_ACCESS_DATE], date);
+    put16(&entry[DIR_WRITE_TIME], time);
+    put16(&entry[DIR_WRITE_DATE], date);
+    if (block_write(g_file.dir_lba, g_work) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  } else {  // append: find the cluster of the last, partial sector
+    g_file.first = (uint32_t)get16(&entry[DIR_CLUSTER_HI]) << 16 |
+                   get16(&entry[DIR_CLUSTER_LO]);
+    g_file.size = get32(&entry[DIR_SIZE]);
+    g_file.dir_size = g_file.size;
+    g_file.sector = g_file.size / FAT32_SECTOR;
+    g_file.used = g_file.size % FAT32_SECTOR;
+    g_file.cluster = g_file.first;
+    for (n = g_file.sector / g_fat.cluster_size; n && g_file.cluster; n--) {
+      g_file.prev = g_file.cluster;
+      if (fat_get(g_file.prev, &next) != FAT32_OK) {
+        return FAT32_ERROR;
       }
-      return (c == 0x0A) ? ( (payload_idx <= VENUS_MAX_PAYLOAD) ? VENUS_OK : VENUS_CLIPPED) : VENUS_INCOMPLETE; 
-    default: 
-      state = 0; 
-      return VENUS_INCOMPLETE;
-  }
-  return VENUS_MORE;
-}
-
-// fills the current relevant GPS data into a command-separated string:
-// fix number
-// satellites number
-// latitude
-// longitude
-// sealevel
-// ECEF x y z velocities
-void gps_csv() {
-  memset((void*)gps_ascii, 0x30, VENUS_MAX_ASCII); // prefill 0's
-  uint8_t idx = 0;
-  utoa(gps_msg.location.fix, &gps_ascii[idx], 10);            // #total chars: 1
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 2
-  utoa(gps_msg.location.sv_count, &gps_ascii[idx], 10);       // #total chars: 34
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 5
-  ltoa(gps_msg.location.latitude, &gps_ascii[idx], 10);       // #total chars: 6789 10 11 12 13 14 15 16
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 17
-  ltoa(gps_msg.location.longitude, &gps_ascii[idx], 10);      // #total chars: 18 19 20 21 22 23 24 25 26 27 28
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 29
-  ultoa(gps_msg.location.sealevel_alt, &gps_ascii[idx], 10);  // #total chars: 30 31 32 33 34 35 36 37 38 39
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 40
-  ltoa(gps_msg.location.ecef_vel.x, &gps_ascii[idx], 10);     // #total chars: 41 42 43 44 45 46 47 48 49 50 51
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 52
-  ltoa(gps_msg.location.ecef_vel.y, &gps_ascii[idx], 10);     // #total chars: 53 54 55 56 57 58 59 60 61 62 63
-  idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 64
-  ltoa(gps_msg.location.ecef_vel.z, &gps_ascii[idx], 10);     // #total chars: 65 66 67 68 69 70 71 72 73 74 75
-}
-
-// main process function externally called
-void gps_process() {
+      g_file.cluster = (next < 2 || next >= FAT32_EOC) ? 0 : next;
+    }
+    if (g_file.used && (!g_file.cluster ||
+        block_read(cluster_lba(g_file.cluster) +
+                       g_file.sector % g_fat.cluster_size,
+                   g_sector[0]) != FAT32_OK)) {
+      return FAT32_ERROR;
+    }
+    // the last cluster holding data: the partial one, or the one before
+    last = (g_file.used || g_file.sector % g_fat.cluster_size) && g_file.cluster
+              ? g_file.cluster
+              : g_file.prev;
+    if (file_tail(last) != FAT32_OK) {
+      return FAT32_ERROR;
+    }
+  }
+  g_fat.status = FAT32_OK;
+  return g_fat.status;
+}
+
+// appends data to the open file, all or nothing: FAT32_BUSY when it doesn't
+// fit in the sector buffers yet
+uint8_t fat32_write(const void *data, uint16_t length) {
+  const uint8_t *src = data;
+  uint16_t n;
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  if (length > (2 - g_file.pending) * FAT32_SECTOR - g_file.used) {
+    return FAT32_BUSY;
+  }
+  g_file.size += length;
+  while (length) {
+    n = FAT32_SECTOR - g_file.used;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&g_sector[g_file.fill][g_file.used], src, n);
+    src += n;
+    length -= n;
+    g_file.used += n;
+    if (g_file.used == FAT32_SECTOR) {  // full, queue it for the card
+      g_file.pending++;
+      g_file.fill ^= 1;
+      g_file.used = 0;
+    }
+  }
+  return FAT32_OK;
+}
+
+// main loop step: writes one full sector buffer when the bus is free
+void fat32_process() {
+  uint8_t status;
+  if (g_fat.status != FAT32_OK || !g_file.pending) {
+    return;
+  }
+  status = file_flush();
+  if (status != SD_OK && status != SD_BUSY) {
+    g_fat.status = status;  // stop writing, FAT32_FULL or FAT32_ERROR
+  }
+}
+
+// writes everything buffered, including the partial sector, and updates the
+// directory entry. Blocking
+uint8_t fat32_sync() {
   uint8_t status;
-  if (uart_available_0()) {
-    status = gps_read(uart_get_0());
-    if (status == VENUS_OK) { // complete message received
-      gps_status++;
-      if (!gps_status) gps_status = 1;
-#ifdef EASY_TRACE
-      uart_put_str_1("VENUS_OK\r\n");
-#endif
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  status = file_drain();
+  return status == FAT32_OK ? dir_update(g_file.size) : status;
+}
+
+// records the sectors written so far in the directory entry, the partial
+// sector isn't written: it only costs a directory sector write, no FAT or data
+// writes. Use it every so many sectors to limit what a power loss takes
+uint8_t fat32_checkpoint() {
+  uint32_t size = g_file.sector * FAT32_SECTOR;
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  return size > g_file.dir_size ? dir_update(size) : FAT32_OK;
+}
+
+// reserves one contiguous cluster run for the next size bytes of the open file,
+// in one FAT update. The sectors in the run are written as one multi-block
+// stream without FAT lookups or allocations in between. Until the file is
+// closed the chain can be longer than the size in the directory entry: after a
+// power loss a disk check reports those clusters as lost, until fat32_open()
+// appends to the file again and frees them
+uint8_t fat32_reserve(uint32_t size) {
+  uint32_t bytes = (uint32_t)g_fat.cluster_size * FAT32_SECTOR;
+  uint32_t count = (size + bytes - 1) / bytes;
+  uint32_t first;
+  uint8_t status;
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  if (g_file.run_first || !count) {  // one run per open
+    return FAT32_OK;
+  }
+  status = fat_find_run(&first, &count);
+  if (status != FAT32_OK) {
+    return status;
+  }
+  // the current cluster is always the end of the chain, the run follows it
+  g_file.link = g_file.cluster ? g_file.cluster : g_file.prev;
+  if (fat_fill(first, first + count - 1, 1) != FAT32_OK ||
+      (g_file.link && fat_set(g_file.link, first) != FAT32_OK)) {
+    return FAT32_ERROR;
+  }
+  if (!g_file.link) {
+    g_file.first = first;
+  }
+  if (!g_file.cluster) {
+    g_file.cluster = first;
+  }
+  g_file.run_first = first;
+  g_file.run_last = first + count - 1;
+  g_fat.free_hint = g_file.run_last + 1;
+  return FAT32_OK;
+}
+
+// pads the sector being filled with zeros, the next write starts a new sector
+uint8_t fat32_align() {
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  if (g_file.used) {
+    memset(&g_sector[g_file.fill][g_file.used], 0,
+           FAT32_SECTOR - g_file.used);
+    g_file.size += FAT32_SECTOR - g_file.used;
+    g_file.pending++;
+    g_file.fill ^= 1;
+    g_file.used = 0;
+  }
+  return FAT32_OK;
+}
+
+// bytes written to the open file so far
+uint32_t fat32_size() { return g_file.size; }
+
+// looks up a file in the root directory for reading, FAT32_CLOSED when it
+// doesn't exist. Reading works next to the file open for writing
+uint8_t fat32_find(const char *name, tFat32Reader *reader) {
+  uint8_t dir[11];
+  uint8_t *entry;
+  uint8_t status, index;
+  uint32_t lba;
+  if (g_fat.status == FAT32_ERROR) {
+    return g_fat.status;
+  }
+  dir_name(dir, name);
+  status = dir_find(dir, &lba, &index, 0);
+  if (status != FAT32_OK) {
+    return status;
+  }
+  entry = &g_work[index * 32];
+  reader->first = (uint32_t)get16(&entry[DIR_CLUSTER_HI]) << 16 |
+                  get16(&entry[DIR_CLUSTER_LO]);
+  reader->size = get32(&entry[DIR_SIZE]);
+  reader->cluster = reader->first;
+  reader->index = 0;
+  return FAT32_OK;
+}
+
+// reads a sector of a file found with fat32_find(), FAT32_CLOSED past its end.
+// Going forward only follows the chain from the last cluster read. Blocking
+uint8_t fat32_read(tFat32Reader *reader, uint32_t sector, uint8_t *buf) {
+  uint32_t index = sector / g_fat.cluster_size;
+  uint32_t next;
+  if (g_fat.status == FAT32_ERROR) {
+    return g_fat.status;
+  }
+  if (sector >= (reader->size + FAT32_SECTOR - 1) / FAT32_SECTOR) {
+    return FAT32_CLOSED;
+  }
+  if (index < reader->index) {  // backwards, start over
+    reader->cluster = reader->first;
+    reader->index = 0;
+  }
+  for (; reader->index < index; reader->index++) {
+    if (reader->cluster < 2 || reader->cluster >= FAT32_EOC ||  // broken chain
+        fat_get(reader->cluster, &next) != FAT32_OK) {
+      return FAT32_ERROR;
     }
+    reader->cluster = next;
+  }
+  if (reader->cluster < 2 || reader->cluster >= FAT32_EOC) {
+    return FAT32_ERROR;
+  }
+  return block_read(cluster_lba(reader->cluster) +
+                        sector % g_fat.cluster_size,
+                    buf);
+}
+
+// bytes left in the sector being filled
+uint16_t fat32_sector_left() { return FAT32_SECTOR - g_file.used; }
+
+// syncs and closes the open file, the unused part of a reserved run is freed
+uint8_t fat32_close() {
+  uint8_t status;
+  if (g_fat.status != FAT32_OK) {
+    return g_fat.status;
+  }
+  status = file_drain();
+  if (status == FAT32_OK) {
+    status = file_trim();
+  }
+  if (status == FAT32_OK) {
+    status = dir_update(g_file.size);
+  }
+  if (g_fat.status == FAT32_OK) {
+    g_fat.status = FAT32_CLOSED;
   }
+  return status;
 }
 
+// FAT32_OK when a file is open and being written, FAT32_CLOSED when mounted
+// without an open file
+uint8_t fat32_status() { return g_fat.status; }
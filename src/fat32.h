@@ -1,66 +1,70 @@
-
-
-
-
-
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
 #ifndef FAT32_H_INCLUDED
 #define FAT32_H_INCLUDED
 
-#include <stdlib.h>
 #include <stdint.h>
-#include <string.h>
-#include "usart_0.h"   // UART0 for GPS (mcu2)
-#include "usart_1.h"   // UART1 for DEBUG
-
-void gps_process(void);
-void gps_setup(void);
-
-#define _MAX_PAYLOAD  255
-#define VENUS_MAX_ASCII  80
-
-#define VENUS_GPS_LOCATION 0xA8 // GPS message id for binary data output
-
-char gps_ascii[VENUS_MAX_ASCII]; // GPS ascii format, comma-seperated
-uint8_t gps_status; // 0 = no binary message yet or # of msgs received (rolls over at 255 to 1)
-
-typedef struct {
-  int32_t x;
-  int32_t y;
-  int32_t z;
-} xyz32_t;
 
+#include "sd.h"
+
+// FAT32 append-only writer for the SD card (mcu2): one file open at a time in
+// the root directory, 8.3 names. Writes are buffered in two sectors and flushed
+// by fat32_process() one sector per call as a multi-block write, so the main
+// loop and the mcu link keep running. A file can reserve a contiguous cluster
+// run up front, then writing doesn't touch the FAT or the directory until a
+// checkpoint or closing. Files can be read next to the one being written.
+// Only needs the sd.h block interface, a host build can run it against a disk
+// image
+
+// status codes, the first three equal the SD ones
+#define FAT32_OK SD_OK        // done
+#define FAT32_BUSY SD_BUSY    // buffers full, try again after fat32_process()
+#define FAT32_ERROR SD_ERROR  // no card, no FAT32 volume or a card error
+#define FAT32_FULL 3          // no free cluster left on the volume
+#define FAT32_CLOSED 4        // no file open
+
+// a file being read
 typedef struct {
-  uint8_t fix;                                    // fix mode: 0 = no fix, 1,2,3 = 2D,3D,3D+DGPS
-  uint8_t sv_count;                               // # of satellites in view
-  uint16_t gps_week;                              // gps week nr
-  uint32_t gps_tow;                               // gps time of week
-  int32_t latitude;                               // latitude coors, N > 0, S < 0
-  int32_t longitude;                              // longitude coors, E > 0, W < 0
-  uint32_t ellipsoid_alt;                         // height above ellipsoid
-  uint32_t sealevel_alt;                          // height above sea level
-  uint16_t gdop, pdop, hdop, vdop, tdop;          // Geometric, Position, Horiz, Vert, Time dilutions
-  xyz32_t ecef_coor;                              // ECEF x,y,z coordinates
-  xyz32_t ecef_vel;                               // ECEF x,y,z velocities
-} venus_location;
-
-// messages from the GPS unit over uart0
-typedef truct {
-  uint8_t length; // payload length;
-  uint8_t id;     // message id
-  // NOTE: only filling the body array, but this space aligns with the location struct in the same union, so
-  // is directly accessible
-  union {
-    uint8_t body[VENUS_MAX_PAYLOAD]; // raw messages
-    venus_location location; // specifically post-processed location structure
-  };
-} venus_message;
-
-venus_message gps_msg;
-
-#define VENUS_OK           0  // full msg read successful
-#define VENUS_BADCR        1  // checksum failure
-#define VENUS_CLIPPED      2  // message buffer too small, response payload was clipped
-#define VENUS_MORE         3  // more data remaining
-#define VENUS_INCOMPLETE   4  // not a corrent end of msg found, message was incomplete
+  uint32_t first;    // first cluster
+  uint32_t size;     // bytes
+  uint32_t cluster;  // cluster read last
+  uint32_t index;    // its position in the chain
+} tFat32Reader;
+
+// directory entry date/time stamps
+#define FAT32_DATE(y, m, d) \
+  ((uint16_t)(((y) - 1980) << 9) | ((m) << 5) | (d))
+#define FAT32_TIME(h, m, s) ((uint16_t)((h) << 11) | ((m) << 5) | ((s) >> 1))
+
+uint8_t fat32_init(void);
+uint8_t fat32_open(const char *name, uint16_t date, uint16_t time);
+uint8_t fat32_write(const void *data, uint16_t length);
+void fat32_process(void);
+uint8_t fat32_sync(void);
+uint8_t fat32_checkpoint(void);
+uint8_t fat32_reserve(uint32_t size);
+uint8_t fat32_align(void);
+uint16_t fat32_sector_left(void);
+uint32_t fat32_size(void);
+uint8_t fat32_find(const char *name, tFat32Reader *reader);
+uint8_t fat32_read(tFat32Reader *reader, uint32_t sector, uint8_t *buf);
+uint8_t fat32_close(void);
+uint8_t fat32_status(void);
 
 #endif
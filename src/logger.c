@@ -0,0 +1,321 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "logger.h"
+
+#define LOGGER_PER_SECTOR (SD_BLOCK_SIZE / sizeof(tLogIndex))
+
+// log request states
+typedef enum {
+  LOG_IDLE,    // no request
+  LOG_SCAN,    // reading the index for the next ride of the day
+  LOG_STREAM   // returning the records of a ride
+} tLogState;
+
+typedef struct {
+  uint16_t minute;
+  uint16_t sector;
+} tLogMark;
+
+// a log request being served
+typedef struct {
+  tFat32Reader index;  // LOGINDEX.DAT
+  tFat32Reader file;   // log file of the ride being streamed
+  uint32_t entry;      // next index entry
+  uint16_t date;       // day asked for
+  uint16_t minute;     // start of the day asked for
+  uint16_t number;     // ride found in the index
+  uint16_t sector;     // next sector of the ride, or where it starts
+  uint16_t end;        // sector after the ride
+  uint16_t offset;     // next record in g_log_sector
+  uint8_t found;       // a start sector of the ride was found
+  uint8_t loaded;      // g_log_sector holds the index sector of entry
+  tLogState state;
+} tLogQuery;
+
+static uint32_t g_log_bytes;     // written since the last checkpoint
+static uint16_t g_log_dropped;   // records that didn't fit in the buffers
+static uint16_t g_log_date;      // ride being logged
+static uint16_t g_log_time;
+static uint16_t g_log_number;
+static tLogMark g_log_mark[LOGGER_MARKS];  // sparse minute -> sector table
+static uint8_t g_log_marks;
+static uint16_t g_log_interval;  // sectors between marks
+static tLogQuery g_log_query;
+static uint8_t g_log_sector[SD_BLOCK_SIZE];  // index/log sector being read
+
+static void logger_name(char *name, uint16_t date, uint16_t number);
+static void logger_mark(uint16_t minute);
+static uint8_t logger_index(uint16_t end);
+static void logger_scan(void);
+
+// info.txt: ddmmyyyy.[bootup number]
+static void logger_name(char *name, uint16_t date, uint16_t number) {
+  uint16_t fields[4] = {date & 0x1F, (date >> 5) & 0x0F, 19, 80};
+  uint8_t i;
+  fields[3] += date >> 9;  // years since 1980
+  fields[2] += fields[3] / 100;
+  fields[3] %= 100;
+  for (i = 0; i < 4; i++) {
+    name[i * 2] = '0' + fields[i] / 10;
+    name[i * 2 + 1] = '0' + fields[i] % 10;
+  }
+  number %= 1000;
+  name[8] = '.';
+  name[9] = '0' + number / 100;
+  name[10] = '0' + number / 10 % 10;
+  name[11] = '0' + number % 10;
+  name[12] = '\0';
+}
+
+// keeps a mark every g_log_interval sectors for the index, the first record of
+// the ride always gets one. A full table drops every other mark
+static void logger_mark(uint16_t minute) {
+  uint32_t sector = fat32_size() / SD_BLOCK_SIZE;
+  uint8_t i, n;
+  if (sector >= LOGGER_END || (g_log_marks && sector % g_log_interval)) {
+    return;
+  }
+  if (g_log_marks == LOGGER_MARKS) {
+    g_log_interval *= 2;
+    for (i = n = 1; i < LOGGER_MARKS; i++) {
+      if (g_log_mark[i].sector % g_log_interval == 0) {
+        g_log_mark[n++] = g_log_mark[i];
+      }
+    }
+    g_log_marks = n;
+    if (sector % g_log_interval) {
+      return;
+    }
+  }
+  g_log_mark[g_log_marks].minute = minute;
+  g_log_mark[g_log_marks].sector = sector;
+  g_log_marks++;
+}
+
+// appends the marks of the ride just closed and its end to the index
+static uint8_t logger_index(uint16_t end) {
+  tLogIndex entry;
+  uint8_t status, i;
+  if (!g_log_marks) {  // nothing logged
+    return FAT32_OK;
+  }
+  status = fat32_open(LOGGER_INDEX, g_log_date, g_log_time);
+  if (status != FAT32_OK) {
+    return status;
+  }
+  entry.date = g_log_date;
+  entry.number = g_log_number;
+  for (i = 0; i <= g_log_marks && status == FAT32_OK; i++) {
+    if (i < g_log_marks) {
+      entry.minute = g_log_mark[i].minute;
+      entry.sector = g_log_mark[i].sector;
+    } else {
+      entry.minute = LOGGER_END;
+      entry.sector = end;
+    }
+    status = fat32_write(&entry, sizeof(entry));
+  }
+  g_log_marks = 0;
+  return status == FAT32_OK ? fat32_close() : status;
+}
+
+// opens (or appends to) the log file of a ride and reserves its clusters, a
+// reservation that fails only means clusters get allocated one by one
+uint8_t logger_start(uint16_t date, uint16_t time, uint16_t number) {
+  char name[13];
+  uint8_t status;
+  logger_stop();
+  logger_name(name, date, number);
+  status = fat32_open(name, date, time);
+  if (status == FAT32_OK) {
+    fat32_align();  // a file cut off by a power loss ends mid-sector
+    fat32_reserve(LOGGER_RESERVE);
+    g_log_bytes = 0;
+    g_log_date = date;
+    g_log_time = time;
+    g_log_number = number;
+    g_log_marks = 0;
+    g_log_interval = LOGGER_INTERVAL;
+  }
+  return status;
+}
+
+// appends one record, it's dropped when the sector buffers are still full.
+// date (FAT32_DATE) and minute of the day, for the index: a new date ends the
+// day's part of the ride, blocking like logger_start()
+uint8_t logger_record(uint8_t cmd, const void *rec, uint8_t length,
+                      uint16_t date, uint16_t minute) {
+  uint8_t buf[LOGGER_RECORD_SIZE];
+  uint16_t left;
+  uint8_t status = fat32_status();
+  if (status != FAT32_OK) {
+    return status;
+  }
+  if (length + 2 > LOGGER_RECORD_SIZE) {
+    return FAT32_ERROR;
+  }
+  if (date != g_log_date) {  // past midnight
+    status = logger_start(date, FAT32_TIME(minute / 60, minute % 60, 0),
+                          g_log_number);
+    if (status != FAT32_OK) {
+      return status;
+    }
+  }
+  left = fat32_sector_left();
+  if (left < length + 2) {  // doesn't fit in this sector anymore
+    fat32_align();
+    g_log_bytes += left;
+  }
+  buf[0] = length + 1;
+  buf[1] = cmd;
+  memcpy(&buf[2], rec, length);
+  if (fat32_sector_left() == SD_BLOCK_SIZE) {  // starts a sector
+    logger_mark(minute);
+  }
+  status = fat32_write(buf, length + 2);
+  if (status == FAT32_BUSY) {
+    g_log_dropped++;
+    return status;
+  }
+  g_log_bytes += length + 2;
+  if (g_log_bytes >= LOGGER_CHECKPOINT * SD_BLOCK_SIZE) {
+    g_log_bytes = 0;
+    status = fat32_checkpoint();
+  }
+  return status;
+}
+
+// closes the log file at a sector boundary and indexes the ride
+uint8_t logger_stop() {
+  uint8_t status = fat32_status();
+  uint32_t end;
+  if (status != FAT32_OK) {
+    return status;
+  }
+  fat32_align();
+  end = fat32_size() / SD_BLOCK_SIZE;
+  status = fat32_close();
+  if (status != FAT32_OK) {
+    return status;
+  }
+  return logger_index(end < LOGGER_END ? end : LOGGER_END);
+}
+
+// records lost since startup
+uint16_t logger_dropped() { return g_log_dropped; }
+
+// starts a log request: the records of all rides on a day (FAT32_DATE),
+// from the index mark at or before minute on. Rides still being logged aren't
+// in the index yet. FAT32_CLOSED when there's no index
+uint8_t logger_find(uint16_t date, uint16_t minute) {
+  tLogQuery *q = &g_log_query;
+  uint8_t status = fat32_find(LOGGER_INDEX, &q->index);
+  q->state = LOG_IDLE;
+  if (status != FAT32_OK) {
+    return status;
+  }
+  q->entry = 0;
+  q->date = date;
+  q->minute = minute;
+  q->found = 0;
+  q->loaded = 0;
+  q->state = LOG_SCAN;
+  return FAT32_OK;
+}
+
+// reads the index up to the end of the next ride on the requested day, which
+// is streamed then. Its start is the last mark at or before the minute asked
+// for, or its first mark
+static void logger_scan() {
+  tLogQuery *q = &g_log_query;
+  const tLogIndex *entry;
+  char name[13];
+  while (q->state == LOG_SCAN) {
+    if (q->entry >= q->index.size / sizeof(tLogIndex)) {
+      q->state = LOG_IDLE;  // all rides done
+      return;
+    }
+    if (!q->loaded || q->entry % LOGGER_PER_SECTOR == 0) {
+      if (fat32_read(&q->index, q->entry / LOGGER_PER_SECTOR, g_log_sector) !=
+          FAT32_OK) {
+        q->state = LOG_IDLE;
+        return;
+      }
+      q->loaded = 1;
+    }
+    entry = (const tLogIndex *)&g_log_sector[(q->entry % LOGGER_PER_SECTOR) *
+                                             sizeof(tLogIndex)];
+    q->entry++;
+    if (entry->date != q->date) {
+      continue;
+    }
+    if (entry->minute != LOGGER_END) {
+      if (!q->found || entry->minute <= q->minute) {
+        q->found = 1;
+        q->number = entry->number;
+        q->sector = entry->sector;
+      }
+      continue;
+    }
+    q->end = entry->sector;
+    logger_name(name, q->date, q->number);
+    if (q->found && q->sector < q->end &&
+        fat32_find(name, &q->file) == FAT32_OK) {
+      q->offset = SD_BLOCK_SIZE;
+      q->loaded = 0;  // g_log_sector gets the log sectors now
+      q->state = LOG_STREAM;
+    }
+    q->found = 0;
+  }
+}
+
+// next record of the log request: points record at CMD_CODE - PAYLOAD BYTES
+// and returns their length (LEN), 0 when all records have been returned.
+// Reads a sector when it's needed, blocking
+uint8_t logger_next(const uint8_t **record) {
+  tLogQuery *q = &g_log_query;
+  uint8_t length;
+  while (q->state != LOG_IDLE) {
+    if (q->state == LOG_SCAN) {
+      logger_scan();
+    } else if (q->offset >= SD_BLOCK_SIZE || !g_log_sector[q->offset]) {
+      // sector done, the rest is padding
+      if (q->sector >= q->end ||
+          fat32_read(&q->file, q->sector, g_log_sector) != FAT32_OK) {
+        q->state = LOG_SCAN;  // next ride of the day
+      } else {
+        q->sector++;
+        q->offset = 0;
+      }
+    } else {
+      length = g_log_sector[q->offset];
+      if (q->offset + 1 + length > SD_BLOCK_SIZE) {  // corrupt, skip the rest
+        q->offset = SD_BLOCK_SIZE;
+        continue;
+      }
+      *record = &g_log_sector[q->offset + 1];
+      q->offset += 1 + length;
+      return length;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef LOGGER_H_INCLUDED
+#define LOGGER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "fat32.h"
+
+// ride log on the SD card (mcu2): binary command records appended to one file
+// per ride, ddmmyyyy.nnn. Record: LEN - CMD_CODE - PAYLOAD BYTES (LEN-1), the
+// binary frame without start flag and checksum. Records don't cross sectors,
+// the rest of a sector that can't hold the next record is padded with zeros
+// (LEN 0), so every sector starts with a record.
+// LOGINDEX.DAT indexes the rides per day: every ride adds a sparse table of
+// tLogIndex entries when it's closed, (minute, sector) marks spread over the
+// ride and an end entry. A log request reads the index instead of the card.
+// A ride going past midnight is indexed and continued in the file of the new
+// day with the same number, so the minutes of a day's marks don't wrap
+
+#ifndef LOGGER_RESERVE
+#define LOGGER_RESERVE (8UL * 1024 * 1024)  // contiguous per ride, ~3.5 hours
+                                            // of 10Hz CMD_DATA/CMD_GPS records
+#endif
+#ifndef LOGGER_CHECKPOINT
+#define LOGGER_CHECKPOINT 64  // sectors between directory updates (32kB)
+#endif
+#define LOGGER_RECORD_SIZE 64  // largest record, LEN and CMD_CODE included
+#define LOGGER_MARKS 32        // index marks per ride, thinned out when full
+#define LOGGER_INTERVAL 64     // sectors between marks to start with
+#define LOGGER_END 0xFFFF      // index entry minute: end of a ride
+#define LOGGER_INDEX "LOGINDEX.DAT"
+
+// index entry
+typedef struct {
+  uint16_t date;    // FAT32_DATE of the ride
+  uint16_t number;  // log file extension
+  uint16_t minute;  // minute of the day the sector was started, or LOGGER_END
+  uint16_t sector;  // file sector, the end of the ride for LOGGER_END
+} tLogIndex;
+
+uint8_t logger_start(uint16_t date, uint16_t time, uint16_t number);
+uint8_t logger_record(uint8_t cmd, const void *rec, uint8_t length,
+                      uint16_t date, uint16_t minute);
+uint8_t logger_stop(void);
+uint16_t logger_dropped(void);
+uint8_t logger_find(uint16_t date, uint16_t minute);
+uint8_t logger_next(const uint8_t **record);
+
+#endif
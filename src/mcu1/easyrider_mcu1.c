@@ -33,81 +33,99 @@
 #include "sound.h"
 
 // callbacks struct array: main handler functions and pre-guard functions for
-// the queued events
-tCallBack g_callbacks[] = {
-    {EV_READ_BATTERY, check_battery_read, process_battery},
-    {EV_READ_TEMPERATURE, check_temperature_read, process_temperature},
-    {EV_READ_CURRENT, check_board_current, process_board_current},
-    {EV_READ_ACCEL, check_board_accel, process_board_accel},
-    {EV_G1_OFF, check_gear1_off, process_gear1_off},
-    {EV_G2_OFF, check_gear2_off, process_gear2_off},
-    {EV_G3_OFF, check_gear3_off, process_gear3_off},
-    {EV_G4_OFF, check_gear4_off, process_gear4_off},
-    {EV_G1_ON, check_gear1_on, process_gear1_on},
-    {EV_G2_ON, check_gear2_on, process_gear2_on},
-    {EV_G3_ON, check_gear3_on, process_gear3_on},
-    {EV_G4_ON, check_gear4_on, process_gear4_on}};
+// the queued events, indexed by event id and kept in flash
+const tCallBack g_callbacks[EV_COUNT] PROGMEM = {
+    [EV_READ_BATTERY] = {check_battery_read, process_battery},
+    [EV_READ_TEMPERATURE] = {check_temperature_read, process_temperature},
+    [EV_READ_CURRENT] = {check_board_current, process_board_current},
+    [EV_READ_ACCEL] = {check_board_accel, process_board_accel},
+    [EV_G1_OFF] = {check_gear1_off, process_gear1_off},
+    [EV_G2_OFF] = {check_gear2_off, process_gear2_off},
+    [EV_G3_OFF] = {check_gear3_off, process_gear3_off},
+    [EV_G4_OFF] = {check_gear4_off, process_gear4_off},
+    [EV_G1_ON] = {check_gear1_on, process_gear1_on},
+    [EV_G2_ON] = {check_gear2_on, process_gear2_on},
+    [EV_G3_ON] = {check_gear3_on, process_gear3_on},
+    [EV_G4_ON] = {check_gear4_on, process_gear4_on}};
+
+// event priority order of the coalescing event queue, highest first
+static const uint8_t g_event_prio[] PROGMEM = {
+    EV_READ_BATTERY, EV_READ_CURRENT, EV_READ_TEMPERATURE, EV_READ_ACCEL,
+    EV_G1_OFF,       EV_G2_OFF,       EV_G3_OFF,           EV_G4_OFF,
+    EV_G1_ON,        EV_G2_ON,        EV_G3_ON,            EV_G4_ON};
+
+// gear senses (debounced pins)
+static const tSense g_senses[] PROGMEM = {
+    {SENSE_PORT_D, (1 << PIN_C90_SENSE_G1), EV_G1_ON, EV_G1_OFF},
+    {SENSE_PORT_B, (1 << PIN_C90_SENSE_G2), EV_G2_ON, EV_G2_OFF},
+    {SENSE_PORT_B, (1 << PIN_C90_SENSE_G3), EV_G3_ON, EV_G3_OFF},
+    {SENSE_PORT_A, (1 << PIN_C90_SENSE_G4), EV_G4_ON, EV_G4_OFF}};
+
+// ADC channels, sampled round robin at ADC_TRIGGER_HZ / ADC_CHANNELS (1002hz)
+// each. The accelerometer stays at 10 bits since its raw value is sent out as
+// is, 62.6hz. Battery, current: 12 bits at 15.6hz, temperature: 12 bits at
+// 3.9hz
+static const tAdcChannel g_adc_channels[ADC_CHANNELS] PROGMEM = {
+    [ADC_ACCELX] = {0, 0, 4},   [ADC_ACCELY] = {1, 0, 4},
+    [ADC_ACCELZ] = {2, 0, 4},   [ADC_VBAT] = {3, 2, 2},
+    [ADC_VCURRENT] = {4, 2, 2}, [ADC_VTEMP] = {5, 2, 4}};
 
 // Gets called from the main loop, generates events and puts them in the event
-// queue. The complete queue is handled (emptied) in each main loop iteration in
-// a FIFO way, so better put the higher priority events at the top
+// queue. The complete queue is handled (emptied) in each main loop iteration,
+// in the order of g_event_prio
 static void dispatch_events() {
   check_battery();
   check_current();
   check_temperature();
   check_accel();
-  check_gear1();
-  check_gear2();
-  check_gear3();
-  check_gear4();
+  check_gears();
   check_neutral();
+  check_rpm();
   check_sound();
+  check_wifi();
+}
+
+// resolves an event in constant time via the event-indexed callback table:
+// guard condition first, then the event handler
+void handle_event(uint8_t ev) {
+  uint8_t (*check_func)(void);
+  void (*process_func)(void);
+  if (ev >= EV_COUNT) return;  // unknown event
+  check_func = (uint8_t(*)(void))pgm_read_word(&g_callbacks[ev].check_func);
+  if (check_func && check_func()) {  // guard condition to check if current
+                                     // state is accepting this event
+    process_func =
+        (void (*)(void))pgm_read_word(&g_callbacks[ev].process_func);
+    process_func();  // call event handler
+  }
 }
 
-// default function for checking sense pins and dispatching events
-void check_default(uint8_t event_on, uint8_t event_off, uint8_t pin,
-                   volatile uint8_t *debounce_timer_flag,
-                   volatile uint8_t *debounce_state) {
-  // keep checking for 6 positives in a short timespan, so we're certain a
-  // button is pressed/released and it's not noise
-  if (*debounce_timer_flag) {  // timer-based flag is set (again)
-    *debounce_timer_flag = 0;  // reset to wait for next timer event
-    if (pin) {
-      *debounce_state =
-          (*debounce_state << 1);  // add 0 as a positive "off" press
-      if ((*debounce_state & 0b00111111) == 0) {
-        set_event(event_off);
-      }
-    } else {
-      *debounce_state =
-          (*debounce_state << 1) | 1;  // add 1 as a positive "on" press
-      if ((*debounce_state & 0b00111111) == 0b00111111) {
-        set_event(event_on);
-      }
+// generates the gear events from the sense pins the debouncer saw toggling
+void check_gears() {
+  uint8_t changed[SENSE_PORTS];
+  uint8_t state[SENSE_PORTS];
+  uint8_t i, port, pin;
+  cli();  // the debouncer runs in the TIMER2 interrupt
+  for (i = 0; i < SENSE_PORTS; i++) {
+    changed[i] = g_sense_changed[i];
+    g_sense_changed[i] = 0;
+    state[i] = g_debounce[i].state;
+  }
+  sei();
+  if (!(changed[SENSE_PORT_A] | changed[SENSE_PORT_B] |
+        changed[SENSE_PORT_D])) {
+    return;  // nothing toggled
+  }
+  for (i = 0; i < SENSE_CNT; i++) {
+    port = pgm_read_byte(&g_senses[i].port);
+    pin = pgm_read_byte(&g_senses[i].pin);
+    if (changed[port] & pin) {
+      set_event((state[port] & pin) ? pgm_read_byte(&g_senses[i].event_on)
+                                    : pgm_read_byte(&g_senses[i].event_off));
     }
   }
 }
 
-void check_gear1() {
-  check_default(EV_G1_ON, EV_G1_OFF, STATUS_C90_SENSE_G1, &FLAG_DEBOUNCE_G1,
-                &g_gear1_debounce);
-}
-
-void check_gear2() {
-  check_default(EV_G2_ON, EV_G2_OFF, STATUS_C90_SENSE_G2, &FLAG_DEBOUNCE_G2,
-                &g_gear2_debounce);
-}
-
-void check_gear3() {
-  check_default(EV_G3_ON, EV_G3_OFF, STATUS_C90_SENSE_G3, &FLAG_DEBOUNCE_G3,
-                &g_gear3_debounce);
-}
-
-void check_gear4() {
-  check_default(EV_G4_ON, EV_G4_OFF, STATUS_C90_SENSE_G4, &FLAG_DEBOUNCE_G4,
-                &g_gear4_debounce);
-}
-
 void check_neutral() {
   if (g_neutral_counter >= 100) {  // every 0.5s (5ms*100) check
     g_neutral_counter = 0;
@@ -117,13 +135,78 @@ void check_neutral() {
   }
 }
 
-void check_battery() { set_event(EV_READ_BATTERY); }
+// turns the captured pulse periods into g_rpm: a median of the last 3 periods
+// rejects a single misfire, a moving average of the medians smooths the rest.
+// The average is kept as a sum, i.e. a fixed point period with RPM_AVG_SHIFT
+// fraction bits, so one 32-bit division per new period yields the RPM
+void check_rpm() {
+  uint16_t a, b, c, t;
+  uint8_t head, count, i;
+  cli();  // the periods are captured in the PCINT1 interrupt
+  if (!FLAG_RPM) {
+    sei();
+    return;
+  }
+  FLAG_RPM = 0;
+  head = g_rpm_head;
+  count = g_rpm_count;
+  a = g_rpm_periods[(head - 1) & (RPM_SAMPLES - 1)];
+  b = g_rpm_periods[(head - 2) & (RPM_SAMPLES - 1)];
+  c = g_rpm_periods[(head - 3) & (RPM_SAMPLES - 1)];
+  sei();
+  if (count >= 3) {  // median of 3
+    if (a > b) {
+      t = a;
+      a = b;
+      b = t;
+    }
+    if (b > c) {
+      b = c;
+    }
+    if (a < b) {
+      a = b;
+    }
+  }
+  if (!g_rpm) {  // first period after a stall: fill the average with it
+    for (i = 0; i < RPM_AVG; i++) {
+      g_rpm_avg[i] = a;
+    }
+    g_rpm_sum = (uint32_t)a << RPM_AVG_SHIFT;
+  } else {
+    g_rpm_sum -= g_rpm_avg[g_rpm_avg_idx];
+    g_rpm_sum += a;
+    g_rpm_avg[g_rpm_avg_idx] = a;
+    g_rpm_avg_idx = (g_rpm_avg_idx + 1) & (RPM_AVG - 1);
+  }
+  g_rpm = (RPM_K << RPM_AVG_SHIFT) / g_rpm_sum;
+}
+
+// the ADC events fire at the filtered sample rate of their channel
+void check_battery() {
+  if (adc_ready(ADC_VBAT)) {
+    set_event(EV_READ_BATTERY);
+  }
+}
 
-void check_current() { set_event(EV_READ_CURRENT); }
+void check_current() {
+  if (adc_ready(ADC_VCURRENT)) {
+    set_event(EV_READ_CURRENT);
+  }
+}
 
-void check_temperature() { set_event(EV_READ_TEMPERATURE); }
+void check_temperature() {
+  if (adc_ready(ADC_VTEMP)) {
+    set_event(EV_READ_TEMPERATURE);
+  }
+}
 
-void check_accel() { set_event(EV_READ_ACCEL); }
+void check_accel() {
+  if (adc_ready(ADC_ACCELZ)) {  // the last of the three axes
+    adc_ready(ADC_ACCELX);
+    adc_ready(ADC_ACCELY);
+    set_event(EV_READ_ACCEL);
+  }
+}
 
 uint8_t check_battery_read() { return 1; }
 
@@ -149,34 +232,35 @@ uint8_t check_gear3_off() { return (g_current_gear == 3); }
 
 uint8_t check_gear4_off() { return (g_current_gear == 4); }
 
-// get the next event from the event queue (circular buffer)
+// get the next pending event from the event queue, highest priority first
 uint8_t get_event() {
-  uint8_t ev;
-  if (g_buffer_tail != g_buffer_head) {  // not empty
-    ev = g_event_buffer[g_buffer_tail];
-    g_buffer_tail++;
-    if (g_buffer_tail >= C90_EVENT_BUFFER_SIZE) {
-      g_buffer_tail = 0;
-    }
-    return ev;
-  } else {
+  uint8_t i, ev;
+  if (!g_event_pending) {
     return EV_VOID;  // no events, return a void event
   }
+  for (i = 0; i < sizeof(g_event_prio); i++) {
+    ev = pgm_read_byte(&g_event_prio[i]);
+    if (g_event_pending & (1 << ev)) {
+      g_event_pending &= ~(1 << ev);
+      return ev;
+    }
+  }
+  g_event_pending = 0;  // only events without a priority left, discard them
+  return EV_VOID;
 }
 
-// put an event in the event queue (circular buffer)
+// put an event in the event queue (pending bitmask), an event that is already
+// pending gets coalesced with it, so the queue can't overflow and no event
+// ever gets evicted (e.g. a brake event by a flood of other events)
 void set_event(uint8_t ev) {
-  g_event_buffer[g_buffer_head] = ev;  // insert event at head position
-  g_buffer_head++;                     // advance head
-  if (g_buffer_head >= C90_EVENT_BUFFER_SIZE) {
-    g_buffer_head = 0;  // cycle back to start
+  if (ev <= EV_ANY || ev >= EV_COUNT) {  // not a queueable event
+    g_event_drops++;
+    return;
   }
-  if (g_buffer_head == g_buffer_tail) {
-    g_buffer_tail++;  // also move tail, basically destroying the oldest event
-                      // to make space
-  }
-  if (g_buffer_tail >= C90_EVENT_BUFFER_SIZE) {
-    g_buffer_tail = 0;  // cycle back to start
+  if (g_event_pending & (1 << ev)) {
+    g_event_coalesced++;
+  } else {
+    g_event_pending |= (1 << ev);
   }
 }
 
@@ -186,13 +270,11 @@ static void set_gear(uint8_t gear) { g_gear = gear; }
 // calculates the battery's voltage
 // Vref = 5v, if Vref isnt exactly 5.00v, but a bit off, tweak
 // C90_OFFSET_ADC_READING for 12v battery readout: my voltage divider
-// ratio: 2.2K - 1K Vmeasure:  0.3125 * Vbat 10bit ADCvalue (0-1023):
-// Vmeasure/(5/1024) Vbat: (ADCvalue*(5/1024))/(0.3125)
+// ratio: 2.2K - 1K Vmeasure:  0.3125 * Vbat 12bit ADCvalue (0-4095):
+// Vmeasure/(5/4096) Vbat: (ADCvalue*(5/4096))/(0.3125) -> 3.92mV per bit,
+// 1004/256 in fixed point
 void process_battery() {
-  if (FLAG_READ_BATTERY) {
-    g_voltage = 49 * g_adc_voltage[3] / 3.125;
-    FLAG_READ_BATTERY = 0;
-  }
+  g_voltage = ((uint32_t)adc_read(ADC_VBAT) * 1004) >> 8;
 }
 
 // calculates the current consumption of the board in mA, according the sensor's
@@ -201,24 +283,24 @@ void process_battery() {
 // reverse, this value drops when the current increases (using the 0-512 10bit
 // part instead of 512-1023) 10bit ADCvalue (0-1023): (5v/1024) -> 0.00488 volt
 // per bit resolution sensor: 185mV/A -> 0.0185 volt == 100mA -> 0.00488/0.0185
-// == 26mA per bit -> due to low res/noise set to a sensible 25mA/bit
+// == 26mA per bit -> set to a sensible 25mA/bit, the 12bit oversampled value
+// gives a quarter of that. 32 bit math: a deviation of 2048 counts (a railed
+// sensor) times 25 doesn't fit in 16 bits
 void process_board_current() {
-  if (FLAG_READ_CURRENT) {
-    g_current = abs(512 - g_adc_voltage[4]) * 25;
-    FLAG_READ_CURRENT = 0;
+  int16_t offset = 2048 - (int16_t)adc_read(ADC_VCURRENT);
+  if (offset < 0) {
+    offset = -offset;
   }
+  g_current = ((uint32_t)offset * 25) >> 2;
 }
 
 // calculates the board's ambient temperature using an LM35 sensor which gives
 // 10mV/Celsius since 1 bit is roughly 5mV, max resolution is 0.5 degrees Vref =
 // 5v, if Vref isnt exactly 5.00v, but a bit off, tweak C90_OFFSET_ADC_READING
 // 10bit ADCvalue (0-1023): Vmeasure/(5/1024) -> use 49*voltage == temperature
-// (divide by 100) on receiver side
+// (divide by 100) on receiver side, the 12bit oversampled value gives 49/4
 void process_temperature() {
-  if (FLAG_READ_TEMPERATURE) {
-    g_temperature = (49 * g_adc_voltage[5]);
-    FLAG_READ_TEMPERATURE = 0;
-  }
+  g_temperature = ((uint32_t)adc_read(ADC_VTEMP) * 49) >> 2;
 }
 
 // reads the accelerometer's x-/y-/z-axis
@@ -226,12 +308,9 @@ void process_temperature() {
 // Vref = 5v, if Vref isnt exactly 5.00v, but a bit off, tweak
 // C90_OFFSET_ADC_READING 10bit ADCvalue (0-1023): Vmeasure/(5/1024)
 void process_board_accel() {
-  if (FLAG_READ_ACCEL) {
-    g_accelx = g_adc_voltage[0];
-    g_accely = g_adc_voltage[1];
-    g_accelz = g_adc_voltage[2];
-    FLAG_READ_ACCEL = 0;
-  }
+  g_accelx = adc_read(ADC_ACCELX);
+  g_accely = adc_read(ADC_ACCELY);
+  g_accelz = adc_read(ADC_ACCELZ);
 }
 
 void process_gear1_on() {
@@ -280,7 +359,7 @@ void init_ports() {
   PORT_C90_SENSE_G3 |= (1 << PIN_C90_SENSE_G3);
   DDR_C90_SENSE_G4 &= ~(1 << PIN_C90_SENSE_G4);
   PORT_C90_SENSE_G4 |= (1 << PIN_C90_SENSE_G4);
-  // RPM T0 counter pin as as input(0)/high(1)
+  // RPM pulse pin as as input(0)/high(1)
   DDR_C90_RPM &= ~(1 << PIN_C90_RPM);
   PORT_C90_RPM |= (1 << PIN_C90_RPM);
   // heartbeat led on pcb
@@ -291,53 +370,95 @@ void init_ports() {
   PORT_C90_BUZZER &= ~(1 << PIN_C90_BUZZER);  // low
 }
 
-// setup the ADC in Free Running Mode (3 LSB in ADCSRB: 0 by default), so we can
-// advance the read pin ourselves
+// setup the ADC in auto trigger mode: timer0 compare match A starts a
+// conversion ADC_TRIGGER_HZ times a second, the ADC interrupt advances the
+// channel
 void enable_adc() {
+  g_adc_channel = 0;
   // analog input channel selections,  clear the bottom 3 bits before setting
   // the new pin for readout the 3 LSB select the currently active  ADC0-7
-  ADMUX = (ADMUX & 0xF8) | g_adc_read_pin;
+  ADMUX = (ADMUX & 0xF8) | pgm_read_byte(&g_adc_channels[0].mux);
   ADMUX |= (1 << REFS0);  // voltage reference = AVCC
   DIDR0 = 0x3F;           // 0b00111111, disable digital inputs for ADC0-ADC5
   ADCSRA |= (1 << ADEN);  // enable ADC
   ADCSRA |= (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);  // prescaler = 128
   ADCSRA |= (1 << ADIE);                                 // enable interrupt
-  ADCSRA |= (1 << ADSC);                                 // start a conversion
+  ADCSRB = (ADCSRB & 0xF8) | (1 << ADTS1) | (1 << ADTS0);  // timer0 compare A
+  ADCSRA |= (1 << ADATE);                                  // auto trigger
+  // Configure timer 0 (8-bit) for CTC mode (Clear on Timer Compare), no
+  // interrupt: the compare flag triggers the ADC and is cleared in ADC_vect
+  TCCR0A |= (1 << WGM01);
+  TCCR0A &= ~(1 << WGM00);
+  TCCR0A &= ~((1 << COM0A1) |
+              (1 << COM0A0));  // DON'T use PB3's OC0A functionality, else it
+                               // will interfere with the buzzer on that pin
+  TCCR0B &= ~(1 << WGM02);
+  // prescale 64
+  TCCR0B |= ((1 << CS01) | (1 << CS00));
+  TCCR0B &= ~(1 << CS02);
+  OCR0A = ADC_TRIGGER_OCR;
+}
+
+// returns the filtered value of an ADC channel: the mean of its ring of
+// decimated samples, 10 + bits of the channel's config wide
+uint16_t adc_read(uint8_t ch) {
+  uint16_t sum = 0;
+  uint8_t i;
+  cli();
+  for (i = 0; i < ADC_RING; i++) {
+    sum += g_adc[ch].ring[i];
+  }
+  sei();
+  return sum / ADC_RING;
 }
 
+// checks and clears if an ADC channel has a new filtered sample
+uint8_t adc_ready(uint8_t ch) {
+  uint8_t ready;
+  cli();
+  ready = g_adc_ready & (1 << ch);
+  g_adc_ready &= ~(1 << ch);
+  sei();
+  return ready;
+}
+
+// accumulates a sample of the current channel, a channel is decimated after
+// 2^(2*bits + avg_shift) samples, which yields bits extra bits of resolution
 ISR(ADC_vect) {
-  // first read ADCL, then ADCH to keep it an atomic operation
-  g_adc_voltage[g_adc_read_pin] = ADCL;
-  g_adc_voltage[g_adc_read_pin] =
-      (g_adc_voltage[g_adc_read_pin] | (ADCH << 8));  // ADCH has the last 2
-                                                      // bits as LSB, which
-                                                      // become MSB in uint16_t
-  g_adc_voltage[g_adc_read_pin] += C90_OFFSET_ADC_READING;
-  g_adc_read_pin++;  // increment pin to read a new voltage on
-  if (g_adc_read_pin > 5) {
-    g_adc_read_pin = 0;
+  uint8_t ch = g_adc_channel;
+  volatile tAdcState *adc = &g_adc[ch];
+  uint8_t bits = pgm_read_byte(&g_adc_channels[ch].bits);
+  uint8_t shift = bits + pgm_read_byte(&g_adc_channels[ch].avg_shift);
+  TIFR0 = (1 << OCF0A);  // clear the trigger flag, else no next trigger edge
+  adc->sum += ADC;       // 16-bit read, ADCL first, then ADCH
+  if (++adc->count >> (shift + bits)) {  // 2^(2*bits + avg_shift) samples
+    adc->ring[adc->head] =
+        (adc->sum >> shift) + (C90_OFFSET_ADC_READING << bits);
+    adc->head = (adc->head + 1) & (ADC_RING - 1);
+    adc->sum = 0;
+    adc->count = 0;
+    g_adc_ready |= (1 << ch);
+  }
+  if (++ch >= ADC_CHANNELS) {  // next channel, round robin
+    ch = 0;
   }
-  ADMUX = (ADMUX & 0xF8) | g_adc_read_pin;
-  ADCSRA |= (1 << ADSC);  // start another conversion again
+  g_adc_channel = ch;
+  // the mux changes before the next trigger starts a conversion
+  ADMUX = (ADMUX & 0xF8) | pgm_read_byte(&g_adc_channels[ch].mux);
 }
 
-// RPM timer
+// RPM timer: timer 3 runs free as the timebase of the RPM engine, each RPM
+// pulse on PB0 is timestamped with it in the pin change interrupt (a software
+// input capture, the pulse isn't wired to ICP1/ICP3)
 void start_rpm_timer() {
-  // Configure timer 0 (8-bit) for CTC mode (Clear on Timer Compare)
-  // set timer as CTC Mode
-  TCCR0A |= (1 << WGM01);
-  TCCR0A |= ~(1 << WGM00);
-  TCCR0A &= ~((1 << COM0A1) |
-              (1 << COM0A0));  // DON'T use PB3's OC0A functionality, else it
-                               // will interfere with the buzzer on that pin
-  TCCR0B |= ~(1 << WGM02);
-  // no prescale, but configure as external clock source on T0 pin. Clock on
-  // falling edge.
-  TCCR0B |= ((1 << CS01) | (1 << CS02));
-  TCCR0B &= ~(1 << CS00);
-  TIMSK0 |= (1 << OCIE0A);  // Enable Compare A interrupt
-  OCR0A = 1;  // Set CTC compare A value to 1, to calculate the time between
-              // each pulse
+  // Configure timer 3 (16-bit) for normal mode, no interrupts
+  TCCR3A &= ~((1 << WGM31) | (1 << WGM30));
+  TCCR3B &= ~((1 << WGM33) | (1 << WGM32));
+  // prescale with 64 to get 312500 hz (3.2us ticks) with a 20mhz crystal
+  TCCR3B &= ~(1 << CS32);
+  TCCR3B |= ((1 << CS31) | (1 << CS30));
+  PCMSK1 |= (1 << PCINT8);  // pin change interrupt on the RPM pin PB0
+  PCICR |= (1 << PCIE1);
 }
 
 void start_buzzer_timer() {
@@ -349,7 +470,29 @@ void start_buzzer_timer() {
   // Set CTC compare value, approx. 4600hz: with a square wave that is a 2300hz
   // tone This is the default value, when playing sounds, this value is
   // constantly updated with the tone's frequency
-  OCR1A = 68;
+  OCR1A = BUZZER_BEEP;
+}
+
+// plays a square wave tone on the buzzer, top is the CTC compare value of half
+// a period
+void buzzer_tone(uint16_t top) {
+  OCR1A = top;
+  TCNT1 = 0;  // restart the period, a lower top could be passed already
+#ifdef C90_BUZZER_OC1A
+  TCCR1A |= (1 << COM1A0);  // toggle OC1A in hardware on compare match
+#else
+  TIMSK1 |= (1 << OCIE1A);  // enable interrupt
+#endif
+}
+
+// silences the buzzer
+void buzzer_off() {
+#ifdef C90_BUZZER_OC1A
+  TCCR1A &= ~((1 << COM1A1) | (1 << COM1A0));  // disconnect OC1A
+#else
+  TIMSK1 &= ~(1 << OCIE1A);  // disable interrupt
+#endif
+  PORT_C90_BUZZER &= ~(1 << PIN_C90_BUZZER);
 }
 
 // sense timer for debouncing the gear senses
@@ -365,36 +508,38 @@ void start_sense_timer() {
   OCR2A = 97;  // Set CTC compare A value, approx. 5 ms -> 200 times/sec
 }
 
-// timer for the period calculation of the RPM
-void start_10us_timer() {
-  // Configure timer 3 (16-bit) for CTC mode (Clear on Timer Compare)
-  TCCR3A &= ~((1 << WGM31) | (1 << WGM30));  // CTC Mode
-  TCCR3B |= (1 << WGM32);                    // CTC Mode
-  // prescale with 8 to get 2.5million hz with a 20mhz crystal
-  TCCR3B &= ~((1 << CS30) | (1 << CS32));
-  TCCR3B |= (1 << CS31);
-  TIMSK3 |= (1 << OCIE3A);  // Enable Compare A interrupt
-  OCR3A = 24;               // Set CTC compare value, 100.000 times/sec
-}
-
-// interrupt handler for 8bit timer0 that triggers every RPM pulse
-// resolution of RPM is 120RPM per bit steps
-ISR(TIMER0_COMPA_vect) {
-  // calculate RPM by checking how many 10 microsecond ticks have passed since
-  // last pulse, the multiply by 2 is needed since we only detect the positive
-  // pulse of the rectified signal
-  g_rpm = (100000UL / g_10us_ticks * 60) * 2;
-  // reset ticks
-  g_10us_ticks = 0;
+// interrupt handler of the RPM pin that captures the time of every RPM pulse
+ISR(PCINT1_vect) {
+  uint16_t now = TCNT3;  // capture first, keeps the timestamp jitter low
+  uint16_t period;
+  if (STATUS_C90_RPM) {
+    return;  // rising edge, a pulse is timed on its falling edge
+  }
+  period = now - g_rpm_capture;  // 16-bit wrap is fine, a stall is declared
+                                 // before timer3 wraps around (209ms)
+  if (g_rpm_reset) {  // engine running: store the period since last pulse
+    if (period < RPM_MIN_PERIOD) {
+      return;  // ignition noise, keep timing from the previous pulse
+    }
+    g_rpm_periods[g_rpm_head] = period;
+    g_rpm_head = (g_rpm_head + 1) & (RPM_SAMPLES - 1);
+    if (g_rpm_count < RPM_SAMPLES) {
+      g_rpm_count++;
+    }
+    FLAG_RPM = 1;
+  }
+  g_rpm_capture = now;
   // reset to full to notify that we still have rpms
-  g_rpm_reset = 40;
+  g_rpm_reset = RPM_STALL;
 }
 
+#ifndef C90_BUZZER_OC1A
 // timer interrupt for the speaker
 ISR(TIMER1_COMPA_vect) {
   // toggle buzzer pin to create a 50% duty cycle
   PORT_C90_BUZZER ^= (1 << PIN_C90_BUZZER);
 }
+#endif
 
 // timer interrupt for the sense, each 5ms
 ISR(TIMER2_COMPA_vect) {
@@ -403,6 +548,7 @@ ISR(TIMER2_COMPA_vect) {
     g_rpm_reset--;
   } else if (g_rpm) {
     g_rpm = 0;
+    g_rpm_count = 0;  // start over with a fresh period history
   }
   // neutral check after g_current_gear == 0 for # counts
   if (!g_current_gear) {
@@ -413,22 +559,30 @@ ISR(TIMER2_COMPA_vect) {
 #ifdef EASY_TRACE123
   g_uart_display_counter++;
 #endif
-  FLAG_READ_BATTERY = 1;
-  FLAG_READ_CURRENT = 1;
-  FLAG_READ_TEMPERATURE = 1;
-  FLAG_READ_ACCEL = 1;
-  FLAG_DEBOUNCE_G1 = 1;
-  FLAG_DEBOUNCE_G2 = 1;
-  FLAG_DEBOUNCE_G3 = 1;
-  FLAG_DEBOUNCE_G4 = 1;
+  // debounce all gear sense pins in parallel, they are active low
+  g_sense_changed[SENSE_PORT_A] |=
+      debounce_port(&g_debounce[SENSE_PORT_A], ~PINA & SENSE_PINS_A);
+  g_sense_changed[SENSE_PORT_B] |=
+      debounce_port(&g_debounce[SENSE_PORT_B], ~PINB & SENSE_PINS_B);
+  g_sense_changed[SENSE_PORT_D] |=
+      debounce_port(&g_debounce[SENSE_PORT_D], ~PIND & SENSE_PINS_D);
+  // now and then re-send all debounced senses, so an event that got rejected
+  // by its guard is retried
+  if (++g_sense_resync >= SENSE_RESYNC) {
+    g_sense_resync = 0;
+    g_sense_changed[SENSE_PORT_A] = SENSE_PINS_A;
+    g_sense_changed[SENSE_PORT_B] = SENSE_PINS_B;
+    g_sense_changed[SENSE_PORT_D] = SENSE_PINS_D;
+  }
   if (g_music_duration) {
     g_music_duration--;
   }
+  g_wifi_timer++;
+#ifdef EASY_BENCH
+  g_bench_ticks++;
+#endif
 }
 
-// timer interrupt with 10 microsecond intervals to calculate RPM
-ISR(TIMER3_COMPA_vect) { g_10us_ticks++; }
-
 void check_sound() {
   if (FLAG_MUSIC) {
     if (!g_music_duration) {
@@ -442,34 +596,38 @@ void check_sound() {
             calc_note_duration(pgm_read_word(g_current_music), g_music_tempo);
         g_current_music++;
         if (pgm_read_word(g_current_music) ==
-            MUSIC_P) {               // pause check (silence for a certain time)
-          TIMSK1 &= ~(1 << OCIE1A);  // disable interrupt
-          PORT_C90_BUZZER &= ~(1 << PIN_C90_BUZZER);
+            MUSIC_P) {  // pause check (silence for a certain time)
+          buzzer_off();
         } else {
-          TIMSK1 |= (1 << OCIE1A);  // enable interrupt
+          buzzer_tone(pgm_read_word(g_current_music));
         }
-        OCR1A = pgm_read_word(g_current_music);
-        TCNT1 = 0;
         g_current_music++;
       } else {  // the end of song
         FLAG_MUSIC = 0;
-        TIMSK1 &= ~(1 << OCIE1A);  // disable interrupt
-        PORT_C90_BUZZER &= ~(1 << PIN_C90_BUZZER);
+        buzzer_off();
       }
     }
   }
 }
 
+// wifi tick, the websocket keepalive pings an idle client and closes a
+// vanished one
+void check_wifi() {
+  if (g_wifi_timer >= 20) {  // 20 ticks x 5ms=100ms interval (WS_TICK_MS)
+    g_wifi_timer = 0;
+    wifi_tick();
+  }
+}
+
 void set_sound(uint8_t status) {
   uint8_t song_idx;
   // initially mute current sound
-  TIMSK1 &= ~(1 << OCIE1A);  // disable interrupt
-  PORT_C90_BUZZER &= ~(1 << PIN_C90_BUZZER);
+  buzzer_off();
   FLAG_MUSIC = 0;
   switch (status) {
     case 255:  // random song
-      srand(g_adc_voltage[0] + g_adc_voltage[1] + g_adc_voltage[2] +
-            g_adc_voltage[3]);               // random seed
+      srand(g_adc[ADC_ACCELX].sum + g_adc[ADC_ACCELY].sum +
+            g_adc[ADC_ACCELZ].sum + g_adc[ADC_VBAT].sum);  // random seed
       song_idx = 1 + (uint8_t)(rand() % 5);  // add 0-4 idx
       g_music_duration = 0;
       g_current_music = (uint16_t *)pgm_read_word(&g_music[song_idx]);
@@ -479,9 +637,7 @@ void set_sound(uint8_t status) {
     case 254:  // no sound, do nothing
       break;
     case 253:  // beep only
-      OCR1A = 68;
-      TCNT1 = 0;
-      TIMSK1 |= (1 << OCIE1A);  // enable interrupt
+      buzzer_tone(BUZZER_BEEP);
       break;
     default:  // specific idx
       g_music_duration = 0;
@@ -491,18 +647,42 @@ void set_sound(uint8_t status) {
   }
 }
 
+#ifdef EASY_BENCH
+// counts main loop iterations, reported over UART1 every second (200 x 5ms)
+void check_bench() {
+  static uint32_t loops;
+  char tmp[11];
+  loops++;
+  if (g_bench_ticks >= 200) {
+    g_bench_ticks = 0;
+    uart_put_str_1("LOOPS/S: ");
+    uart_put_str_1(ultoa(loops, tmp, 10));
+    uart_put_str_1(" EV_COALESCED: ");
+    uart_put_int_1(g_event_coalesced);
+    uart_put_str_1(" EV_DROPS: ");
+    uart_put_int_1(g_event_drops);
+    uart_put_str_1(" WIFI_SKIPPED: ");
+    uart_put_int_1(wifi_skipped());
+    uart_put_str_1("\r\n");
+    loops = 0;
+  }
+}
+#endif
+
 void initialize() {
   MCUCR = 0x80;  // disable JTAG at runtime (2 calls in a row needed)
   MCUCR = 0x80;
   wdt_enable(WDTO_2S);                // enable 2 sec watchdog
   sei();                              // enable global interrupts
-  g_buffer_head = g_buffer_tail = 0;  // init event buffer
+  g_event_pending = 0;                // init event queue
+  debounce_init(&g_debounce[SENSE_PORT_A]);
+  debounce_init(&g_debounce[SENSE_PORT_B]);
+  debounce_init(&g_debounce[SENSE_PORT_D]);
   enable_adc();
   init_ports();
   start_rpm_timer();
   start_buzzer_timer();
   start_sense_timer();
-  start_10us_timer();
   command_init();
 }
 
@@ -512,16 +692,7 @@ int main(void) {
     dispatch_events();
     while ((g_event = get_event()) !=
            EV_VOID) {  // handle the complete event queue in one go
-      for (uint8_t i = 0; i < TR_CNT; i++) {
-        if (g_event == g_callbacks[i].event) {  // check if event matches
-          if (g_callbacks[i].check_func()) {    // guard condition to check if
-                                              // current state is accepting this
-                                              // event
-            g_callbacks[i].process_func();  // call event handler
-            break;
-          }
-        }
-      }
+      handle_event(g_event);
     }
     //  WiFi serial wifly passthrough of UART1 cable -> UART0 Wifi (mcu1)
     //  or
@@ -534,6 +705,9 @@ int main(void) {
     /*}*/
     // process all commands (SPI, UART and WIFI)
     command_process();
+#ifdef EASY_BENCH
+    check_bench();
+#endif
 #ifdef EASY_TRACE123
     if (g_uart_display_counter >= 20) {
       g_uart_display_counter = 0;
@@ -19,10 +19,13 @@
 #ifndef EASYRIDER_MCU1_H_INCLUDED
 #define EASYRIDER_MCU1_H_INCLUDED
 
+#include "../util.h"
+
 #define STATUS_C90_SENSE_G1 PIND &(1 << PIN_C90_SENSE_G1)
 #define STATUS_C90_SENSE_G2 PINB &(1 << PIN_C90_SENSE_G2)
 #define STATUS_C90_SENSE_G3 PINB &(1 << PIN_C90_SENSE_G3)
 #define STATUS_C90_SENSE_G4 PINA &(1 << PIN_C90_SENSE_G4)
+#define STATUS_C90_RPM PINB &(1 << PIN_C90_RPM)
 
 #define PIN_C90_SENSE_G1 PIND7
 #define PIN_C90_SENSE_G2 PINB1
@@ -40,15 +43,28 @@
 #define DDR_C90_SENSE_G4 DDRA
 #define DDR_C90_RPM DDRB
 #define DDR_C90_HEARTBEAT_LED DDRC
+#ifdef C90_BUZZER_OC1A
+#define DDR_C90_BUZZER DDRD
+#else
 #define DDR_C90_BUZZER DDRB
+#endif
 
 #define PORT_C90_RPM PORTB
 #define PORT_C90_HEARTBEAT_LED PORTC
+#ifdef C90_BUZZER_OC1A
+#define PORT_C90_BUZZER PORTD
+#else
 #define PORT_C90_BUZZER PORTB
+#endif
 
 #define PIN_C90_RPM PINB0
 #define PIN_C90_HEARTBEAT_LED PINC2
-#define PIN_C90_BUZZER PINB3
+#ifdef C90_BUZZER_OC1A
+#define PIN_C90_BUZZER PIND5  // OC1A, the tone is generated by timer1
+#else
+#define PIN_C90_BUZZER PINB3  // OC0A can't be used, timer0 triggers the ADC
+#endif
+#define BUZZER_BEEP 68  // timer1 CTC value of the beep, approx. 2300hz tone
 
 // the events
 #define EV_VOID 0
@@ -65,15 +81,41 @@
 #define EV_G3_OFF 11
 #define EV_G4_ON 12
 #define EV_G4_OFF 13
+#define EV_COUNT 14  // number of events, size of the event-indexed table
+
+// debounced sense ports, all sense pins of a port are debounced in parallel
+#define SENSE_PORT_A 0
+#define SENSE_PORT_B 1
+#define SENSE_PORT_D 2
+#define SENSE_PORTS 3
+#define SENSE_PINS_A (1 << PIN_C90_SENSE_G4)
+#define SENSE_PINS_B ((1 << PIN_C90_SENSE_G2) | (1 << PIN_C90_SENSE_G3))
+#define SENSE_PINS_D (1 << PIN_C90_SENSE_G1)
+#define SENSE_RESYNC 20  // 5ms ticks between re-sending all debounced senses
+#define SENSE_CNT \
+  (sizeof(g_senses) / sizeof(*g_senses))  // number of sense table entries
+
+// RPM engine, pulses are timestamped with timer3 (prescale 64)
+#define RPM_TIMER_HZ (F_CPU / 64)        // timer3 ticks per second
+#define RPM_K (60UL * RPM_TIMER_HZ)      // RPM = RPM_K / ticks between pulses
+#define RPM_MIN_PERIOD (RPM_K / 20000)   // shorter periods are ignition noise
+#define RPM_STALL 40  // 5ms ticks without a pulse until the engine has stalled
+#define RPM_SAMPLES 4     // captured periods, power of 2
+#define RPM_AVG_SHIFT 2   // moving average over 1 << RPM_AVG_SHIFT medians
+#define RPM_AVG (1 << RPM_AVG_SHIFT)
 
-#define TR_CNT           \
-  (sizeof(g_callbacks) / \
-   sizeof(*g_callbacks))  // number of callback table entries
+// ADC engine, timer0 triggers a conversion ADC_TRIGGER_HZ times a second
+#define ADC_TRIGGER_OCR 51  // timer0 CTC value at prescale 64
+#define ADC_TRIGGER_HZ (F_CPU / 64 / (ADC_TRIGGER_OCR + 1))  // 6010hz
+#define ADC_ACCELX 0
+#define ADC_ACCELY 1
+#define ADC_ACCELZ 2
+#define ADC_VBAT 3
+#define ADC_VCURRENT 4
+#define ADC_VTEMP 5
+#define ADC_CHANNELS 6
+#define ADC_RING 4  // filtered samples kept per channel, power of 2
 
-// size of event queue (circular buffer) -> this is the max size, if more events
-// occur in one go, then the oldest will be overwritten, just like Snake hitting
-// his tail
-#define C90_EVENT_BUFFER_SIZE 128
 #define C90_OFFSET_ADC_READING \
   0  // tweak this if your 5V VRef is a little off, or to compensate an offset
      // error at 0 volt; each in-/decrement is 5/1024th of a volt
@@ -105,9 +147,32 @@ static const uint16_t *const g_music[] PROGMEM = {
     g_music_alarm, g_music_pipi,    g_music_popcorn,
     g_music_larry, g_music_frogger, g_music_furelise};
 
-// callback struct
+// sense struct, debounced sense pin with its events
+typedef struct {
+  uint8_t port;       // SENSE_PORT_* of the sense pin
+  uint8_t pin;        // sense pin mask on that port
+  uint8_t event_on;   // event when the sense turns on
+  uint8_t event_off;  // event when the sense turns off
+} tSense;
+
+// ADC channel config: 4^bits samples are decimated to bits extra bits of
+// resolution, 2^avg_shift of those are averaged into one filtered sample
+typedef struct {
+  uint8_t mux;        // ADMUX input channel
+  uint8_t bits;       // extra bits of resolution by oversampling
+  uint8_t avg_shift;  // averaged decimated samples, power of 2
+} tAdcChannel;
+
+// ADC channel state
+typedef struct {
+  uint32_t sum;              // accumulated samples
+  uint16_t count;            // number of accumulated samples
+  uint16_t ring[ADC_RING];   // last filtered samples, 10 + bits wide
+  uint8_t head;              // next write index of ring
+} tAdcState;
+
+// callback struct, the callback table is indexed by event id
 typedef struct {
-  uint8_t event;                // event id
   uint8_t (*check_func)(void);  // guard condition function: is current state
                                 // allowed to process event?
   void (*process_func)(void);   // process function
@@ -117,22 +182,20 @@ typedef struct {
 static void initialize(void);
 static void init_ports(void);
 static void dispatch_events(void);
+static void handle_event(uint8_t ev);
 static uint8_t get_event(void);
 static void set_event(uint8_t ev);
 static void set_gear(uint8_t gear);
 static void start_rpm_timer(void);
 static void start_buzzer_timer(void);
 static void start_sense_timer(void);
-static void start_10us_timer(void);
 static void check_battery(void);
 static void check_current(void);
 static void check_temperature(void);
 static void check_accel(void);
-static void check_gear1(void);
-static void check_gear2(void);
-static void check_gear3(void);
-static void check_gear4(void);
+static void check_gears(void);
 static void check_neutral(void);
+static void check_rpm(void);
 static uint8_t check_battery_read(void);
 static uint8_t check_temperature_read(void);
 static uint8_t check_board_current(void);
@@ -159,39 +222,50 @@ static void process_gear3_off(void);
 static void process_gear4_off(void);
 
 static void check_sound(void);
+static void check_wifi(void);
+static void buzzer_tone(uint16_t top);
+static void buzzer_off(void);
 static void enable_adc(void);
+static uint16_t adc_read(uint8_t ch);
+static uint8_t adc_ready(uint8_t ch);
+#ifdef EASY_BENCH
+static void check_bench(void);
+#endif
 
 void set_sound(uint8_t status);
 
 // flags
-static volatile uint8_t FLAG_DEBOUNCE_G1;  // gear 1 debounce
-static volatile uint8_t FLAG_DEBOUNCE_G2;  // gear 2 debounce
-static volatile uint8_t FLAG_DEBOUNCE_G3;  // gear 3 debounce
-static volatile uint8_t FLAG_DEBOUNCE_G4;  // gear 4 debounce
-static volatile uint8_t
-    FLAG_READ_BATTERY;  // ADC voltage readout/conversion needed
-static volatile uint8_t
-    FLAG_READ_CURRENT;  // ADC voltage readout/conversion needed
-static volatile uint8_t
-    FLAG_READ_TEMPERATURE;  // ADC voltage readout/conversion needed
-static volatile uint8_t
-    FLAG_READ_ACCEL;                 // ADC voltage readout/conversion needed
 static volatile uint8_t FLAG_MUSIC;  // time to play some music
+static volatile uint8_t FLAG_RPM;    // new RPM pulse period captured
 
 // globals, non-static ones are used in other modules as an "extern", e.g. in
 // the command module
+volatile uint16_t g_event_coalesced;  // events merged with a pending duplicate
+volatile uint16_t g_event_drops;      // events rejected by the event queue
 static volatile uint8_t g_event;  // the current event
-static volatile uint8_t
-    g_event_buffer[C90_EVENT_BUFFER_SIZE];  // the event queue (circular buffer)
-static volatile uint8_t g_buffer_head;      // index of first item to process
-static volatile uint8_t g_buffer_tail;      // index of last item to process
-static volatile uint16_t g_10us_ticks;      // timer ticks every 10 microseconds
+static volatile uint16_t
+    g_event_pending;  // the event queue: bitmask of pending events, index
+                      // is the event id
+#ifdef EASY_BENCH
+static volatile uint8_t g_bench_ticks;  // 5ms ticks for the loop benchmark
+#endif
+static volatile uint8_t g_wifi_timer;  // 5ms ticks until the next wifi tick
 static volatile uint8_t g_rpm_reset;     // counter to check if the engine has
                                          // stopped, i.e. reset rpm to 0
-static volatile uint8_t g_adc_read_pin;  // current pin to read ADC voltage
+static volatile uint16_t g_rpm_capture;  // timer3 timestamp of last RPM pulse
 static volatile uint16_t
-    g_adc_voltage[6];  // current ADC voltages: accelx, accely, accelz, vbat,
-                       // vcurrent, vtemp
+    g_rpm_periods[RPM_SAMPLES];  // last RPM pulse periods in timer3 ticks
+static volatile uint8_t g_rpm_head;   // next write index of g_rpm_periods
+static volatile uint8_t g_rpm_count;  // periods captured since engine start
+static uint16_t g_rpm_avg[RPM_AVG];   // medians of the RPM moving average
+static uint8_t g_rpm_avg_idx;         // oldest median in g_rpm_avg
+static uint32_t g_rpm_sum;  // sum of g_rpm_avg, fixed point pulse period
+static volatile uint8_t g_adc_channel;  // ADC channel being converted
+static volatile uint8_t
+    g_adc_ready;  // bitmask of ADC channels with a new filtered sample
+static volatile tAdcState g_adc[ADC_CHANNELS];  // ADC channel states: accelx,
+                                                // accely, accelz, vbat,
+                                                // vcurrent, vtemp
 static volatile uint8_t
     g_current_gear;  // currently selected gear for temporary use to satisfy
                      // on/off gear checks
@@ -221,10 +295,10 @@ static volatile uint8_t
                              // over uart1 (DEBUG)
 #endif
 
-// debounce bitmasks
-static volatile uint8_t g_gear1_debounce;  // gear 1 sense
-static volatile uint8_t g_gear2_debounce;  // gear 2 sense
-static volatile uint8_t g_gear3_debounce;  // gear 3 sense
-static volatile uint8_t g_gear4_debounce;  // gear 4 sense
+// sense debouncing
+static tDebounce g_debounce[SENSE_PORTS];  // vertical counters per port
+static volatile uint8_t
+    g_sense_changed[SENSE_PORTS];  // debounced sense pins that toggled
+static volatile uint8_t g_sense_resync;  // ticks until all senses are re-sent
 
 #endif
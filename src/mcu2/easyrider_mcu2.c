@@ -19,28 +19,58 @@
 #include "easyrider_mcu2.h"
 
 // state transition struct array: main handler functions and pre-guard functions
-// for the queued events
-tTransition g_trans[] = {
-    {EV_BRAKE_ON, check_brake_on, process_brake_on},
-    {EV_BRAKE_OFF, check_brake_off, process_brake_off},
-    {EV_CLAXON_ON, check_claxon_on, process_claxon_on},
-    {EV_CLAXON_OFF, check_claxon_off, process_claxon_off},
-    {EV_RI_ON, check_ri_on, process_ri_on},
-    {EV_RI_OFF, check_ri_off, process_ri_off},
-    {EV_LI_ON, check_li_on, process_li_on},
-    {EV_LI_OFF, check_li_off, process_li_off},
-    {EV_WARNING_ON, check_warning_on, process_warning_on},
-    {EV_WARNING_OFF, check_warning_off, process_warning_off},
-    {EV_IGN_ON, check_ign_on, process_ign_on},
-    {EV_IGN_OFF, check_ign_off, process_ign_off},
-    {EV_PILOT_ON, check_pilot_on, process_pilot_on},
-    {EV_PILOT_OFF, check_pilot_off, process_pilot_off},
-    {EV_LIGHT_ON, check_light_on, process_light_on},
-    {EV_LIGHT_OFF, check_light_off, process_light_off},
-    {EV_NEUTRAL_ON, check_neutral_on, process_neutral_on},
-    {EV_NEUTRAL_OFF, check_neutral_off, process_neutral_off},
-    {EV_ALARM_ON, check_alarm_on, process_alarm_on},
-    {EV_ALARM_OFF, check_alarm_off, process_alarm_off}};
+// for the queued events, indexed by event id and kept in flash
+const tTransition g_trans[EV_COUNT] PROGMEM = {
+    [EV_BRAKE_ON] = {check_brake_on, process_brake_on},
+    [EV_BRAKE_OFF] = {check_brake_off, process_brake_off},
+    [EV_CLAXON_ON] = {check_claxon_on, process_claxon_on},
+    [EV_CLAXON_OFF] = {check_claxon_off, process_claxon_off},
+    [EV_RI_ON] = {check_ri_on, process_ri_on},
+    [EV_RI_OFF] = {check_ri_off, process_ri_off},
+    [EV_LI_ON] = {check_li_on, process_li_on},
+    [EV_LI_OFF] = {check_li_off, process_li_off},
+    [EV_WARNING_ON] = {check_warning_on, process_warning_on},
+    [EV_WARNING_OFF] = {check_warning_off, process_warning_off},
+    [EV_IGN_ON] = {check_ign_on, process_ign_on},
+    [EV_IGN_OFF] = {check_ign_off, process_ign_off},
+    [EV_PILOT_ON] = {check_pilot_on, process_pilot_on},
+    [EV_PILOT_OFF] = {check_pilot_off, process_pilot_off},
+    [EV_LIGHT_ON] = {check_light_on, process_light_on},
+    [EV_LIGHT_OFF] = {check_light_off, process_light_off},
+    [EV_NEUTRAL_ON] = {check_neutral_on, process_neutral_on},
+    [EV_NEUTRAL_OFF] = {check_neutral_off, process_neutral_off},
+    [EV_ALARM_ON] = {check_alarm_on, process_alarm_on},
+    [EV_ALARM_OFF] = {check_alarm_off, process_alarm_off}};
+
+// event priority order of the coalescing event queue, highest first, the
+// safety-critical brake/claxon events always go first
+static const uint8_t g_event_prio[] PROGMEM = {
+    EV_BRAKE_ON,    EV_BRAKE_OFF,   EV_CLAXON_ON,   EV_CLAXON_OFF,
+    EV_LIGHT_ON,    EV_LIGHT_OFF,   EV_RI_ON,       EV_RI_OFF,
+    EV_LI_ON,       EV_LI_OFF,      EV_WARNING_ON,  EV_WARNING_OFF,
+    EV_PILOT_ON,    EV_PILOT_OFF,   EV_ALARM_ON,    EV_ALARM_OFF,
+    EV_NEUTRAL_ON,  EV_NEUTRAL_OFF, EV_IGN_ON,      EV_IGN_OFF};
+
+// all senses, physical (debounced pins) and dynamic (set remotely)
+static const tSense g_senses[] PROGMEM = {
+    {FLAG_SENSE_BRAKE, SENSE_PORT_D, (1 << PIN_C90_SENSE_BRAKE), EV_BRAKE_ON,
+     EV_BRAKE_OFF},
+    {FLAG_SENSE_CLAXON, SENSE_PORT_D, (1 << PIN_C90_SENSE_CLAXON),
+     EV_CLAXON_ON, EV_CLAXON_OFF},
+    {FLAG_SENSE_PILOT, SENSE_PORT_B, (1 << PIN_C90_SENSE_PILOT), EV_PILOT_ON,
+     EV_PILOT_OFF},
+    {FLAG_SENSE_LIGHT, SENSE_PORT_B, (1 << PIN_C90_SENSE_LIGHT), EV_LIGHT_ON,
+     EV_LIGHT_OFF},
+    {FLAG_SENSE_IGN, SENSE_PORT_D, (1 << PIN_C90_SENSE_IGN), EV_IGN_ON,
+     EV_IGN_OFF},
+    {FLAG_SENSE_LIGHT_RI, SENSE_PORT_B, (1 << PIN_C90_SENSE_LIGHT_RI),
+     EV_RI_ON, EV_RI_OFF},
+    {FLAG_SENSE_LIGHT_LI, SENSE_PORT_B, (1 << PIN_C90_SENSE_LIGHT_LI),
+     EV_LI_ON, EV_LI_OFF},
+    {FLAG_SENSE_WARNING, SENSE_PORT_D, (1 << PIN_C90_SENSE_WARNING),
+     EV_WARNING_ON, EV_WARNING_OFF},
+    {FLAG_SENSE_ALARM, SENSE_PORT_B, (1 << PIN_C90_SENSE_ALARM), EV_ALARM_ON,
+     EV_ALARM_OFF}};
 
 static void set_state(uint16_t st) {
   g_state = st;
@@ -69,25 +99,31 @@ static void remove_substate(uint16_t st) {
 }
 
 // Gets called from the main loop, reads all senses and puts them in the event
-// queue. The complete queue is handled (emptied) in each main loop iteration in
-// a FIFO way, so better put the higher priority events at the top, i.e. claxon
-// sound is more important then indicator light.
+// queue. The complete queue is handled (emptied) in each main loop iteration,
+// in the order of g_event_prio, i.e. claxon sound is more important then
+// indicator light.
 static void dispatch_events() {
-  check_brake();   // high prio, critical
-  check_claxon();  // high prio, critical
-  check_light();
-  check_ri();
-  check_li();
-  check_warning();
-  check_pilot();
-  check_alarm();
+  check_senses();
   check_alarm_settle();
   check_alarm_trigger();
   check_neutral();
   check_rtc();
   check_stats();
   check_gps();
-  check_ign();
+}
+
+// resolves an event in constant time via the event-indexed transition table:
+// guard condition first, then the event handler
+void handle_event(uint8_t ev) {
+  uint8_t (*check_func)(void);
+  void (*process_func)(void);
+  if (ev >= EV_COUNT) return;  // unknown event
+  check_func = (uint8_t(*)(void))pgm_read_word(&g_trans[ev].check_func);
+  if (check_func && check_func()) {  // guard condition to check if current
+                                     // state is accepting this event
+    process_func = (void (*)(void))pgm_read_word(&g_trans[ev].process_func);
+    process_func();  // call event handler
+  }
 }
 
 uint8_t check_brake_on() {
@@ -164,93 +200,46 @@ uint8_t check_alarm_off() {
           ((g_state & ~(ST_ALARM | ST_SLEEP)) == g_state));
 }
 
-// default function for checking sense pins and dispatching events
-void check_default(uint16_t sense_flag, uint8_t event_on, uint8_t event_off,
-                   uint8_t pin, volatile uint8_t *debounce_timer_flag,
-                   volatile uint8_t *debounce_state) {
-  // physical senses
-  if ((g_settings.p_senses_active & sense_flag) == sense_flag) {
-    // keep checking for 6 positives in a short timespan, so we're certain a
-    // button is pressed/released and it's not noise timespan is 6*5ms, so the
-    // delay is 30ms
-    if (*debounce_timer_flag) {  // timer-based flag is set (again)
-      *debounce_timer_flag = 0;  // reset to wait for next timer event
-      if (pin) {
-        *debounce_state =
-            (*debounce_state << 1);  // add 0 as a positive "off" press
-        if ((*debounce_state & 0b00111111) == 0) {
-          set_event(event_off);
-        }
-      } else {
-        *debounce_state =
-            (*debounce_state << 1) | 1;  // add 1 as a positive "on" press
-        if ((*debounce_state & 0b00111111) == 0b00111111) {
-          set_event(event_on);
-        }
+// generates the events of all senses: physical senses from the pins the
+// debouncer saw toggling, dynamic senses from their current status
+void check_senses() {
+  uint8_t changed[SENSE_PORTS];
+  uint8_t state[SENSE_PORTS];
+  uint8_t i, port, pin;
+  uint16_t flag;
+  cli();  // the debouncer runs in the TIMER0 interrupt
+  for (i = 0; i < SENSE_PORTS; i++) {
+    changed[i] = g_sense_changed[i];
+    g_sense_changed[i] = 0;
+    state[i] = g_debounce[i].state;
+  }
+  sei();
+  if (!(changed[SENSE_PORT_B] | changed[SENSE_PORT_D]) &&
+      !g_settings.d_senses_active) {
+    return;  // nothing toggled, no dynamic senses
+  }
+  for (i = 0; i < SENSE_CNT; i++) {
+    flag = pgm_read_word(&g_senses[i].sense_flag);
+    // physical senses
+    if ((g_settings.p_senses_active & flag) == flag) {
+      port = pgm_read_byte(&g_senses[i].port);
+      pin = pgm_read_byte(&g_senses[i].pin);
+      if (changed[port] & pin) {
+        set_event((state[port] & pin) ? pgm_read_byte(&g_senses[i].event_on)
+                                      : pgm_read_byte(&g_senses[i].event_off));
       }
     }
-  }
-  // dynamic senses
-  if ((g_settings.d_senses_active & sense_flag) == sense_flag) {
-    if ((g_d_senses_status & sense_flag) == sense_flag) {
-      set_event(event_on);
-    } else {
-      set_event(event_off);
+    // dynamic senses
+    if ((g_settings.d_senses_active & flag) == flag) {
+      if ((g_d_senses_status & flag) == flag) {
+        set_event(pgm_read_byte(&g_senses[i].event_on));
+      } else {
+        set_event(pgm_read_byte(&g_senses[i].event_off));
+      }
     }
   }
 }
 
-void check_brake() {
-  check_default(FLAG_SENSE_BRAKE, EV_BRAKE_ON, EV_BRAKE_OFF,
-                STATUS_C90_SENSE_BRAKE, &FLAG_DEBOUNCE_BRAKE,
-                &g_brake_debounce);
-}
-
-void check_claxon() {
-  check_default(FLAG_SENSE_CLAXON, EV_CLAXON_ON, EV_CLAXON_OFF,
-                STATUS_C90_SENSE_CLAXON, &FLAG_DEBOUNCE_CLAXON,
-                &g_claxon_debounce);
-}
-
-void check_pilot() {
-  check_default(FLAG_SENSE_PILOT, EV_PILOT_ON, EV_PILOT_OFF,
-                STATUS_C90_SENSE_PILOT, &FLAG_DEBOUNCE_PILOT,
-                &g_pilot_debounce);
-}
-
-void check_light() {
-  check_default(FLAG_SENSE_LIGHT, EV_LIGHT_ON, EV_LIGHT_OFF,
-                STATUS_C90_SENSE_LIGHT, &FLAG_DEBOUNCE_LIGHT,
-                &g_light_debounce);
-}
-
-void check_ign() {
-  check_default(FLAG_SENSE_IGN, EV_IGN_ON, EV_IGN_OFF, STATUS_C90_SENSE_IGN,
-                &FLAG_DEBOUNCE_IGN, &g_ign_debounce);
-}
-
-void check_ri() {
-  check_default(FLAG_SENSE_LIGHT_RI, EV_RI_ON, EV_RI_OFF,
-                STATUS_C90_SENSE_LIGHT_RI, &FLAG_DEBOUNCE_RI, &g_ri_debounce);
-}
-
-void check_li() {
-  check_default(FLAG_SENSE_LIGHT_LI, EV_LI_ON, EV_LI_OFF,
-                STATUS_C90_SENSE_LIGHT_LI, &FLAG_DEBOUNCE_LI, &g_li_debounce);
-}
-
-void check_warning() {
-  check_default(FLAG_SENSE_WARNING, EV_WARNING_ON, EV_WARNING_OFF,
-                STATUS_C90_SENSE_WARNING, &FLAG_DEBOUNCE_WARNING,
-                &g_warning_debounce);
-}
-
-void check_alarm() {
-  check_default(FLAG_SENSE_ALARM, EV_ALARM_ON, EV_ALARM_OFF,
-                STATUS_C90_SENSE_ALARM, &FLAG_DEBOUNCE_ALARM,
-                &g_alarm_debounce);
-}
-
 /*void check_alarm_settle() {*/
 /*[>if (g_state == ST_ALARM_SETTLE) {<]*/
 /*[>if (!FLAG_ALARM_SETTLE) { // first time in alarm settle mode<]*/
@@ -391,7 +380,9 @@ void check_gps() {
   if (g_gps_timer >= 35) {  // 20 ticks x 5ms=100ms interval poll, offset is
                             // 50ms to stats trigger to spread a bit
     g_gps_timer = 15;
+    gps_tick();
     command_trigger_gps(CMD_IF_IC);
+    command_trigger_gps(CMD_IF_SD);
 #ifdef EASY_TRACE
     command_trigger_gps(CMD_IF_DEBUG);
 #endif
@@ -420,34 +411,35 @@ void check_neutral() {
   }
 }
 
-// get the next event from the event queue (circular buffer)
+// get the next pending event from the event queue, highest priority first
 uint8_t get_event() {
-  uint8_t ev;
-  if (g_buffer_tail != g_buffer_head) {  // not empty
-    ev = g_event_buffer[g_buffer_tail];
-    g_buffer_tail++;
-    if (g_buffer_tail >= C90_EVENT_BUFFER_SIZE) {
-      g_buffer_tail = 0;
-    }
-    return ev;
-  } else {
+  uint8_t i, ev;
+  if (!g_event_pending) {
     return EV_VOID;  // no events, return a void event
   }
+  for (i = 0; i < sizeof(g_event_prio); i++) {
+    ev = pgm_read_byte(&g_event_prio[i]);
+    if (g_event_pending & ((uint32_t)1 << ev)) {
+      g_event_pending &= ~((uint32_t)1 << ev);
+      return ev;
+    }
+  }
+  g_event_pending = 0;  // only events without a priority left, discard them
+  return EV_VOID;
 }
 
-// put an event in the event queue (circular buffer)
+// put an event in the event queue (pending bitmask), an event that is already
+// pending gets coalesced with it, so the queue can't overflow and no event
+// ever gets evicted (e.g. a brake event by a flood of other events)
 void set_event(uint8_t ev) {
-  g_event_buffer[g_buffer_head] = ev;  // insert event at head position
-  g_buffer_head++;                     // advance head
-  if (g_buffer_head >= C90_EVENT_BUFFER_SIZE) {
-    g_buffer_head = 0;  // cycle back to start
-  }
-  if (g_buffer_head == g_buffer_tail) {
-    g_buffer_tail++;  // also move tail, basically destroying the oldest
-                      // event to make space
+  if (ev <= EV_ANY || ev >= EV_COUNT) {  // not a queueable event
+    g_event_drops++;
+    return;
   }
-  if (g_buffer_tail >= C90_EVENT_BUFFER_SIZE) {
-    g_buffer_tail = 0;  // cycle back to start
+  if (g_event_pending & ((uint32_t)1 << ev)) {
+    g_event_coalesced++;
+  } else {
+    g_event_pending |= ((uint32_t)1 << ev);
   }
 }
 
@@ -506,6 +498,7 @@ void process_ign_on() {
 #ifdef EASY_TRACE
   command_trigger_sound(g_settings.startup_sound, CMD_IF_DEBUG);
 #endif
+  command_log_start(g_settings.power_cycles);  // log this ride
   set_state(ST_ACTIVE);
 }
 
@@ -518,6 +511,7 @@ void process_ign_off() {
 #ifdef EASY_TRACE
   command_trigger_sound(SOUND_CMD_OFF, CMD_IF_DEBUG);
 #endif
+  command_log_stop();
   if (get_substate(ST_ALARM_SET)) {
     set_state(ST_ALARM);
   } else {
@@ -734,12 +728,12 @@ void init_ports() {
 }
 
 void set_p_senses_active(uint16_t senses) {
-  g_settings.p_senses_active = senses;
+  set_setting(&g_settings, SET_P_SENSES_ACTIVE, senses);
   update_settings(&g_settings);
 }
 
 void set_d_senses_active(uint16_t senses) {
-  g_settings.d_senses_active = senses;
+  set_setting(&g_settings, SET_D_SENSES_ACTIVE, senses);
   update_settings(&g_settings);
 }
 
@@ -774,6 +768,25 @@ void start_blink_timer() {
   OCR1A = g_settings.blink_speed;  // Set CTC compare value
 }
 
+// applies a setting that changed at runtime, no reboot needed. Settings that
+// are read where they are used (sounds, senses, alarm values) need nothing
+void apply_setting(uint8_t field) {
+  if (field == SET_BLINK_SPEED) {
+    cli();  // 16 bit timer registers
+    OCR1A = g_settings.blink_speed;
+    if (TCNT1 >= g_settings.blink_speed) {
+      TCNT1 = 0;  // a lower top could be passed already
+    }
+    sei();
+  } else if (field == SET_SD_LOG && get_substate(ST_ACTIVE)) {
+    if (g_settings.sd_log) {  // log the rest of this ride
+      command_log_start(g_settings.power_cycles);
+    } else {
+      command_log_stop();
+    }
+  }
+}
+
 // timer for the millisecond fraction of global timestamps
 void start_ms_timer() {
   // Configure timer 3 (16-bit) for CTC mode (Clear on Timer Compare)
@@ -789,15 +802,25 @@ void start_ms_timer() {
 
 // interrupt handler for 8bit timer0 that triggers every 5ms
 ISR(TIMER0_COMPA_vect) {
-  FLAG_DEBOUNCE_BRAKE = 1;
-  FLAG_DEBOUNCE_CLAXON = 1;
-  FLAG_DEBOUNCE_IGN = 1;
-  FLAG_DEBOUNCE_PILOT = 1;
-  FLAG_DEBOUNCE_LIGHT = 1;
-  FLAG_DEBOUNCE_RI = 1;
-  FLAG_DEBOUNCE_LI = 1;
-  FLAG_DEBOUNCE_ALARM = 1;
-  FLAG_DEBOUNCE_WARNING = 1;
+  // debounce all sense pins in parallel, they are active low
+  uint8_t pins = ~PINB & SENSE_PINS_B;
+  if (SPCR & (1 << SPE)) {
+    // ignore SI_LI when SPI transfer is active, since this SS pin is an
+    // output(1) during SPI hardware mode: keep its debounced state
+    pins = (pins & ~(1 << PIN_C90_SENSE_LIGHT_LI)) |
+           (g_debounce[SENSE_PORT_B].state & (1 << PIN_C90_SENSE_LIGHT_LI));
+  }
+  g_sense_changed[SENSE_PORT_B] |=
+      debounce_port(&g_debounce[SENSE_PORT_B], pins);
+  g_sense_changed[SENSE_PORT_D] |=
+      debounce_port(&g_debounce[SENSE_PORT_D], ~PIND & SENSE_PINS_D);
+  // now and then re-send all debounced senses, so an event that got rejected
+  // by its guard (e.g. during sleep) is retried once the state allows it
+  if (++g_sense_resync >= SENSE_RESYNC) {
+    g_sense_resync = 0;
+    g_sense_changed[SENSE_PORT_B] = SENSE_PINS_B;
+    g_sense_changed[SENSE_PORT_D] = SENSE_PINS_D;
+  }
   g_stats_timer++;
   g_gps_timer++;
   // TODO
@@ -831,18 +854,41 @@ ISR(TIMER3_COMPA_vect) {
   }
 }
 
+#ifdef EASY_BENCH
+// counts main loop iterations, reported over UART1 every RTC second
+void check_bench() {
+  static uint32_t loops;
+  static uint8_t seconds;
+  char tmp[11];
+  loops++;
+  if (seconds != g_datetime.seconds) {
+    seconds = g_datetime.seconds;
+    uart_put_str_1("LOOPS/S: ");
+    uart_put_str_1(ultoa(loops, tmp, 10));
+    uart_put_str_1(" EV_COALESCED: ");
+    uart_put_int_1(g_event_coalesced);
+    uart_put_str_1(" EV_DROPS: ");
+    uart_put_int_1(g_event_drops);
+    uart_put_str_1("\r\n");
+    loops = 0;
+  }
+}
+#endif
+
 void initialize() {
   g_mcu_reset = 0;
   MCUCR = 0x80;  // disable JTAG at runtime (2 calls in a row needed)
   MCUCR = 0x80;
   wdt_enable(WDTO_2S);                // enable 2 sec watchdog
   sei();                              // enable global interrupts
-  g_buffer_head = g_buffer_tail = 0;  // init event buffer
+  g_event_pending = 0;                // init event queue
+  debounce_init(&g_debounce[SENSE_PORT_B]);
+  debounce_init(&g_debounce[SENSE_PORT_D]);
   // get settings from EEPROM
   read_settings(&g_settings);
-  // write new power cycle count to EEPROM
-  g_settings.power_cycles += 1;
-  update_settings(&g_settings);
+  notify_settings(apply_setting);
+  // count this startup, its own EEPROM ring: no settings slot is written
+  count_power_cycle(&g_settings);
 
   // TODO: move to CMD_RTC function
   /*g_datetime.weekday = 4;*/
@@ -881,17 +927,12 @@ int main(void) {
     dispatch_events();
     while ((g_event = get_event()) !=
            EV_VOID) {  // handle the complete event queue in one go
-      for (uint8_t i = 0; i < TR_CNT; i++) {
-        if (g_event == g_trans[i].event) {  // check if event matches
-          if (g_trans[i].check_func()) {  // guard condition to check if current
-                                          // state is accepting this event
-            g_trans[i].process_func();    // call event handler
-            break;
-          }
-        }
-      }
+      handle_event(g_event);
     }
     command_process();
+#ifdef EASY_BENCH
+    check_bench();
+#endif
     if (!g_mcu_reset) {
       wdt_reset();  // reset the watchdog, i.e. don't reset the mcu
     }
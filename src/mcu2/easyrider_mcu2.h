@@ -110,6 +110,7 @@
 #define EV_WARNING_OFF 19
 #define EV_NEUTRAL_ON 20
 #define EV_NEUTRAL_OFF 21
+#define EV_COUNT 22  // number of events, size of the event-indexed table
 
 // all possible substate bits that are contained in the full g_state var
 // byte 1
@@ -137,6 +138,19 @@
 #define FLAG_SENSE_WARNING 128
 #define FLAG_SENSE_ALARM 256
 
+// debounced sense ports, all sense pins of a port are debounced in parallel
+#define SENSE_PORT_B 0
+#define SENSE_PORT_D 1
+#define SENSE_PORTS 2
+#define SENSE_PINS_B                                                     \
+  ((1 << PIN_C90_SENSE_PILOT) | (1 << PIN_C90_SENSE_LIGHT) |             \
+   (1 << PIN_C90_SENSE_LIGHT_RI) | (1 << PIN_C90_SENSE_LIGHT_LI) |       \
+   (1 << PIN_C90_SENSE_ALARM))
+#define SENSE_PINS_D                                                     \
+  ((1 << PIN_C90_SENSE_BRAKE) | (1 << PIN_C90_SENSE_CLAXON) |            \
+   (1 << PIN_C90_SENSE_IGN) | (1 << PIN_C90_SENSE_WARNING))
+#define SENSE_RESYNC 20  // 5ms ticks between re-sending all debounced senses
+
 #define FLAG_LIGHT_ON 1
 #define FLAG_LIGHT_OFF 0
 #define FLAG_CLAXON_ON 1
@@ -145,17 +159,20 @@
 #define SOUND_CMD_ON 253
 #define SOUND_CMD_OFF 254
 
-#define TR_CNT \
-  (sizeof(g_trans) / sizeof(*g_trans))  // number of transition table entries
+#define SENSE_CNT \
+  (sizeof(g_senses) / sizeof(*g_senses))  // number of sense table entries
 
-// size of event queue (circular buffer) -> this is the max size, if more events
-// occur in one go, then the oldest will be overwritten, just like Snake hitting
-// his tail
-#define C90_EVENT_BUFFER_SIZE 128
+// sense struct, physical and dynamic sense with its events
+typedef struct {
+  uint16_t sense_flag;  // FLAG_SENSE_* bit in the p/d_senses_active settings
+  uint8_t port;         // SENSE_PORT_* of the physical sense pin
+  uint8_t pin;          // physical sense pin mask on that port
+  uint8_t event_on;     // event when the sense turns on
+  uint8_t event_off;    // event when the sense turns off
+} tSense;
 
-// state transition struct
+// state transition struct, the transition table is indexed by event id
 typedef struct {
-  uint8_t event;                // event id
   uint8_t (*check_func)(void);  // guard condition function: is current state
                                 // allowed to process event?
   void (*process_func)(void);   // process function
@@ -167,10 +184,12 @@ tSettings g_settings;  // active settings (initially read from EEPROM)
 //// proto's
 static void initialize(void);
 static void dispatch_events(void);
+static void handle_event(uint8_t ev);
 static uint8_t get_event(void);
 static void set_event(uint8_t ev);
 static void start_sense_timer(void);
 static void start_blink_timer(void);
+static void apply_setting(uint8_t field);
 static void start_ms_timer(void);
 static void init_ports(void);
 static void set_state(uint16_t st);
@@ -201,10 +220,6 @@ static void process_warning_off(void);
 static void process_warning_on(void);
 static void process_alarm_on(void);
 static void process_alarm_off(void);
-static void check_default(uint16_t physical_flag, uint8_t event_on,
-                          uint8_t event_off, uint8_t pin,
-                          volatile uint8_t *debounce_timer_flag,
-                          volatile uint8_t *debounce_state);
 static uint8_t check_brake_on(void);
 static uint8_t check_brake_off(void);
 static uint8_t check_claxon_on(void);
@@ -225,22 +240,17 @@ static uint8_t check_alarm_on(void);
 static uint8_t check_alarm_off(void);
 static uint8_t check_neutral_on(void);
 static uint8_t check_neutral_off(void);
-static void check_alarm(void);
+static void check_senses(void);
 static void check_alarm_settle(void);
-static void check_brake(void);
-static void check_claxon(void);
-static void check_pilot(void);
-static void check_light(void);
-static void check_ign(void);
-static void check_ri(void);
-static void check_li(void);
 static void check_neutral(void);
 static void check_alarm_trigger(void);
-static void check_warning(void);
 static void check_stats(void);
 static void check_gps(void);
 static void check_rtc(void);
 static void all_relays(uint8_t lights, uint8_t claxon);
+#ifdef EASY_BENCH
+static void check_bench(void);
+#endif
 
 void set_p_senses_active(uint16_t senses);
 void set_d_senses_active(uint16_t senses);
@@ -251,18 +261,11 @@ static volatile uint8_t FLAG_BLINK_RI;       // right indicator blink needed
 static volatile uint8_t FLAG_BLINK_LI;       // left indicator blink needed
 static volatile uint8_t FLAG_BLINK_WARNING;  // all indicators blink needed
 static volatile uint8_t FLAG_RTC;  // flag to retrieve a new date/time from RTC
-static volatile uint8_t FLAG_DEBOUNCE_ALARM;    // alarm debounce
-static volatile uint8_t FLAG_DEBOUNCE_BRAKE;    // brake debounce
-static volatile uint8_t FLAG_DEBOUNCE_CLAXON;   // claxon debounce
-static volatile uint8_t FLAG_DEBOUNCE_PILOT;    // pilot debounce
-static volatile uint8_t FLAG_DEBOUNCE_LIGHT;    // light debounce
-static volatile uint8_t FLAG_DEBOUNCE_IGN;      // ignition key debounce
-static volatile uint8_t FLAG_DEBOUNCE_RI;       // right indicator debounce
-static volatile uint8_t FLAG_DEBOUNCE_LI;       // left indicator debounce
-static volatile uint8_t FLAG_DEBOUNCE_WARNING;  // warning debounce
 
 // globals, non-static ones are used in other modules as an "extern", e.g. in
 // the command module
+volatile uint16_t g_event_coalesced;  // events merged with a pending duplicate
+volatile uint16_t g_event_drops;      // events rejected by the event queue
 volatile uint16_t g_state;            // the current state
 volatile uint8_t g_gear;              // current gear or neutral
 volatile uint16_t g_accelx;           // X-axis voltage of accelerometer
@@ -274,28 +277,22 @@ volatile uint8_t g_mcu_reset;  // let the mcu reset by the watchdog, can be
                                // triggered remotely via command
 
 static volatile uint8_t g_event;  // the current event
-static volatile uint8_t
-    g_event_buffer[C90_EVENT_BUFFER_SIZE];  // the event queue (circular buffer)
-static volatile uint8_t g_stats_timer;      // SPI polling command counter
-static volatile uint8_t g_gps_timer;        // GPS polling counter
-static volatile uint8_t g_buffer_head;      // index of first item to process
-static volatile uint8_t g_buffer_tail;      // index of last item to process
+static volatile uint32_t
+    g_event_pending;  // the event queue: bitmask of pending events, index
+                      // is the event id
+static volatile uint8_t g_stats_timer;  // SPI polling command counter
+static volatile uint8_t g_gps_timer;    // GPS polling counter
 static volatile uint16_t
     g_milliseconds;  // current milliseconds for timestamping
 static volatile uint8_t g_seconds_prev;  // previous seconds for timestamping,
                                          // needed to reset/sync with ms timer
 static volatile uint8_t g_update_date;   // retrieve new date/time from RTC
 
-// debounce bitmasks
-static volatile uint8_t g_brake_debounce;    // brake light
-static volatile uint8_t g_claxon_debounce;   // claxon sound
-static volatile uint8_t g_ign_debounce;      // ignition sound
-static volatile uint8_t g_pilot_debounce;    // pilot light
-static volatile uint8_t g_light_debounce;    // main light
-static volatile uint8_t g_ri_debounce;       // right indicators light
-static volatile uint8_t g_li_debounce;       // left indicators light
-static volatile uint8_t g_warning_debounce;  // warning switch
-static volatile uint8_t g_alarm_debounce;    // alarm switch
+// sense debouncing
+static tDebounce g_debounce[SENSE_PORTS];  // vertical counters per port
+static volatile uint8_t
+    g_sense_changed[SENSE_PORTS];  // debounced sense pins that toggled
+static volatile uint8_t g_sense_resync;  // ticks until all senses are re-sent
 
 // TODO
 // static volatile uint16_t g_adc_avg_voltage[3]; // average ADC voltages: 0-2
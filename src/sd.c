@@ -0,0 +1,295 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+#include "sd.h"
+#include "spi.h"
+
+#define SD_SPI_INIT SPI_CLOCK_DIV64  // 312.5kHz, at most 400kHz until ready
+#define SD_SPI_CLOCK SPI_CLOCK_DIV4  // 5MHz, same as the mcu link
+
+// commands
+#define SD_CMD0 0     // GO_IDLE_STATE
+#define SD_CMD8 8     // SEND_IF_COND
+#define SD_CMD16 16   // SET_BLOCKLEN
+#define SD_CMD17 17   // READ_SINGLE_BLOCK
+#define SD_CMD24 24   // WRITE_BLOCK
+#define SD_CMD25 25   // WRITE_MULTIPLE_BLOCK
+#define SD_CMD55 55   // APP_CMD, next command is an application command
+#define SD_CMD58 58   // READ_OCR
+#define SD_ACMD41 41  // SD_SEND_OP_COND
+
+#define SD_R1_READY 0x00
+#define SD_R1_IDLE 0x01
+#define SD_R1_ILLEGAL 0x04
+#define SD_IF_COND 0x1AA        // 2.7-3.6V, check pattern 0xAA
+#define SD_OCR_CCS 0x40         // card capacity status bit in the 1st OCR byte
+#define SD_ACMD41_HCS (1UL << 30)  // host supports high capacity cards
+
+// data tokens
+#define SD_TOKEN_START 0xFE  // single block read/write
+#define SD_TOKEN_MULTI 0xFC  // block of a multi-block write
+#define SD_TOKEN_STOP 0xFD   // ends a multi-block write
+#define SD_DATA_MASK 0x1F
+#define SD_DATA_ACCEPTED 0x05
+
+#define SD_INIT_TRIES 1000     // 1ms apart, leaving the idle state takes <1s
+#define SD_TOKEN_TRIES 0xFFFF  // bytes to wait for a read token, ~100ms
+
+#define SD_ADDRESS(block) (g_sd_type == SD_HC ? (block) : (block) << 9)
+
+static tSDType g_sd_type;
+static uint32_t g_sd_stream;  // next block of the open multi-block write, 0
+                              // when there's none
+
+static uint8_t sd_claim(uint8_t speed);
+static void sd_release(void);
+static uint8_t sd_begin(void);
+static uint8_t sd_stop_stream(void);
+static uint8_t sd_command(uint8_t cmd, uint32_t arg);
+static uint8_t sd_send_data(uint8_t token, const uint8_t *buf);
+
+// takes the bus from the mcu link, only in between its bursts
+static uint8_t sd_claim(uint8_t speed) {
+  cli();  // a burst ends in the SPI interrupt
+  if (g_spi_state != SPI_OFF) {
+    sei();
+    return 0;
+  }
+  g_spi_state = SPI_SD;
+  sei();
+  spi_init(SPI_MASTER, speed, SPI_MODE0, SPI_MSBFIRST, SPI_NO_INTERRUPT);
+  spi_enable();
+  spi_sd_start();
+  return 1;
+}
+
+// hands the bus back to the mcu link
+static void sd_release() {
+  spi_sd_stop();
+  spi_communicate(0xFF);  // the card releases MISO on the next clock
+  spi_disable();
+  spi_init(SPI_OFF, SD_SPI_CLOCK, SPI_MODE0, SPI_MSBFIRST, SPI_NO_INTERRUPT);
+  g_spi_state = SPI_OFF;
+}
+
+// claims the bus for a block operation, the card holds MISO low while it's
+// still programming a block written before
+static uint8_t sd_begin() {
+  if (g_sd_type == SD_NONE) {
+    return SD_ERROR;
+  }
+  if (!sd_claim(SD_SPI_CLOCK)) {
+    return SD_BUSY;
+  }
+  if (spi_communicate(0xFF) != 0xFF) {
+    sd_release();
+    return SD_BUSY;
+  }
+  return SD_OK;
+}
+
+// ends an open multi-block write, the card programs its last block after
+// this: releases the bus and returns SD_BUSY
+static uint8_t sd_stop_stream() {
+  spi_communicate(SD_TOKEN_STOP);
+  spi_communicate(0xFF);  // busy starts one byte after the stop token
+  g_sd_stream = 0;
+  sd_release();
+  return SD_BUSY;
+}
+
+// sends a command frame, returns the R1 response
+static uint8_t sd_command(uint8_t cmd, uint32_t arg) {
+  uint8_t r1 = 0xFF;
+  uint8_t i;
+  spi_communicate(0xFF);
+  spi_communicate(0x40 | cmd);
+  spi_communicate(arg >> 24);
+  spi_communicate(arg >> 16);
+  spi_communicate(arg >> 8);
+  spi_communicate(arg);
+  // the CRC only counts before the card is in SPI mode
+  spi_communicate(cmd == SD_CMD0 ? 0x95 : (cmd == SD_CMD8 ? 0x87 : 0x01));
+  for (i = 0; i < 8 && (r1 & 0x80); i++) {  // response within 8 bytes
+    r1 = spi_communicate(0xFF);
+  }
+  return r1;
+}
+
+// sends a data block, returns SD_OK when the card accepted it
+static uint8_t sd_send_data(uint8_t token, const uint8_t *buf) {
+  uint16_t i;
+  spi_communicate(token);
+  for (i = 0; i < SD_BLOCK_SIZE; i++) {
+    spi_communicate(buf[i]);
+  }
+  spi_communicate(0xFF);  // CRC, not checked
+  spi_communicate(0xFF);
+  if ((spi_communicate(0xFF) & SD_DATA_MASK) != SD_DATA_ACCEPTED) {
+    return SD_ERROR;
+  }
+  return SD_OK;
+}
+
+// initializes the card: SPI mode, voltage check, leaving the idle state and
+// the addressing mode. Blocking (up to 1s), only called at startup
+uint8_t sd_init() {
+  uint8_t r1, i;
+  uint8_t ocr[4];
+  uint16_t tries = SD_INIT_TRIES;
+  tSDType type = SD_V1;
+  g_sd_type = SD_NONE;
+  g_sd_stream = 0;
+  if (!sd_claim(SD_SPI_INIT)) {
+    return SD_BUSY;
+  }
+  spi_sd_stop();  // at least 74 clocks with CS high to enter native mode
+  for (i = 0; i < 10; i++) {
+    spi_communicate(0xFF);
+  }
+  spi_sd_start();
+  r1 = sd_command(SD_CMD0, 0);  // CS low: SPI mode
+  if (r1 == SD_R1_IDLE) {
+    if (sd_command(SD_CMD8, SD_IF_COND) == SD_R1_IDLE) {  // version 2
+      for (i = 0; i < 4; i++) {
+        ocr[i] = spi_communicate(0xFF);
+      }
+      type = (ocr[2] == 0x01 && ocr[3] == 0xAA) ? SD_V2 : SD_NONE;
+    }
+    // version 1 cards answer illegal command on CMD8
+    while (type != SD_NONE && tries--) {
+      sd_command(SD_CMD55, 0);
+      r1 = sd_command(SD_ACMD41, type == SD_V2 ? SD_ACMD41_HCS : 0);
+      if (r1 == SD_R1_READY) {
+        break;
+      }
+      _delay_ms(1);
+    }
+    if (r1 == SD_R1_READY && type == SD_V2 &&
+        sd_command(SD_CMD58, 0) == SD_R1_READY) {
+      for (i = 0; i < 4; i++) {
+        ocr[i] = spi_communicate(0xFF);
+      }
+      if (ocr[0] & SD_OCR_CCS) {
+        type = SD_HC;
+      }
+    }
+    if (r1 == SD_R1_READY && type != SD_HC) {  // byte addressed, 512 blocks
+      r1 = sd_command(SD_CMD16, SD_BLOCK_SIZE);
+    }
+    if (r1 == SD_R1_READY) {
+      g_sd_type = type;
+    }
+  }
+  sd_release();
+  return g_sd_type == SD_NONE ? SD_ERROR : SD_OK;
+}
+
+// reads a block into buf
+uint8_t sd_read_block(uint32_t block, uint8_t *buf) {
+  uint8_t status = sd_begin();
+  uint8_t token = 0xFF;
+  uint16_t i;
+  if (status != SD_OK) {
+    return status;
+  }
+  if (g_sd_stream) {
+    return sd_stop_stream();
+  }
+  status = SD_ERROR;
+  if (sd_command(SD_CMD17, SD_ADDRESS(block)) == SD_R1_READY) {
+    for (i = SD_TOKEN_TRIES; i && token == 0xFF; i--) {
+      token = spi_communicate(0xFF);
+    }
+    if (token == SD_TOKEN_START) {
+      for (i = 0; i < SD_BLOCK_SIZE; i++) {
+        buf[i] = spi_communicate(0xFF);
+      }
+      spi_communicate(0xFF);  // CRC, not checked
+      spi_communicate(0xFF);
+      status = SD_OK;
+    }
+  }
+  sd_release();
+  return status;
+}
+
+// writes a single block, the card programs it after the bus is released
+uint8_t sd_write_block(uint32_t block, const uint8_t *buf) {
+  uint8_t status = sd_begin();
+  if (status != SD_OK) {
+    return status;
+  }
+  if (g_sd_stream) {
+    return sd_stop_stream();
+  }
+  status = SD_ERROR;
+  if (sd_command(SD_CMD24, SD_ADDRESS(block)) == SD_R1_READY) {
+    spi_communicate(0xFF);
+    status = sd_send_data(SD_TOKEN_START, buf);
+  }
+  sd_release();
+  return status;
+}
+
+// writes consecutive blocks as one multi-block write: the card doesn't have to
+// close and reopen its write for each block. The write stays open when the bus
+// is released in between, a block that doesn't follow the previous one, any
+// other block operation or sd_sync() end it
+uint8_t sd_write_stream(uint32_t block, const uint8_t *buf) {
+  uint8_t status = sd_begin();
+  if (status != SD_OK) {
+    return status;
+  }
+  if (g_sd_stream != block) {
+    if (g_sd_stream) {
+      return sd_stop_stream();
+    }
+    if (sd_command(SD_CMD25, SD_ADDRESS(block)) != SD_R1_READY) {
+      sd_release();
+      return SD_ERROR;
+    }
+    spi_communicate(0xFF);
+  }
+  status = sd_send_data(SD_TOKEN_MULTI, buf);
+  if (status != SD_OK) {  // rejected, end the write
+    g_sd_stream = block + 1;
+    sd_stop_stream();
+    return SD_ERROR;
+  }
+  g_sd_stream = block + 1;
+  sd_release();
+  return SD_OK;
+}
+
+// ends an open multi-block write, returns SD_OK once the card programmed all
+// blocks written so far
+uint8_t sd_sync() {
+  uint8_t status = sd_begin();
+  if (status != SD_OK) {
+    return status;
+  }
+  if (g_sd_stream) {
+    return sd_stop_stream();
+  }
+  sd_release();
+  return SD_OK;
+}
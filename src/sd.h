@@ -0,0 +1,49 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef SD_H_INCLUDED
+#define SD_H_INCLUDED
+
+#include <stdint.h>
+
+// SD card block device over the SPI bus (mcu2), shared with the mcu link: the
+// bus is claimed per block and released right after, a card that's still
+// programming is never waited for. Block operations return SD_BUSY then, try
+// again later. Kept free of avr includes, a host build can put a disk image
+// file behind this interface
+
+#define SD_BLOCK_SIZE 512
+
+#define SD_OK 0     // done
+#define SD_BUSY 1   // bus in use by the mcu link or card busy, retry later
+#define SD_ERROR 2  // no (initialized) card, or the card rejected the request
+
+typedef enum {
+  SD_NONE,  // no card or initialization failed
+  SD_V1,    // SD version 1, byte addressed
+  SD_V2,    // SD version 2 standard capacity, byte addressed
+  SD_HC     // SDHC/SDXC, block addressed
+} tSDType;
+
+uint8_t sd_init(void);
+uint8_t sd_read_block(uint32_t block, uint8_t *buf);
+uint8_t sd_write_block(uint32_t block, const uint8_t *buf);
+uint8_t sd_write_stream(uint32_t block, const uint8_t *buf);
+uint8_t sd_sync(void);
+
+#endif
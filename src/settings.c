@@ -4,105 +4,250 @@
  *  http://www.visionnaire.nl
  *
  */
+#include <avr/pgmspace.h>
+#include <stddef.h>
+#include <util/crc16.h>
+
 #include "settings.h"
 
-// setting these to defaults, so an .eep ROM file is generated
-// this struct will be used as the reference layout to read/write to the proper
-// pointer addresses in EEPROM
-tSettings EEMEM g_rom_settings = {
-    ROM_SYSTEM_NAME,       ROM_POWER_CYCLES,
-    ROM_PINCODE,           ROM_SD_LOG,
-    ROM_SW_VERSION,        ROM_HW_VERSION,
-    ROM_P_SENSES_ACTIVE,   ROM_D_SENSES_ACTIVE,
-    ROM_ALARM_SETTLE_TIME, ROM_INDICATOR_SOUND,
-    ROM_BLINK_SPEED,       ROM_ALARM_COUNTER,
-    ROM_ALARM_TRIGGER,     ROM_ALARM_TRIGGER_COUNTER,
-    ROM_ALARM_THRES_MIN,   ROM_ALARM_TRHES_MAX,
-    ROM_STARTUP_SOUND};
+#define ROM_SETTINGS                                              \
+  {                                                               \
+    ROM_SYSTEM_NAME, ROM_POWER_CYCLES, ROM_PINCODE, ROM_SD_LOG,   \
+        ROM_SW_VERSION, ROM_HW_VERSION, ROM_P_SENSES_ACTIVE,      \
+        ROM_D_SENSES_ACTIVE, ROM_ALARM_SETTLE_TIME,               \
+        ROM_INDICATOR_SOUND, ROM_BLINK_SPEED, ROM_ALARM_COUNTER,  \
+        ROM_ALARM_TRIGGER, ROM_ALARM_TRIGGER_COUNTER,             \
+        ROM_ALARM_THRES_MIN, ROM_ALARM_TRHES_MAX, ROM_STARTUP_SOUND \
+  }
+
+// one stored copy of the settings, the sequence number is written last and
+// commits the slot, the crc covers sequence and settings
+typedef struct {
+  uint16_t sequence;
+  tSettings settings;
+  uint16_t crc;
+} tSettingsSlot;
+
+// EEPROM layout: the settings block of older firmware stays at address 0, it
+// holds the defaults in the .eep ROM file and is read once to migrate a device
+// that has no valid slot yet. Every write goes to the next slot of the ring.
+// The power cycle counter counts on in a ring of its own, its value in the
+// slots is only used while that ring is still erased
+typedef struct {
+  tSettings legacy;
+  tSettingsSlot slot[SETTINGS_SLOTS];
+  uint16_t cycles[SETTINGS_CYCLES];
+} tSettingsRom;
+
+tSettingsRom EEMEM g_rom_settings = {ROM_SETTINGS};
+
+static const tSettings g_default_settings PROGMEM = ROM_SETTINGS;
+
+static uint8_t g_slot;       // slot holding the current settings
+static uint16_t g_sequence;  // sequence number of that slot
+static uint8_t g_cycle;      // newest entry of the power cycle ring
+
+// position and valid range of a runtime setting
+typedef struct {
+  uint8_t offset;  // offset in tSettings
+  uint8_t size;    // 1 or 2 bytes
+  uint16_t min;
+  uint16_t max;
+} tSettingsLayout;
+
+#define SET_LAYOUT(field, min, max) \
+  { offsetof(tSettings, field), sizeof(((tSettings *)0)->field), min, max }
+
+// blink timer ticks of 0.0000512 secs, faster than 0.05 secs isn't blinking
+#define BLINK_SPEED_MIN 977
+
+// indexed by tSettingsField
+static const tSettingsLayout g_settings_layout[SET_FIELDS] PROGMEM = {
+    SET_LAYOUT(sd_log, 0, 1),
+    SET_LAYOUT(p_senses_active, 0, 0xFFFF),
+    SET_LAYOUT(d_senses_active, 0, 0xFFFF),
+    SET_LAYOUT(alarm_settle_time, 0, 0xFFFF),
+    SET_LAYOUT(indicator_sound, 0, 1),
+    SET_LAYOUT(blink_speed, BLINK_SPEED_MIN, 0xFFFF),
+    SET_LAYOUT(alarm_counter, 0, 255),
+    SET_LAYOUT(alarm_trigger, 0, 255),
+    SET_LAYOUT(alarm_trigger_counter, 0, 255),
+    SET_LAYOUT(alarm_thres_min, 0, 1023),  // 10 bit ADC values
+    SET_LAYOUT(alarm_thres_max, 0, 1023),
+    SET_LAYOUT(startup_sound, 0, 255)};
+
+static tSettingsNotify g_notify;  // applies changed settings at runtime
+
+// the sequence number after seq, skipping the value of erased EEPROM
+static uint16_t next_sequence(uint16_t seq) {
+  seq++;
+  return (seq == SETTINGS_EMPTY) ? 0 : seq;
+}
+
+static uint16_t slot_crc(const tSettingsSlot *slot) {
+  const uint8_t *p = (const uint8_t *)slot;
+  uint16_t crc = 0xFFFF;
+  uint8_t i;
+  for (i = 0; i < sizeof(tSettingsSlot) - sizeof(uint16_t); i++) {
+    crc = _crc16_update(crc, p[i]);
+  }
+  return crc;
+}
+
+// reads a slot, returns 1 if it holds valid settings
+static uint8_t slot_read(uint8_t i, tSettingsSlot *slot) {
+  eeprom_read_block((void *)slot, (const void *)&g_rom_settings.slot[i],
+                    sizeof(tSettingsSlot));
+  return (slot->sequence != SETTINGS_EMPTY) && (slot->crc == slot_crc(slot));
+}
+
+// stores the settings in the slot after the current one, eeprom_update only
+// writes the bytes that differ from what that slot held before
+static void slot_write(const tSettings *settings) {
+  tSettingsSlot slot;
+  uint8_t i = (g_slot + 1) % SETTINGS_SLOTS;
+  slot.sequence = next_sequence(g_sequence);
+  memcpy(&slot.settings, settings, sizeof(tSettings));
+  slot.crc = slot_crc(&slot);
+  eeprom_update_block((const void *)&slot.settings,
+                      &g_rom_settings.slot[i].settings, sizeof(tSettings));
+  eeprom_update_word(&g_rom_settings.slot[i].crc, slot.crc);
+  eeprom_update_word(&g_rom_settings.slot[i].sequence, slot.sequence);
+  g_slot = i;
+  g_sequence = slot.sequence;
+}
+
+// reads the power cycle counter, keeps count when the ring is still erased.
+// The ring is written from entry 0 on, the newest entry is the last one that
+// counts on from entry 0: erased or .eep filled entries after it don't
+static void cycles_read(uint16_t *count) {
+  uint16_t value = eeprom_read_word(&g_rom_settings.cycles[0]);
+  uint16_t next;
+  uint8_t i;
+  if (value == SETTINGS_EMPTY) {  // the first count starts the ring at 0
+    g_cycle = SETTINGS_CYCLES - 1;
+    return;
+  }
+  for (i = 1; i < SETTINGS_CYCLES; i++) {
+    next = eeprom_read_word(&g_rom_settings.cycles[i]);
+    if (next != next_sequence(value)) {
+      break;
+    }
+    value = next;
+  }
+  g_cycle = i - 1;
+  *count = value;
+}
 
 // reads the current settings, or resets it to default settings when no valid
-// ROM values are found
+// ROM values are found. The newest slot is the one whose successor in the ring
+// was not written after it, when its crc fails (power lost while writing) the
+// slots before it are tried
 void read_settings(tSettings *settings) {
-  eeprom_read_block((void *)settings->system_name,
-                    (const void *)g_rom_settings.system_name, 10);
+  tSettingsSlot slot;
+  uint16_t seq, next = eeprom_read_word(&g_rom_settings.slot[0].sequence);
+  uint8_t i, n;
+  for (i = SETTINGS_SLOTS - 1; i > 0; i--) {  // scan backwards from the end
+    seq = eeprom_read_word(&g_rom_settings.slot[i].sequence);
+    if (seq != SETTINGS_EMPTY && next != next_sequence(seq)) {
+      break;
+    }
+    next = seq;
+  }
+  for (n = 0; n < SETTINGS_SLOTS; n++) {
+    if (slot_read(i, &slot)) {
+      memcpy(settings, &slot.settings, sizeof(tSettings));
+      settings->system_name[9] = '\0';
+      g_slot = i;
+      g_sequence = slot.sequence;
+      cycles_read(&settings->power_cycles);  // kept when the ring is erased
+      return;
+    }
+    i = (i + SETTINGS_SLOTS - 1) % SETTINGS_SLOTS;
+  }
+  // no valid slot, the next write starts the ring at slot 0
+  g_slot = SETTINGS_SLOTS - 1;
+  g_sequence = SETTINGS_EMPTY - 1;
+  eeprom_read_block((void *)settings, (const void *)&g_rom_settings.legacy,
+                    sizeof(tSettings));
   settings->system_name[9] = '\0';  // force valid string in case ROM is invalid
-  if (strncmp(settings->system_name, ROM_SYSTEM_NAME, 9) !=
-      0) {  // invalid ROM, write default settings first
-    reset_settings();
-    eeprom_read_block((void *)settings->system_name,
-                      (const void *)g_rom_settings.system_name, 10);
+  if (strncmp(settings->system_name, ROM_SYSTEM_NAME, 9) != 0) {
+    memcpy_P(settings, &g_default_settings, sizeof(tSettings));
   }
-  settings->power_cycles = eeprom_read_word(&g_rom_settings.power_cycles);
-  eeprom_read_block((void *)settings->pincode,
-                    (const void *)g_rom_settings.pincode, 5);
-  settings->sd_log = eeprom_read_byte(&g_rom_settings.sd_log);
-  settings->sw_version = eeprom_read_word(&g_rom_settings.sw_version);
-  eeprom_read_block((void *)settings->hw_version,
-                    (const void *)g_rom_settings.hw_version, 10);
-  settings->p_senses_active = eeprom_read_word(&g_rom_settings.p_senses_active);
-  settings->d_senses_active = eeprom_read_word(&g_rom_settings.d_senses_active);
-  settings->alarm_settle_time =
-      eeprom_read_word(&g_rom_settings.alarm_settle_time);
-  settings->indicator_sound = eeprom_read_byte(&g_rom_settings.indicator_sound);
-  settings->blink_speed = eeprom_read_word(&g_rom_settings.blink_speed);
-  settings->alarm_counter = eeprom_read_byte(&g_rom_settings.alarm_counter);
-  settings->alarm_trigger = eeprom_read_byte(&g_rom_settings.alarm_trigger);
-  settings->alarm_trigger_counter =
-      eeprom_read_byte(&g_rom_settings.alarm_trigger_counter);
-  settings->alarm_thres_min = eeprom_read_word(&g_rom_settings.alarm_thres_min);
-  settings->alarm_thres_max = eeprom_read_word(&g_rom_settings.alarm_thres_max);
-  settings->startup_sound = eeprom_read_byte(&g_rom_settings.startup_sound);
+  cycles_read(&settings->power_cycles);
+  slot_write(settings);
 }
 
-// eeprom_update writes only the changed values to ROM
+// stores the settings in a new slot, nothing is written when they equal the
+// current slot. The power cycle counter has its own ring, it doesn't count
 void update_settings(tSettings *settings) {
-  eeprom_update_block((const void *)settings->system_name,
-                      &g_rom_settings.system_name, 10);
-  eeprom_update_word(&g_rom_settings.power_cycles, settings->power_cycles);
-  eeprom_update_block((const void *)settings->pincode, &g_rom_settings.pincode,
-                      5);
-  eeprom_update_byte(&g_rom_settings.sd_log, settings->sd_log);
-  eeprom_update_word(&g_rom_settings.sw_version, settings->sw_version);
-  eeprom_update_block((const void *)settings->hw_version,
-                      &g_rom_settings.hw_version, 10);
-  eeprom_update_word(&g_rom_settings.p_senses_active,
-                     settings->p_senses_active);
-  eeprom_update_word(&g_rom_settings.d_senses_active,
-                     settings->d_senses_active);
-  eeprom_update_word(&g_rom_settings.alarm_settle_time,
-                     settings->alarm_settle_time);
-  eeprom_update_byte(&g_rom_settings.indicator_sound,
-                     settings->indicator_sound);
-  eeprom_update_word(&g_rom_settings.blink_speed, settings->blink_speed);
-  eeprom_update_byte(&g_rom_settings.alarm_counter, settings->alarm_counter);
-  eeprom_update_byte(&g_rom_settings.alarm_trigger, settings->alarm_trigger);
-  eeprom_update_byte(&g_rom_settings.alarm_trigger_counter,
-                     settings->alarm_trigger_counter);
-  eeprom_update_word(&g_rom_settings.alarm_thres_min,
-                     settings->alarm_thres_min);
-  eeprom_update_word(&g_rom_settings.alarm_thres_max,
-                     settings->alarm_thres_max);
-  eeprom_update_byte(&g_rom_settings.startup_sound, settings->startup_sound);
+  const uint8_t *p = (const uint8_t *)settings;
+  const uint8_t *rom = (const uint8_t *)&g_rom_settings.slot[g_slot].settings;
+  uint8_t i;
+  for (i = 0; i < sizeof(tSettings); i++) {
+    if (i == offsetof(tSettings, power_cycles)) {
+      i += sizeof(settings->power_cycles) - 1;
+    } else if (eeprom_read_byte(rom + i) != p[i]) {
+      slot_write(settings);
+      return;
+    }
+  }
 }
 
-// resets the whole ROM to the default values
+// stores the default values as the current settings
 void reset_settings() {
-  eeprom_update_block(ROM_SYSTEM_NAME, &g_rom_settings.system_name, 10);
-  eeprom_update_word(&g_rom_settings.power_cycles, ROM_POWER_CYCLES);
-  eeprom_update_block(ROM_PINCODE, &g_rom_settings.pincode, 5);
-  eeprom_update_byte(&g_rom_settings.sd_log, ROM_SD_LOG);
-  eeprom_update_word(&g_rom_settings.sw_version, ROM_SW_VERSION);
-  eeprom_update_block(ROM_HW_VERSION, &g_rom_settings.hw_version, 10);
-  eeprom_update_word(&g_rom_settings.p_senses_active, ROM_P_SENSES_ACTIVE);
-  eeprom_update_word(&g_rom_settings.d_senses_active, ROM_D_SENSES_ACTIVE);
-  eeprom_update_word(&g_rom_settings.alarm_settle_time, ROM_ALARM_SETTLE_TIME);
-  eeprom_update_byte(&g_rom_settings.indicator_sound, ROM_INDICATOR_SOUND);
-  eeprom_update_word(&g_rom_settings.blink_speed, ROM_BLINK_SPEED);
-  eeprom_update_byte(&g_rom_settings.alarm_counter, ROM_ALARM_COUNTER);
-  eeprom_update_byte(&g_rom_settings.alarm_trigger, ROM_ALARM_TRIGGER);
-  eeprom_update_byte(&g_rom_settings.alarm_trigger_counter,
-                     ROM_ALARM_TRIGGER_COUNTER);
-  eeprom_update_word(&g_rom_settings.alarm_thres_min, ROM_ALARM_THRES_MIN);
-  eeprom_update_word(&g_rom_settings.alarm_thres_max, ROM_ALARM_TRHES_MAX);
-  eeprom_update_byte(&g_rom_settings.startup_sound, ROM_STARTUP_SOUND);
+  tSettings settings;
+  memcpy_P(&settings, &g_default_settings, sizeof(tSettings));
+  slot_write(&settings);
+}
+
+// counts a startup: the power cycle counter goes to the next entry of its
+// ring, eeprom_update writes the 1 or 2 bytes that differ from the count that
+// entry held a ring ago
+void count_power_cycle(tSettings *settings) {
+  settings->power_cycles = next_sequence(settings->power_cycles);
+  g_cycle = (g_cycle + 1) % SETTINGS_CYCLES;
+  eeprom_update_word(&g_rom_settings.cycles[g_cycle], settings->power_cycles);
+}
+
+// value of a runtime setting
+uint16_t get_setting(const tSettings *settings, uint8_t field) {
+  const uint8_t *p;
+  if (field >= SET_FIELDS) {
+    return 0;
+  }
+  p = (const uint8_t *)settings +
+      pgm_read_byte(&g_settings_layout[field].offset);
+  if (pgm_read_byte(&g_settings_layout[field].size) == 1) {
+    return *p;
+  }
+  return p[0] | (p[1] << 8);
+}
+
+// changes a runtime setting and notifies it when the value differs, returns 0
+// for an unknown setting or a value out of range.
+// NOTE: only RAM is changed, call update_settings() afterwards to store one or
+// more changes in a single EEPROM slot write
+uint8_t set_setting(tSettings *settings, uint8_t field, uint16_t value) {
+  uint8_t *p;
+  if (field >= SET_FIELDS ||
+      value < pgm_read_word(&g_settings_layout[field].min) ||
+      value > pgm_read_word(&g_settings_layout[field].max)) {
+    return 0;
+  }
+  if (value == get_setting(settings, field)) {
+    return 1;
+  }
+  p = (uint8_t *)settings + pgm_read_byte(&g_settings_layout[field].offset);
+  p[0] = value;
+  if (pgm_read_byte(&g_settings_layout[field].size) == 2) {
+    p[1] = value >> 8;
+  }
+  if (g_notify) {
+    g_notify(field);
+  }
+  return 1;
 }
+
+// registers the function that applies changed settings at runtime
+void notify_settings(tSettingsNotify notify) { g_notify = notify; }
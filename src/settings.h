@@ -31,6 +31,18 @@
 #define ROM_ALARM_TRHES_MAX 550
 #define ROM_STARTUP_SOUND 255
 
+// number of slots in the EEPROM ring, every one holds a full copy of the
+// settings, can be overridden with CFLAGS
+#ifndef SETTINGS_SLOTS
+#define SETTINGS_SLOTS 16
+#endif
+#define SETTINGS_EMPTY 0xFFFF  // sequence number of an erased slot
+// entries in the EEPROM ring of the power cycle counter, kept apart from the
+// settings so a startup writes 1 or 2 bytes instead of a slot
+#ifndef SETTINGS_CYCLES
+#define SETTINGS_CYCLES 16
+#endif
+
 // settings saved in EEPROM
 typedef struct {
   char system_name[10];   // contains the string: "easyrider", not changeable,
@@ -59,8 +71,32 @@ typedef struct {
                           // no sound: 254, beep only: 253
 } tSettings;
 
+// settings that can be changed at runtime, the ids are used by CMD_SETTINGS
+typedef enum {
+  SET_SD_LOG,
+  SET_P_SENSES_ACTIVE,
+  SET_D_SENSES_ACTIVE,
+  SET_ALARM_SETTLE_TIME,
+  SET_INDICATOR_SOUND,
+  SET_BLINK_SPEED,
+  SET_ALARM_COUNTER,
+  SET_ALARM_TRIGGER,
+  SET_ALARM_TRIGGER_COUNTER,
+  SET_ALARM_THRES_MIN,
+  SET_ALARM_THRES_MAX,
+  SET_STARTUP_SOUND,
+  SET_FIELDS  // number of runtime settings
+} tSettingsField;
+
+// called when a runtime setting changed, to apply the new value right away
+typedef void (*tSettingsNotify)(uint8_t field);
+
 void read_settings(tSettings *settings);
 void update_settings(tSettings *settings);
 void reset_settings(void);
+void count_power_cycle(tSettings *settings);
+uint16_t get_setting(const tSettings *settings, uint8_t field);
+uint8_t set_setting(tSettings *settings, uint8_t field, uint16_t value);
+void notify_settings(tSettingsNotify notify);
 
 #endif
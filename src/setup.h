@@ -39,42 +39,5 @@ if (uart_available_0()) {
   g_datetime.seconds = 0;
   ds1307_set_date(&g_datetime); // set inital date/time
   _delay_ms(100);
-  // GPS
-  // 57600 baud
-  uart_put_0(160);
-  uart_put_0(161);
-  uart_put_0(0x00);
-  uart_put_0(0x04);
-  uart_put_0(0x05);
-  uart_put_0(0x00);
-  uart_put_0(0x04);
-  uart_put_0(0x01);
-  uart_put_0(0x00);
-  uart_put_0(13);
-  uart_put_0(10);
-  _delay_ms(100);
-  // Binary only output
-  uart_put_0(160);
-  uart_put_0(161);
-  uart_put_0(0x00);
-  uart_put_0(0x03);
-  uart_put_0(0x09);
-  uart_put_0(0x02);
-  uart_put_0(0x01);
-  uart_put_0(10);
-  uart_put_0(13);
-  uart_put_0(10);
-  _delay_ms(100);
-  // 10 hz update rate
-  uart_put_0(160);
-  uart_put_0(161);      
-  uart_put_0(0x00);
-  uart_put_0(0x03);
-  uart_put_0(14);
-  uart_put_0(10);
-  uart_put_0(0x01);
-  uart_put_0(0x05);
-  uart_put_0(13);
-  uart_put_0(10);
-  _delay_ms(100);
+  // GPS: configured by venus.c at startup, see gps_setup()
 #endif
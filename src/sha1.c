@@ -51,115 +51,105 @@ void sha1_init(sha1_ctx_t *state){
 }
 
 /********************************************************************************************************/
-/* some helping functions */
-uint32_t rotl32(uint32_t n, uint8_t bits){
-	return ((n<<bits) | (n>>(32-bits)));
+/* some helping functions
+ * constant rotations only: rotations by 8/16/24 are plain byte moves on the
+ * AVR, the others are built from a byte rotation and at most 3 single-bit
+ * shifts instead of a shift loop over a variable count
+ */
+#define ROTL8(x)  (((x)<<8) | ((x)>>24))
+#define ROTL1(x)  (((x)<<1) | ((x)>>31))
+#define ROTR2(x)  (((x)>>2) | ((x)<<30))
+#define ROTR3(x)  (((x)>>3) | ((x)<<29))
+#define ROTL5(x)  ROTR3(ROTL8(x))
+#define ROTL30(x) ROTR2(x)
+
+/* big endian load/store, bytewise: no 32-bit shifts needed */
+static inline uint32_t load_be32(const uint8_t *p){
+	return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint16_t)p[2]<<8) | p[3];
 }
 
-uint32_t change_endian32(uint32_t x){
-	return (((x)<<24) | ((x)>>24) | (((x)& 0x0000ff00)<<8) | (((x)& 0x00ff0000)>>8));
+static inline void store_be32(uint8_t *p, uint32_t x){
+	p[0] = x>>24;
+	p[1] = x>>16;
+	p[2] = x>>8;
+	p[3] = x;
 }
 
+/* three SHA-1 inner functions, as macros: no function pointer calls */
+#define CH(x,y,z)     ((z) ^ ((x) & ((y) ^ (z))))
+#define PARITY(x,y,z) ((x) ^ (y) ^ (z))
+#define MAJ(x,y,z)    (((x) & (y)) | ((z) & ((x) | (y))))
 
-/* three SHA-1 inner functions */
-uint32_t ch(uint32_t x, uint32_t y, uint32_t z){
-	return ((x&y)^((~x)&z));
-}
-
-uint32_t maj(uint32_t x, uint32_t y, uint32_t z){
-	return ((x&y)^(x&z)^(y&z));
-}
-
-uint32_t parity(uint32_t x, uint32_t y, uint32_t z){
-	return ((x^y)^z);
-}
+#define K0 0x5a827999
+#define K1 0x6ed9eba1
+#define K2 0x8f1bbcdc
+#define K3 0xca62c1d6
 
 /********************************************************************************************************/
 /**
  * \brief "add" a block to the hash
  * This is the core function of the hash algorithm. To understand how it's working
- * and what thoese variables do, take a look at FIPS-182. This is an "alternativ" implementation
+ * and what thoese variables do, take a look at FIPS-182. This is an "alternativ" implementation:
+ * the rounds are unrolled by 5, the variables change roles instead of being moved
+ * (e=d; d=c; c=b; b=a;), w is a ring of 16 words expanded in place
  */
 
 #define MASK 0x0000000f
 
-typedef uint32_t (*pf_t)(uint32_t x, uint32_t y, uint32_t z);
+/* message schedule word of round t, expanded from round 16 on */
+#define W(t) ((t) < 16 ? w[t] : (w[(t)&MASK] = ROTL1(w[((t)+13)&MASK] ^ \
+	w[((t)+8)&MASK] ^ w[((t)+2)&MASK] ^ w[(t)&MASK])))
+
+#define ROUND(a,b,c,d,e,f,k,t) do { \
+		e += ROTL5(a) + f(b,c,d) + k + W(t); \
+		b = ROTL30(b); \
+	} while (0)
+
+#define ROUND5(f,k,t) do { \
+		ROUND(a,b,c,d,e,f,k,(t));   \
+		ROUND(e,a,b,c,d,f,k,(t)+1); \
+		ROUND(d,e,a,b,c,f,k,(t)+2); \
+		ROUND(c,d,e,a,b,f,k,(t)+3); \
+		ROUND(b,c,d,e,a,f,k,(t)+4); \
+	} while (0)
 
 void sha1_nextBlock (sha1_ctx_t *state, const void* block){
-	uint32_t a[5];
+	uint32_t a, b, c, d, e;
 	uint32_t w[16];
-	uint32_t temp;
-	uint8_t t,s,fi, fib;
-	pf_t f[] = {ch,parity,maj,parity};
-	uint32_t k[4]={	0x5a827999,
-					0x6ed9eba1,
-					0x8f1bbcdc,
-					0xca62c1d6};
+	uint8_t t;
 
 	/* load the w array (changing the endian and so) */
 	for(t=0; t<16; ++t){
-		w[t] = change_endian32(((uint32_t*)block)[t]);
+		w[t] = load_be32((const uint8_t*)block + 4*t);
 	}
 
-#if DEBUG
-	uint8_t dbgi;
-	for(dbgi=0; dbgi<16; ++dbgi){
-		/*
-		DEBUG_S("\n\rBlock:");
-		DEBUG_B(dbgi);
-		DEBUG_C(':');
-		*/
-		cli_putstr_P(PSTR("\r\nBlock:"));
-		cli_hexdump(&dbgi, 1);
-		cli_putc(':');
-		cli_hexdump(&(w[dbgi]) ,4);
-	}
-#endif
-
 	/* load the state */
-	memcpy(a, state->h, 5*sizeof(uint32_t));
-
-
-	/* the fun stuff */
-	for(fi=0,fib=0,t=0; t<=79; ++t){
-		s = t & MASK;
-		if(t>=16){
-			#if DEBUG
-			 DEBUG_S("\r\n ws = "); cli_hexdump(&(w[s]), 4);
-			#endif
-			w[s] = rotl32( w[(s+13)&MASK] ^ w[(s+8)&MASK] ^
-				 w[(s+ 2)&MASK] ^ w[s] ,1);
-			#ifdef DEBUG
-			 DEBUG_S(" --> ws = "); cli_hexdump(&(w[s]), 4);
-			#endif
-		}
-
-		uint32_t dtemp;
-		temp = rotl32(a[0],5) + (dtemp=f[fi](a[1],a[2],a[3])) + a[4] + k[fi] + w[s];
-		memmove(&(a[1]), &(a[0]), 4*sizeof(uint32_t)); /* e=d; d=c; c=b; b=a; */
-		a[0] = temp;
-		a[2] = rotl32(a[2],30); /* we might also do rotr32(c,2) */
-		fib++;
-		if(fib==20){
-			fib=0;
-			fi = (fi+1)%4;
-		}
-		#if DEBUG
-		/* debug dump */
-		DEBUG_S("\r\nt = "); DEBUG_B(t);
-		DEBUG_S("; a[]: ");
-		 cli_hexdump(a, 5*4);
-		DEBUG_S("; k = ");
-		 cli_hexdump(&(k[t/20]), 4);
-		DEBUG_S("; f(b,c,d) = ");
-		 cli_hexdump(&dtemp, 4);
-		#endif
+	a = state->h[0];
+	b = state->h[1];
+	c = state->h[2];
+	d = state->h[3];
+	e = state->h[4];
+
+	/* the fun stuff, 4 x 20 rounds */
+	for(t=0; t<20; t+=5){
+		ROUND5(CH, K0, t);
+	}
+	for(; t<40; t+=5){
+		ROUND5(PARITY, K1, t);
+	}
+	for(; t<60; t+=5){
+		ROUND5(MAJ, K2, t);
+	}
+	for(; t<80; t+=5){
+		ROUND5(PARITY, K3, t);
 	}
 
 	/* update the state */
-	for(t=0; t<5; ++t){
-		state->h[t] += a[t];
-	}
+	state->h[0] += a;
+	state->h[1] += b;
+	state->h[2] += c;
+	state->h[3] += d;
+	state->h[4] += e;
 	state->length += 512;
 }
 
@@ -200,17 +190,10 @@ void sha1_lastBlock(sha1_ctx_t *state, const void* block, uint16_t length){
 /********************************************************************************************************/
 
 void sha1_ctx2hash (void *dest, sha1_ctx_t *state){
-#if defined LITTLE_ENDIAN
 	uint8_t i;
 	for(i=0; i<5; ++i){
-		((uint32_t*)dest)[i] = change_endian32(state->h[i]);
+		store_be32((uint8_t*)dest + 4*i, state->h[i]);
 	}
-#elif BIG_ENDIAN
-	if (dest != state->h)
-		memcpy(dest, state->h, SHA1_HASH_BITS/8);
-#else
-# error unsupported endian type!
-#endif
 }
 
 /********************************************************************************************************/
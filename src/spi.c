@@ -38,6 +38,8 @@ void spi_init(tSPIState role, uint8_t speed,  uint8_t mode, uint8_t bitorder, ui
     SPI_PORT |= (1<<SPI_SS_PIN); // high
     SPI_SLAVE_DDR |= (1<<SPI_SDSLAVE_PIN);   // output
     SPI_SLAVE_DDR |= (1<<SPI_MCUSLAVE_PIN);  // output
+    SPI_SLAVE_PORT |= (1<<SPI_SDSLAVE_PIN);  // high, both slaves deselected
+    SPI_SLAVE_PORT |= (1<<SPI_MCUSLAVE_PIN);
   } else if (role == SPI_MASTER) {
     SPI_DDR |= (1<<SPI_SCK_PIN);    // output
     SPI_DDR |= (1<<SPI_MOSI_PIN);   // output
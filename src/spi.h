@@ -67,10 +67,11 @@
 typedef enum {
   SPI_OFF, // only for mcu2 to restore the SS pin for SI_LI usage again
   SPI_SLAVE, // permanent state for mcu1
-  SPI_MASTER // mcu2 goes into master mode when commands are available
+  SPI_MASTER, // mcu2 goes into master mode when commands are available
+  SPI_SD // mcu2 owns the bus for an SD card block, no mcu bursts meanwhile
 } tSPIState;
 
-tSPIState g_spi_state;
+volatile tSPIState g_spi_state;
 
 void spi_init(tSPIState role, uint8_t speed,  uint8_t mode, uint8_t bitorder, uint8_t interrupt);
 void spi_enable(void);
@@ -0,0 +1,183 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+// host test for fat32.c on a disk image with a busy bus: writing, syncing,
+// appending after reopening, a directory growing past its first cluster,
+// reading back next to a file being written and appending after power losses
+// with a reserved run linked in
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fat32.h"
+#include "sd_host.h"
+
+#define REF_SIZE (256UL * 1024)
+
+static char g_ref[REF_SIZE];  // what LOG1.CSV should hold
+static uint32_t g_ref_size;
+static uint8_t g_failed;
+
+static void check(const char *name, uint8_t ok) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok) {
+    g_failed++;
+  }
+}
+
+// writes like the main loop does: a full buffer is retried after a process step
+static void put(const char *data, uint16_t length, uint8_t ref) {
+  while (fat32_write(data, length) == FAT32_BUSY) {
+    fat32_process();
+  }
+  if (ref) {
+    memcpy(&g_ref[g_ref_size], data, length);
+    g_ref_size += length;
+  }
+}
+
+// reads a file back through fat32.c and compares it with the reference
+static uint8_t read_back(const char *name, const char *ref, uint32_t size) {
+  tFat32Reader reader;
+  uint8_t sector[SD_BLOCK_SIZE];
+  uint32_t i, part;
+  uint8_t status;
+  if (fat32_find(name, &reader) != FAT32_OK || reader.size != size) {
+    return 0;
+  }
+  for (i = 0; i * SD_BLOCK_SIZE < size; i++) {
+    while ((status = fat32_read(&reader, i, sector)) == FAT32_BUSY) {
+    }
+    part = size - i * SD_BLOCK_SIZE;
+    if (part > SD_BLOCK_SIZE) {
+      part = SD_BLOCK_SIZE;
+    }
+    if (status != FAT32_OK || memcmp(sector, &ref[i * SD_BLOCK_SIZE], part)) {
+      return 0;
+    }
+  }
+  return fat32_read(&reader, i, sector) == FAT32_CLOSED;
+}
+
+// a power loss with a reserved run linked in: n records synced, then the card
+// is mounted again without closing. Returns 1 when the volume has lost clusters
+static uint8_t power_loss(uint16_t n) {
+  char record[64];
+  uint16_t i;
+  if (fat32_open("RIDE.DAT", 0, 0) != FAT32_OK ||
+      fat32_reserve(64UL * 1024) != FAT32_OK) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    memset(record, 'a' + g_ref_size / sizeof(record) % 26, sizeof(record));
+    put(record, sizeof(record), 1);
+    fat32_process();
+  }
+  if (fat32_sync() != FAT32_OK || fat32_init() != FAT32_CLOSED) {
+    return 0;
+  }
+  g_sd_busy_every = 0;
+  printf("  lost clusters expected:\n");
+  i = sd_host_check(NULL, NULL) != SD_OK;
+  g_sd_busy_every = 3;
+  return i;
+}
+
+static void run(const char *path, uint8_t mbr, uint8_t cluster_size) {
+  char record[64];
+  char name[16];
+  uint32_t size, mid;
+  uint16_t length, i;
+  printf("== %s, cluster size %u\n", mbr ? "mbr" : "superfloppy",
+         cluster_size);
+  g_ref_size = 0;
+  g_sd_busy_every = 0;
+  if (sd_host_create(path, mbr, cluster_size) != SD_OK) {
+    check("create image", 0);
+    return;
+  }
+  g_sd_busy_every = 3;
+  check("init", fat32_init() == FAT32_CLOSED);
+  check("open", fat32_open("log1.csv", FAT32_DATE(2014, 10, 12),
+                           FAT32_TIME(13, 5, 20)) == FAT32_OK);
+  for (i = 0; i < 3000; i++) {
+    length = snprintf(record, sizeof(record), "%u,record,%u,%s\n", i, i * 7,
+                      i % 13 ? "x" : "longer payload here");
+    put(record, length, 1);
+    fat32_process();
+  }
+  check("sync", fat32_sync() == FAT32_OK);
+  check("size after sync", fat32_size() == g_ref_size);
+  mid = g_ref_size;
+  for (i = 0; i < 5; i++) {
+    length = snprintf(record, sizeof(record), "after sync %u\n", i);
+    put(record, length, 1);
+  }
+  check("read while writing", read_back("LOG1.CSV", g_ref, mid));
+  check("close", fat32_close() == FAT32_OK);
+  check("reopen", fat32_open("LOG1.CSV", 0, 0) == FAT32_OK);
+  for (i = 0; i < 700; i++) {
+    length = snprintf(record, sizeof(record), "append %u\n", i);
+    put(record, length, 1);
+    if (i % 3 == 0) {
+      fat32_process();
+    }
+  }
+  check("close after append", fat32_close() == FAT32_OK);
+  // 16 entries per sector, the directory needs more clusters
+  for (i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "F%u.TXT", i);
+    if (fat32_open(name, 0, 0) != FAT32_OK) {
+      break;
+    }
+    put(name, strlen(name), 0);
+    fat32_close();
+  }
+  check("40 files", i == 40);
+  check("status closed", fat32_status() == FAT32_CLOSED);
+  check("read back", read_back("LOG1.CSV", g_ref, g_ref_size));
+  check("read back last file", read_back("F39.TXT", "F39.TXT", 7));
+  printf("writes %u streamed %u singles %u busy %u\n", g_sd_host.writes,
+         g_sd_host.streamed, g_sd_host.singles, g_sd_host.busy);
+  // the volume as another reader sees it, then as a fresh mount
+  g_sd_busy_every = 0;
+  check("volume", sd_host_check("LOG1.CSV", &size) == SD_OK &&
+                      size == g_ref_size);
+  check("remount", fat32_init() == FAT32_CLOSED &&
+                       read_back("LOG1.CSV", g_ref, g_ref_size));
+  // 100 records end mid-sector, 200 on a sector boundary
+  g_ref_size = 0;
+  g_sd_busy_every = 3;
+  check("power loss mid-sector", power_loss(100));
+  check("power loss on a boundary", power_loss(100));
+  check("append after power loss", fat32_open("RIDE.DAT", 0, 0) == FAT32_OK);
+  put("end\n", 4, 1);
+  check("close ride", fat32_close() == FAT32_OK);
+  g_sd_busy_every = 0;
+  check("no lost clusters", sd_host_check("RIDE.DAT", &size) == SD_OK &&
+                                size == g_ref_size);
+  check("read back ride", read_back("RIDE.DAT", g_ref, g_ref_size));
+  sd_host_close();
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "fat32_host.img";
+  run(path, 1, 1);
+  run(path, 0, 8);
+  return g_failed ? 1 : 0;
+}
@@ -0,0 +1,178 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+// host test for logger.c on a disk image with a busy bus: rides logged on two
+// days, a ride appended to after a restart, a ride going past midnight and the
+// log requests the app makes with CMD_LOG, answered from the index
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../logger.h"
+#include "sd_host.h"
+
+#define MAX_RIDES 4
+
+// a run of consecutive records of one ride in a log request's answer
+typedef struct {
+  uint8_t tag;
+  uint16_t first;
+  uint16_t last;
+} tRun;
+
+static uint8_t g_failed;
+
+static void check(const char *name, uint8_t ok) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok) {
+    g_failed++;
+  }
+}
+
+// logs n records as the main loop does, alternating the CMD_DATA and CMD_GPS
+// record sizes, 100 records a minute. Records carry the ride's tag, their
+// counter and their minute of the day, the date goes on at midnight
+static uint8_t ride(uint16_t date, uint16_t number, uint16_t minute,
+                    uint16_t n, uint8_t tag) {
+  uint8_t rec[35];
+  uint8_t length;
+  uint16_t i, at, day;
+  if (logger_start(date, FAT32_TIME(minute / 60, minute % 60, 0), number) !=
+      FAT32_OK) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    length = i % 2 ? 24 : 35;
+    at = minute + i / 100;
+    day = date + at / 1440;  // the day of the month is the low bits
+    at %= 1440;
+    memset(rec, 0, length);
+    rec[0] = tag;
+    rec[1] = i;
+    rec[2] = i >> 8;
+    rec[3] = at;
+    rec[4] = at >> 8;
+    if (logger_record(i % 2 ? 'c' : 'd', rec, length, day, at) !=
+        FAT32_OK) {
+      return 0;
+    }
+    fat32_process();
+  }
+  return logger_stop() == FAT32_OK;
+}
+
+// runs a log request, returns the number of runs of consecutive records found
+// or -1 when a record is broken
+static int query(uint16_t date, uint16_t minute, tRun *runs) {
+  const uint8_t *r;
+  uint8_t length;
+  uint16_t counter;
+  int count = 0;
+  if (logger_find(date, minute) != FAT32_OK) {
+    return -1;
+  }
+  while ((length = logger_next(&r))) {
+    if (length != (r[0] == 'c' ? 25 : 36)) {
+      return -1;
+    }
+    counter = r[2] | r[3] << 8;
+    if (count && runs[count - 1].tag == r[1] &&
+        runs[count - 1].last + 1 == counter) {
+      runs[count - 1].last = counter;
+      continue;
+    }
+    if (count == MAX_RIDES) {
+      return -1;
+    }
+    runs[count].tag = r[1];
+    runs[count].first = counter;
+    runs[count].last = counter;
+    count++;
+  }
+  return count;
+}
+
+static uint8_t is_run(const tRun *run, uint8_t tag, uint16_t first,
+                      uint16_t last) {
+  return run->tag == tag && run->first == first && run->last == last;
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "logger_host.img";
+  uint16_t day1 = FAT32_DATE(2014, 10, 12), day2 = FAT32_DATE(2014, 10, 13);
+  uint16_t day3 = FAT32_DATE(2014, 10, 14), day4 = FAT32_DATE(2014, 10, 15);
+  tRun runs[MAX_RIDES];
+  uint8_t rec[24] = {5};
+  int n;
+  if (sd_host_create(path, 1, 1) != SD_OK) {
+    check("create image", 0);
+    return 1;
+  }
+  g_sd_busy_every = 3;
+  check("init", fat32_init() == FAT32_CLOSED);
+  check("no index", logger_find(day1, 0) == FAT32_CLOSED);
+  check("record while not logging",
+        logger_record('c', rec, sizeof(rec), day1, 0) == FAT32_CLOSED);
+
+  check("ride 1", ride(day1, 7, 600, 20000, 1));
+  check("ride 2, next day", ride(day2, 8, 480, 3000, 2));
+  check("ride 3", ride(day1, 9, 900, 5000, 3));
+  check("ride 4, same boot as ride 3", ride(day1, 9, 1000, 2000, 4));
+  check("ride 5, past midnight", ride(day3, 11, 1430, 3000, 5));
+  check("nothing dropped", logger_dropped() == 0);
+
+  n = query(day1, 0, runs);
+  check("day 1, all rides",
+        n == 3 && is_run(&runs[0], 1, 0, 19999) &&
+            is_run(&runs[1], 3, 0, 4999) && is_run(&runs[2], 4, 0, 1999));
+  // minute 700 is record 10000 of ride 1, the answer starts at the index
+  // mark before it
+  n = query(day1, 700, runs);
+  check("day 1 from 11:40",
+        n == 3 && runs[0].tag == 1 && runs[0].first > 0 &&
+            runs[0].first <= 10000 && runs[0].last == 19999 &&
+            is_run(&runs[1], 3, 0, 4999) && is_run(&runs[2], 4, 0, 1999));
+  n = query(day2, 0, runs);
+  check("day 2", n == 1 && is_run(&runs[0], 2, 0, 2999));
+  check("day without rides", query(FAT32_DATE(2014, 1, 1), 0, runs) == 0);
+  // ride 5 started at 23:50, its first 10 minutes are on day 3
+  n = query(day3, 1435, runs);
+  check("day 3 until midnight", n == 1 && runs[0].tag == 5 &&
+                                    runs[0].first <= 500 &&
+                                    runs[0].last == 999);
+  n = query(day4, 0, runs);
+  check("day 4 after midnight", n == 1 && is_run(&runs[0], 5, 1000, 2999));
+  n = query(day4, 15, runs);
+  check("day 4 from 00:15",
+        n == 1 && runs[0].tag == 5 && runs[0].first > 1000 &&
+            runs[0].first <= 2500 && runs[0].last == 2999);
+
+  // the ride being logged isn't in the index yet
+  logger_start(day2, 0, 10);
+  logger_record('c', rec, sizeof(rec), day2, 0);
+  n = query(day2, 0, runs);
+  check("ride in progress left out", n == 1 && is_run(&runs[0], 2, 0, 2999));
+  check("stop", logger_stop() == FAT32_OK);
+
+  g_sd_busy_every = 0;
+  check("volume", sd_host_check(LOGGER_INDEX, NULL) == SD_OK);
+  printf("writes %u streamed %u singles %u busy %u\n", g_sd_host.writes,
+         g_sd_host.streamed, g_sd_host.singles, g_sd_host.busy);
+  sd_host_close();
+  return g_failed ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sd_host.h"
+
+#define HOST_CLUSTERS 70000UL  // just above the FAT32 minimum of 65525
+#define HOST_RESERVED 32       // reserved sectors in front of the FATs
+#define HOST_VOLUME 2048       // first volume sector behind the MBR
+#define HOST_EOC 0x0FFFFFF8UL
+
+tSDHostStats g_sd_host;
+uint8_t g_sd_busy_every;
+
+static FILE *g_image;
+static uint32_t g_stream;  // block a multi-block write continues with, 0: none
+static uint32_t g_calls;
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+static uint32_t get32(const uint8_t *p) {
+  return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint8_t image_read(uint32_t block, uint8_t *buf) {
+  if (fseek(g_image, (long)block * SD_BLOCK_SIZE, SEEK_SET) ||
+      fread(buf, SD_BLOCK_SIZE, 1, g_image) != 1) {
+    return SD_ERROR;
+  }
+  return SD_OK;
+}
+
+static uint8_t image_write(uint32_t block, const uint8_t *buf) {
+  if (fseek(g_image, (long)block * SD_BLOCK_SIZE, SEEK_SET) ||
+      fwrite(buf, SD_BLOCK_SIZE, 1, g_image) != 1) {
+    return SD_ERROR;
+  }
+  return SD_OK;
+}
+
+// injected busy bus, or the card programming after a multi-block write ended
+static uint8_t busy(uint32_t next) {
+  if (g_sd_busy_every && ++g_calls % g_sd_busy_every == 0) {
+    g_sd_host.busy++;
+    return 1;
+  }
+  if (g_stream && g_stream != next) {
+    g_stream = 0;
+    g_sd_host.busy++;
+    return 1;
+  }
+  return 0;
+}
+
+// writes a fresh FAT32 volume of HOST_CLUSTERS clusters, behind an MBR or as a
+// superfloppy, and opens it as the card
+uint8_t sd_host_create(const char *path, uint8_t mbr, uint8_t cluster_size) {
+  uint8_t sector[SD_BLOCK_SIZE];
+  uint32_t total = HOST_CLUSTERS * cluster_size + HOST_RESERVED * 8;
+  uint32_t volume = mbr ? HOST_VOLUME : 0;
+  uint32_t fat_size = ((total - HOST_RESERVED) / cluster_size * 4 +
+                       SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE + 1;
+  uint8_t i;
+  g_image = fopen(path, "w+b");
+  if (!g_image) {
+    return SD_ERROR;
+  }
+  memset(sector, 0, sizeof(sector));
+  image_write(volume + total - 1, sector);  // sized, sparse and zeroed
+  if (mbr) {
+    sector[0x1C2] = 0x0C;  // FAT32 LBA
+    put32(&sector[0x1C6], volume);
+    put32(&sector[0x1CA], total);
+    put16(&sector[510], 0xAA55);
+    image_write(0, sector);
+    memset(sector, 0, sizeof(sector));
+  }
+  // boot sector
+  memcpy(sector, "\xEB\x58\x90MSWIN4.1", 11);
+  put16(&sector[11], SD_BLOCK_SIZE);
+  sector[13] = cluster_size;
+  put16(&sector[14], HOST_RESERVED);
+  sector[16] = 2;  // FATs
+  sector[21] = 0xF8;
+  put16(&sector[24], 63);
+  put16(&sector[26], 255);
+  put32(&sector[28], volume);
+  put32(&sector[32], total);
+  put32(&sector[36], fat_size);
+  put32(&sector[44], 2);  // root directory cluster
+  put16(&sector[48], 1);  // FSInfo sector
+  put16(&sector[50], 6);  // backup boot sector
+  put16(&sector[510], 0xAA55);
+  image_write(volume, sector);
+  // FSInfo
+  memset(sector, 0, sizeof(sector));
+  put32(&sector[0], 0x41615252);
+  put32(&sector[484], 0x61417272);
+  put32(&sector[488], HOST_CLUSTERS - 1);
+  put32(&sector[492], 3);
+  put16(&sector[510], 0xAA55);
+  image_write(volume + 1, sector);
+  // FATs: media, reserved, root directory end of chain
+  memset(sector, 0, sizeof(sector));
+  put32(&sector[0], 0x0FFFFFF8);
+  put32(&sector[4], 0xFFFFFFFF);
+  put32(&sector[8], 0x0FFFFFFF);
+  for (i = 0; i < 2; i++) {
+    image_write(volume + HOST_RESERVED + i * fat_size, sector);
+  }
+  g_stream = 0;
+  g_calls = 0;
+  memset(&g_sd_host, 0, sizeof(g_sd_host));
+  return fflush(g_image) ? SD_ERROR : SD_OK;
+}
+
+void sd_host_close() {
+  if (g_image) {
+    fclose(g_image);
+    g_image = NULL;
+  }
+}
+
+// checks the volume without fat32.c: both FATs equal, every allocated cluster
+// belongs to the root directory or to exactly one file, each file's chain as
+// long as its size. Returns SD_OK and the size of the named file (if not NULL)
+uint8_t sd_host_check(const char *name, uint32_t *size) {
+  uint8_t sector[SD_BLOCK_SIZE];
+  uint8_t copy[SD_BLOCK_SIZE];
+  uint8_t dir[11];
+  uint8_t *owner;
+  uint8_t *entry;
+  uint32_t volume = 0, fat, data, fat_size, clusters, cluster, next;
+  uint32_t root, first, length, count, i, j, e;
+  uint8_t cluster_size, found = 0;
+  uint32_t *table;
+  uint8_t status = SD_OK;
+  image_read(0, sector);
+  if (sector[0] != 0xEB && sector[0] != 0xE9) {
+    volume = get32(&sector[0x1C6]);
+    image_read(volume, sector);
+  }
+  cluster_size = sector[13];
+  fat_size = get32(&sector[36]);
+  root = get32(&sector[44]);
+  fat = volume + get16(&sector[14]);
+  data = fat + sector[16] * fat_size;
+  clusters = (get32(&sector[32]) - (data - volume)) / cluster_size + 2;
+  table = malloc(clusters * sizeof(uint32_t));
+  owner = calloc(clusters, 1);
+  for (i = 0; i < fat_size && i * 128 < clusters; i++) {
+    image_read(fat + i, sector);
+    image_read(fat + fat_size + i, copy);
+    if (memcmp(sector, copy, sizeof(sector))) {
+      printf("  FAT copies differ in sector %u\n", i);
+      status = SD_ERROR;
+    }
+    for (j = 0; j < 128 && i * 128 + j < clusters; j++) {
+      table[i * 128 + j] = get32(&sector[j * 4]) & 0x0FFFFFFF;
+    }
+  }
+  // 8.3 name as stored in the directory
+  memset(dir, ' ', sizeof(dir));
+  for (i = 0, j = 0; name && name[i] && j < 11; i++) {
+    if (name[i] == '.') {
+      j = 8;
+    } else {
+      dir[j++] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 32 : name[i];
+    }
+  }
+  // root directory chain, then every file in it
+  for (cluster = root; cluster >= 2 && cluster < HOST_EOC;
+       cluster = table[cluster]) {
+    owner[cluster]++;
+  }
+  for (cluster = root; status == SD_OK && cluster >= 2 && cluster < HOST_EOC;
+       cluster = table[cluster]) {
+    for (i = 0; i < cluster_size; i++) {
+      image_read(data + (cluster - 2) * cluster_size + i, sector);
+      for (e = 0; e < SD_BLOCK_SIZE; e += 32) {
+        entry = &sector[e];
+        if (entry[0] == 0) {
+          goto done;
+        }
+        if (entry[0] == 0xE5 || entry[11] & 0x18) {  // deleted, volume, dir
+          continue;
+        }
+        first = (uint32_t)get16(&entry[20]) << 16 | get16(&entry[26]);
+        length = get32(&entry[28]);
+        for (count = 0, next = first; next >= 2 && next < HOST_EOC;
+             next = table[next]) {
+          if (next >= clusters || owner[next]++ || ++count > clusters) {
+            printf("  %.11s: cross-linked or looping chain\n", entry);
+            status = SD_ERROR;
+            break;
+          }
+        }
+        if (count != (length + cluster_size * SD_BLOCK_SIZE - 1) /
+                         (cluster_size * SD_BLOCK_SIZE)) {
+          printf("  %.11s: %u clusters for %u bytes\n", entry, count, length);
+          status = SD_ERROR;
+        }
+        if (!memcmp(entry, dir, sizeof(dir))) {
+          found = 1;
+          if (size) {
+            *size = length;
+          }
+        }
+      }
+    }
+  }
+done:
+  for (cluster = 2; status == SD_OK && cluster < clusters; cluster++) {
+    if (table[cluster] && !owner[cluster]) {
+      printf("  cluster %u allocated but not in use\n", cluster);
+      status = SD_ERROR;
+    }
+  }
+  if (status == SD_OK && name && !found) {
+    printf("  %s not found\n", name);
+    status = SD_ERROR;
+  }
+  free(table);
+  free(owner);
+  return status;
+}
+
+uint8_t sd_init() { return g_image ? SD_OK : SD_ERROR; }
+
+uint8_t sd_read_block(uint32_t block, uint8_t *buf) {
+  if (busy(0)) {
+    return SD_BUSY;
+  }
+  return image_read(block, buf);
+}
+
+uint8_t sd_write_block(uint32_t block, const uint8_t *buf) {
+  if (busy(0)) {
+    return SD_BUSY;
+  }
+  g_sd_host.writes++;
+  g_sd_host.singles++;
+  return image_write(block, buf);
+}
+
+uint8_t sd_write_stream(uint32_t block, const uint8_t *buf) {
+  if (busy(block)) {
+    return SD_BUSY;
+  }
+  g_sd_host.writes++;
+  if (g_stream == block) {
+    g_sd_host.streamed++;
+  }
+  g_stream = block + 1;
+  return image_write(block, buf);
+}
+
+uint8_t sd_sync() { return busy(0) ? SD_BUSY : SD_OK; }
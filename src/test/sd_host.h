@@ -0,0 +1,45 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef SD_HOST_H_INCLUDED
+#define SD_HOST_H_INCLUDED
+
+#include <stdint.h>
+
+#include "../sd.h"
+
+// host stand-in for sd.h: the blocks live in a disk image file. Like a card
+// sharing the bus with the mcu link it answers SD_BUSY now and then, and a
+// multi-block write that isn't continued with the next block ends with a busy
+// card, so fat32.c's retry paths run on the host too
+
+typedef struct {
+  uint32_t writes;    // blocks written
+  uint32_t streamed;  // of which continued a multi-block write
+  uint32_t singles;   // single block writes
+  uint32_t busy;      // SD_BUSY answers
+} tSDHostStats;
+
+extern tSDHostStats g_sd_host;
+extern uint8_t g_sd_busy_every;  // answer SD_BUSY every n calls, 0: never
+
+uint8_t sd_host_create(const char *path, uint8_t mbr, uint8_t cluster_size);
+void sd_host_close(void);
+uint8_t sd_host_check(const char *name, uint32_t *size);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ *
+ *  Copyright (C) 2014 Bas Brugman
+ *  http://www.visionnaire.nl
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+// host test for sha1.c: FIPS 180 vectors, the RFC 6455 accept key as
+// websocket.c computes it and a timing loop over the handshake input
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../sha1.h"
+#include "../base64_enc.h"
+
+#define BENCH_RUNS 100000
+
+static uint8_t g_failed;
+
+static void check_hash(const char *name, const char *msg, const char *hex) {
+  uint8_t hash[SHA1_HASH_BYTES];
+  char out[SHA1_HASH_BYTES * 2 + 1];
+  uint8_t i;
+  sha1(hash, msg, (uint32_t)strlen(msg) * 8);
+  for (i = 0; i < SHA1_HASH_BYTES; i++) {
+    sprintf(&out[i * 2], "%02x", hash[i]);
+  }
+  if (strcmp(out, hex)) {
+    printf("FAIL %s: %s, expected %s\n", name, out, hex);
+    g_failed++;
+    return;
+  }
+  printf("ok   %s\n", name);
+}
+
+// same steps as websocket.c: key + GUID, sha1, base64
+static void accept_key(char *dest, const char *key) {
+  char buffer[64];
+  uint8_t hash[SHA1_HASH_BYTES];
+  strcpy(buffer, key);
+  strcat(buffer, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+  sha1(hash, buffer, (uint32_t)strlen(buffer) * 8);
+  base64enc(dest, hash, SHA1_HASH_BYTES);
+}
+
+int main(void) {
+  char key[32];
+  uint8_t hash[SHA1_HASH_BYTES];
+  const char *input = "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  clock_t start;
+  double elapsed;
+  uint32_t i;
+
+  check_hash("fips abc", "abc", "a9993e364706816aba3e25717850c26c9cd0d89d");
+  check_hash("fips empty", "", "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+  check_hash("fips 448 bit",
+             "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+             "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+  accept_key(key, "dGhlIHNhbXBsZSBub25jZQ==");
+  if (strcmp(key, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")) {
+    printf("FAIL rfc 6455 accept key: %s\n", key);
+    g_failed++;
+  } else {
+    printf("ok   rfc 6455 accept key\n");
+  }
+
+  // host timing only, relative between sha1.c versions: the accept key input
+  // is 60 bytes, two blocks like on the mcu
+  start = clock();
+  for (i = 0; i < BENCH_RUNS; i++) {
+    sha1(hash, input, 60 * 8);
+  }
+  elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("bench %u accept key hashes: %.3f s, %.3f us/hash\n", BENCH_RUNS,
+         elapsed, elapsed * 1e6 / BENCH_RUNS);
+
+  return g_failed ? 1 : 0;
+}
@@ -16,114 +16,255 @@
  *  limitations under the License.
  *
  */
-#include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include  "usart.h"
+
+#include "usart.h"
+
+// One driver for both USART ports: the port functions below are inlined per
+// port, with a constant port number the register selection folds away. The
+// bit positions of USART1 equal those of USART0, so the USART0 names are used
+#define UART_UBRR(p) (*((p) ? &UBRR1 : &UBRR0))
+#define UART_UCSRA(p) (*((p) ? &UCSR1A : &UCSR0A))
+#define UART_UCSRB(p) (*((p) ? &UCSR1B : &UCSR0B))
+#define UART_UCSRC(p) (*((p) ? &UCSR1C : &UCSR0C))
+#define UART_UDR(p) (*((p) ? &UDR1 : &UDR0))
+#define UART_RX_TX ((1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0))
+
+// ring buffer declaration:
+// the RX buffer fills from the outside world, putting new "heads" in and
+// shrinks by getting the "tails" in the program, a full RX buffer discards new
+// data. The TX buffer puts new "heads" in and transmits the "tail". Head is the
+// next free slot, tail the next byte to take, one slot stays free to tell a
+// full buffer from an empty one. Sizes are powers of 2: wrapping is a mask
+typedef struct {
+  volatile uint8_t *rx_buffer;
+  volatile uint8_t *tx_buffer;
+  uint8_t rx_mask;
+  uint8_t tx_mask;
+  volatile uint8_t rx_head;
+  volatile uint8_t rx_tail;
+  volatile uint8_t tx_head;
+  volatile uint8_t tx_tail;
+} tUart;
+
+static volatile uint8_t g_rx_buffer_0[UART0_RX_SIZE];
+static volatile uint8_t g_tx_buffer_0[UART0_TX_SIZE];
+static volatile uint8_t g_rx_buffer_1[UART1_RX_SIZE];
+static volatile uint8_t g_tx_buffer_1[UART1_TX_SIZE];
+
+static tUart g_uart[2] = {
+    {g_rx_buffer_0, g_tx_buffer_0, UART0_RX_SIZE - 1, UART0_TX_SIZE - 1},
+    {g_rx_buffer_1, g_tx_buffer_1, UART1_RX_SIZE - 1, UART1_TX_SIZE - 1}};
 
 // Initialization
-// NOTE that I'm using the UART1 rx/tx pins of the atmega1284p, not UART0
-void uart_init() {
-  cli(); // Disable global interrupts
-  UBRR1 = ((F_CPU / (USART_BAUDRATE * 8UL)) - 1); // set baudrate, using 8 as multiplier because we set U2X1
-	UCSR1A = (1 << U2X1); // enable 2x speed
-  // Turn on the reception and transmission circuitry and Reception Complete Interrupt
-	UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
-	UCSR1C = (1 << UCSZ11) | (1 << UCSZ10); // set 8 bits data size (default no parity bit, 1 stop bit)
-  tx_buffer_head = tx_buffer_tail = 0; // init buffer
-  rx_buffer_head = rx_buffer_tail = 0; // init buffer
-  sei(); // Enable global interrupts
+static inline void uart_init(uint8_t p) {
+  cli();  // Disable global interrupts
+  // set baudrate, using 8 as multiplier because we set U2X
+  UART_UBRR(p) = USART_UBRR(USART_BAUDRATE);
+  UART_UCSRA(p) = (1 << U2X0);  // enable 2x speed
+  // Turn on the reception and transmission circuitry and Reception Complete
+  // Interrupt
+  UART_UCSRB(p) = UART_RX_TX;
+  UART_UCSRC(p) = (1 << UCSZ01) | (1 << UCSZ00);  // set 8 bits data size
+                                                  // (default no parity bit,
+                                                  // 1 stop bit)
+  g_uart[p].tx_head = g_uart[p].tx_tail = 0;  // init buffer
+  g_uart[p].rx_head = g_uart[p].rx_tail = 0;  // init buffer
+  sei();                                      // Enable global interrupts
 }
 
-// Transmit a byte
-void uart_put(uint8_t c) {
-	uint8_t i;
-	i = tx_buffer_head + 1; // advance head
-	if (i >= TX_BUFFER_SIZE) i = 0; // go to first index if buffer full
-  // NOTE: the hard wait below is not desirable when big, fast UART transfers are part of the main program loop,
-  // in that case, better change it to an if (tx_buffer_tail != i) to prevent delays of other program parts
-	while (tx_buffer_tail == i); // wait until space in buffer
-  tx_buffer[i] = c; // put char in buffer
-  tx_buffer_head = i; // set new head
-  // Turn on the reception and transmission circuitry and Reception Complete and
-  // USART Data Register Empty interrupts
-  UCSR1B = (1<<RXEN1) | (1<<TXEN1) | (1<<RXCIE1) | (1<<UDRIE1);
+// Transmit a byte if there is space in the buffer, returns 0 when it's full
+static inline uint8_t uart_try_put(uint8_t p, uint8_t c) {
+  tUart *u = &g_uart[p];
+  uint8_t i = (u->tx_head + 1) & u->tx_mask;  // advance head
+  if (i == u->tx_tail) {
+    return 0;  // buffer full
+  }
+  u->tx_buffer[u->tx_head] = c;  // put char in buffer
+  u->tx_head = i;                // set new head
+  // Turn on the reception and transmission circuitry and Reception Complete
+  // and USART Data Register Empty interrupts
+  UART_UCSRB(p) = UART_RX_TX | (1 << UDRIE0);
+  return 1;
 }
 
-// Receive a byte, NOTE: always call uart_available() first, before this function
-uint8_t uart_get(void) {
-  uint8_t c, i;
-  i = rx_buffer_tail + 1; // advance tail
-  if (i >= RX_BUFFER_SIZE) i = 0; // got to first index if buffer full
-  c = rx_buffer[i]; // get char from buffer
-  rx_buffer_tail = i; // set new tail
-  return c; // return char
+// Transmit a byte, waits for space in the buffer
+static inline void uart_put(uint8_t p, uint8_t c) {
+  while (!uart_try_put(p, c))
+    ;  // wait until space in buffer
 }
 
-// Writes a string from flash to the uart
-void uart_put_str(const char *str) {
-	while (*str) {
-		uart_put(*str);
-    str++;
-	}
+// Return the number of bytes that fit in the transmit buffer
+static inline uint8_t uart_writable(uint8_t p) {
+  return (g_uart[p].tx_tail - g_uart[p].tx_head - 1) & g_uart[p].tx_mask;
 }
 
-// Writes an integer as a string
-void uart_put_int(const uint16_t dec) {
-  char str[10];
-  char *p = str;
-  utoa(dec,str,10);
-	while (*p) {
-		uart_put(*p);
-    p++;
-	}
+// Transmit as much of a buffer as fits without waiting, copied in one critical
+// section, returns the number of bytes taken
+static inline uint16_t uart_write(uint8_t p, const uint8_t *buf, uint16_t len) {
+  tUart *u = &g_uart[p];
+  uint8_t head, n;
+  uint16_t i;
+  cli();  // the UDRE interrupt moves the tail
+  n = (u->tx_tail - u->tx_head - 1) & u->tx_mask;  // writable bytes
+  if (len > n) {
+    len = n;
+  }
+  head = u->tx_head;
+  for (i = 0; i < len; i++) {
+    u->tx_buffer[head] = buf[i];
+    head = (head + 1) & u->tx_mask;
+  }
+  u->tx_head = head;
+  if (len) {
+    UART_UCSRB(p) = UART_RX_TX | (1 << UDRIE0);
+  }
+  sei();
+  return len;
+}
+
+// Receive a byte, NOTE: always call uart_available() first, before this
+// function
+static inline uint8_t uart_get(uint8_t p) {
+  tUart *u = &g_uart[p];
+  uint8_t c = u->rx_buffer[u->rx_tail];          // get char from buffer
+  u->rx_tail = (u->rx_tail + 1) & u->rx_mask;  // set new tail
+  return c;
+}
+
+// Return the number of bytes waiting in the receive buffer.
+// Call this before uart_get() to check if it will need
+// to wait for a byte to arrive.
+static inline uint8_t uart_available(uint8_t p) {
+  return (g_uart[p].rx_head - g_uart[p].rx_tail) & g_uart[p].rx_mask;
+}
+
+// Drops all bytes not sent yet, in a critical section: the UDRE interrupt
+// moving the tail in between would leave a full ring of stale bytes
+static inline void uart_flush_tx(uint8_t p) {
+  cli();
+  g_uart[p].tx_head = g_uart[p].tx_tail;
+  sei();
+}
+
+// Writes a string to the uart
+static inline void uart_put_str(uint8_t p, const char *str) {
+  while (*str) {
+    uart_put(p, *str);
+    str++;
+  }
 }
 
 // Writes a string from Flash (PROGMEM) to the uart
-void uart_put_str_P(const char *str) {
-	char c;
-	while (1) {
-		c = pgm_read_byte(str++);
-		if (!c) break;
-		uart_put(c);
-	}
+static inline void uart_put_str_P(uint8_t p, const char *str) {
+  char c;
+  while ((c = pgm_read_byte(str++))) {
+    uart_put(p, c);
+  }
 }
 
-// USART1 data register empty Interrupt
+// Writes an integer as a string
+static inline void uart_put_int(uint8_t p, const uint16_t dec) {
+  char str[6];
+  utoa(dec, str, 10);
+  uart_put_str(p, str);
+}
+
+// USART data register empty Interrupt
 // Move a character from the transmit buffer to the data register.
-// If the transmit buffer is empty the UDRE interrupt is disabled until another uart_put() is called
-ISR(USART1_UDRE_vect) {
-	uint8_t i;
-	if (tx_buffer_head == tx_buffer_tail) {
-    UCSR1B &= ~(1 << UDRIE1); // buffer is empty, disable interrupt
-	} else { // fill transmit register with next byte to send
-		i = tx_buffer_tail + 1; // get tail + 1
-		if (i >= TX_BUFFER_SIZE) i = 0; // go to first index if buffer full
-		UDR1 = tx_buffer[i]; // send byte
-		tx_buffer_tail = i; // set new tail
-	}
+// If the transmit buffer is empty the UDRE interrupt is disabled until another
+// uart_put() is called
+static inline void uart_udre_isr(uint8_t p) {
+  tUart *u = &g_uart[p];
+  if (u->tx_head == u->tx_tail) {
+    UART_UCSRB(p) = UART_RX_TX;  // buffer is empty, disable interrupt
+  } else {  // fill transmit register with next byte to send
+    UART_UDR(p) = u->tx_buffer[u->tx_tail];      // send byte
+    u->tx_tail = (u->tx_tail + 1) & u->tx_mask;  // set new tail
+  }
 }
 
 // Receive Complete Interrupt
-ISR(USART1_RX_vect) {
-	uint8_t c, i;
-	c = UDR1; // receive byte
-	i = rx_buffer_head + 1; // advance head 
-	if (i >= RX_BUFFER_SIZE) i = 0; // go to first index if buffer full
-	if (i != rx_buffer_tail) { // not full
-		rx_buffer[i] = c; // put in read buffer
-		rx_buffer_head = i; // set new head
-	}
+static inline void uart_rx_isr(uint8_t p) {
+  tUart *u = &g_uart[p];
+  uint8_t c = UART_UDR(p);                     // receive byte
+  uint8_t i = (u->rx_head + 1) & u->rx_mask;  // advance head
+  if (i != u->rx_tail) {                       // not full
+    u->rx_buffer[u->rx_head] = c;              // put in read buffer
+    u->rx_head = i;                            // set new head
+  }
 }
 
-// Return the number of bytes waiting in the receive buffer.
-// Call this before uart_get() to check if it will need
-// to wait for a byte to arrive.
-uint8_t uart_available(void) {
-	uint8_t head, tail;
-	head = rx_buffer_head;
-	tail = rx_buffer_tail;
-	if (head >= tail) return head - tail; // return count of bytes inbetween
-	return RX_BUFFER_SIZE + head - tail; // head has rolled over to start, return count of bytes inbetween
+ISR(USART0_UDRE_vect) { uart_udre_isr(0); }
+
+ISR(USART0_RX_vect) { uart_rx_isr(0); }
+
+ISR(USART1_UDRE_vect) { uart_udre_isr(1); }
+
+ISR(USART1_RX_vect) { uart_rx_isr(1); }
+
+// the port instances, UART0 for Wifly WiFi communication (mcu1) / GPS (mcu2)
+void uart_init_0() { uart_init(0); }
+
+// switch to another baud rate, e.g. to talk to a device at its factory default,
+// bytes being shifted get garbled
+void uart_set_baud_0(uint32_t baud) { UART_UBRR(0) = USART_UBRR(baud); }
+
+void uart_put_0(uint8_t c) { uart_put(0, c); }
+
+uint8_t uart_try_put_0(uint8_t c) { return uart_try_put(0, c); }
+
+uint16_t uart_write_0(const uint8_t *buf, uint16_t len) {
+  return uart_write(0, buf, len);
+}
+
+uint8_t uart_writable_0() { return uart_writable(0); }
+
+void uart_put_str_0(const char *str) { uart_put_str(0, str); }
+
+void uart_put_str_P_0(const char *str) { uart_put_str_P(0, str); }
+
+void uart_put_int_0(const uint16_t dec) { uart_put_int(0, dec); }
+
+uint8_t uart_get_0() { return uart_get(0); }
+
+uint8_t uart_available_0() { return uart_available(0); }
+
+// drop all received bytes
+void uart_flush_rx_0() { g_uart[0].rx_tail = g_uart[0].rx_head; }
+
+// drop all bytes not sent yet
+void uart_flush_tx_0() { uart_flush_tx(0); }
+
+// UART1 for shell and debugging (mcu1/mcu2)
+void uart_init_1() { uart_init(1); }
+
+void uart_set_baud_1(uint32_t baud) { UART_UBRR(1) = USART_UBRR(baud); }
+
+void uart_put_1(uint8_t c) { uart_put(1, c); }
+
+uint8_t uart_try_put_1(uint8_t c) { return uart_try_put(1, c); }
+
+uint16_t uart_write_1(const uint8_t *buf, uint16_t len) {
+  return uart_write(1, buf, len);
 }
 
+uint8_t uart_writable_1() { return uart_writable(1); }
+
+void uart_put_str_1(const char *str) { uart_put_str(1, str); }
+
+void uart_put_str_P_1(const char *str) { uart_put_str_P(1, str); }
+
+void uart_put_int_1(const uint16_t dec) { uart_put_int(1, dec); }
+
+uint8_t uart_get_1() { return uart_get(1); }
+
+uint8_t uart_available_1() { return uart_available(1); }
+
+void uart_flush_rx_1() { g_uart[1].rx_tail = g_uart[1].rx_head; }
+
+void uart_flush_tx_1() { uart_flush_tx(1); }
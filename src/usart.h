@@ -16,39 +16,68 @@
  *  limitations under the License.
  *
  */
-#ifndef _USART_H_INCLUDED
-#define _USART_H_INCLUDED
+#ifndef USART_H_INCLUDED
+#define USART_H_INCLUDED
 
 #include <stdint.h>
-#include <stdio.h>
-#include <avr/io.h>
-#include <avr/pgmspace.h>
 
-#define CPU_PRESCALE(n) (CLKPR = 0x80, CLKPR = (n))
-#define USART_BAUDRATE 19200 // slow, but we don't care, we want a low % of transfer errors
-#define RX_BUFFER_SIZE 256 // receive buffer
-#define TX_BUFFER_SIZE 256 // transmit buffer
+/*#define USART_BAUDRATE 9600 // used for setup of devices (wifi/gps) that default to this*/
+#define USART_BAUDRATE 57600
+#define USART_UBRR(baud) \
+  ((F_CPU / ((baud) * 8UL)) - 1)  // baud rate register value, with U2X set
 
-// ring buffer declaration:
-// the RX buffer fills from the outside world, putting new "heads" in and shrinks by getting the "tails" in the program,
-// a full RX buffer discards new data
-// the TX buffer puts new "heads" in and transmits the "tail",
-// a full TX buffer waits for a space
-static volatile uint8_t tx_buffer[TX_BUFFER_SIZE];
-static volatile uint8_t tx_buffer_head;
-static volatile uint8_t tx_buffer_tail;
-static volatile uint8_t rx_buffer[RX_BUFFER_SIZE];
-static volatile uint8_t rx_buffer_head;
-static volatile uint8_t rx_buffer_tail;
+// ring buffer sizes per port, powers of 2 up to 256, can be overridden with
+// CFLAGS
+#ifdef EASYRIDER_MCU1
+#ifndef UART0_RX_SIZE
+#define UART0_RX_SIZE 256  // Wifly: HTTP upgrade request, websocket frames
+#endif
+#ifndef UART0_TX_SIZE
+#define UART0_TX_SIZE 256  // Wifly: websocket frames out
+#endif
+#else
+#ifndef UART0_RX_SIZE
+#define UART0_RX_SIZE 256  // GPS: binary navigation data in
+#endif
+#ifndef UART0_TX_SIZE
+#define UART0_TX_SIZE 32  // GPS: configuration messages out
+#endif
+#endif
+#ifndef UART1_RX_SIZE
+#define UART1_RX_SIZE 16  // shell/debug input
+#endif
+#ifndef UART1_TX_SIZE
+#define UART1_TX_SIZE 128  // debug traces
+#endif
 
-// proto's
-void uart_init(void);
-void uart_put(uint8_t c);
-void uart_put_str(const char *str);
-void uart_put_str_P(const char *str);
-void uart_put_int(const uint16_t dec);
-uint8_t uart_get(void);
-uint8_t uart_available(void);
+// proto's, UART0 for Wifly WiFi communication (mcu1) / GPS (mcu2)
+void uart_init_0(void);
+void uart_set_baud_0(uint32_t baud);
+void uart_put_0(uint8_t c);
+uint8_t uart_try_put_0(uint8_t c);
+uint16_t uart_write_0(const uint8_t *buf, uint16_t len);
+uint8_t uart_writable_0(void);
+void uart_put_str_0(const char *str);
+void uart_put_str_P_0(const char *str);
+void uart_put_int_0(const uint16_t dec);
+uint8_t uart_get_0(void);
+uint8_t uart_available_0(void);
+void uart_flush_rx_0(void);
+void uart_flush_tx_0(void);
 
-#endif
+// proto's, UART1 for shell and debugging (mcu1/mcu2)
+void uart_init_1(void);
+void uart_set_baud_1(uint32_t baud);
+void uart_put_1(uint8_t c);
+uint8_t uart_try_put_1(uint8_t c);
+uint16_t uart_write_1(const uint8_t *buf, uint16_t len);
+uint8_t uart_writable_1(void);
+void uart_put_str_1(const char *str);
+void uart_put_str_P_1(const char *str);
+void uart_put_int_1(const uint16_t dec);
+uint8_t uart_get_1(void);
+uint8_t uart_available_1(void);
+void uart_flush_rx_1(void);
+void uart_flush_tx_1(void);
 
+#endif
@@ -18,6 +18,9 @@
  */
 #include "util.h"
 
+// powers of ten for the divide-free digit extraction
+static const uint16_t g_pow10[] PROGMEM = {10000, 1000, 100, 10};
+
 // byte to binary ascii representation
 // used to convert the 2 state bytes to a bit string
 char* command_util_btob(uint8_t x, char* bstr) {
@@ -31,5 +34,102 @@ char* command_util_btob(uint8_t x, char* bstr) {
 // converts uint8_t to ascii number representation with
 // left padding of zero's to form a fixed size number
 void fixed_ascii_uint8(char* buffer, uint8_t nr) {
-  sprintf(buffer, "%03u", nr);
+  fixed_ascii_uint16(buffer, nr, 3);
+  buffer[3] = '\0';
+}
+
+// converts uint16_t to ascii number representation with left padding of
+// zero's, without divisions (no hardware divider): every digit is counted by
+// subtracting its power of ten. Digits above width are dropped and the buffer
+// isn't terminated, so fields can be placed inside a bigger record
+void fixed_ascii_uint16(char* buffer, uint16_t nr, uint8_t width) {
+  uint8_t i;
+  uint16_t pow;
+  char digit;
+  for (i = 0; i < 4; i++) {
+    pow = pgm_read_word(&g_pow10[i]);
+    digit = '0';
+    while (nr >= pow) {
+      nr -= pow;
+      digit++;
+    }
+    if (i >= 5 - width) {
+      *buffer++ = digit;
+    }
+  }
+  *buffer = '0' + nr;
+}
+
+// fills a fixed width ascii record, field by field, from a PROGMEM layout
+// table and the matching values
+void fixed_ascii_fields(char* buffer, const tFixedField* layout,
+                        const uint16_t* values, uint8_t count) {
+  uint8_t i;
+  for (i = 0; i < count; i++) {
+    fixed_ascii_uint16(&buffer[pgm_read_byte(&layout[i].offset)], values[i],
+                       pgm_read_byte(&layout[i].width));
+  }
+}
+
+// same as fixed_ascii_fields(), but only renders the fields whose value
+// differs from the cache of previously rendered values, the cache gets updated
+// NOTE: prefill the cache with 0xFFFF to force a full first render
+void fixed_ascii_fields_changed(char* buffer, const tFixedField* layout,
+                                const uint16_t* values, uint16_t* cache,
+                                uint8_t count) {
+  uint8_t i;
+  for (i = 0; i < count; i++) {
+    if (values[i] != cache[i]) {
+      cache[i] = values[i];
+      fixed_ascii_uint16(&buffer[pgm_read_byte(&layout[i].offset)], values[i],
+                         pgm_read_byte(&layout[i].width));
+    }
+  }
+}
+
+// reads the fields of a fixed width ascii record into values, the reverse of
+// fixed_ascii_fields(). Returns 0 when a field holds something else than digits
+// or a 5 digit value that doesn't fit in 16 bits
+uint8_t fixed_ascii_parse(const char* buffer, const tFixedField* layout,
+                          uint16_t* values, uint8_t count) {
+  const char* digit;
+  uint8_t i, width;
+  uint32_t value;
+  for (i = 0; i < count; i++) {
+    digit = &buffer[pgm_read_byte(&layout[i].offset)];
+    width = pgm_read_byte(&layout[i].width);
+    value = 0;
+    while (width--) {
+      if (*digit < '0' || *digit > '9') {
+        return 0;
+      }
+      value = value * 10 + (*digit++ - '0');
+    }
+    if (value > UINT16_MAX) {
+      return 0;
+    }
+    values[i] = value;
+  }
+  return 1;
+}
+
+// all pins inactive, counters at their start value
+void debounce_init(tDebounce* db) {
+  db->state = 0;
+  db->ct0 = 0xFF;
+  db->ct1 = 0xFF;
+}
+
+// debounces all 8 pins of a port in parallel: every pin has its own 2 bit
+// counter, spread "vertically" over ct0/ct1, that counts the samples which
+// differ from the debounced state and restarts on every equal sample, so a pin
+// only toggles after 4 differing samples in a row
+// active: sampled pins (1 = active), returns the toggled pins
+uint8_t debounce_port(tDebounce* db, uint8_t active) {
+  uint8_t delta = db->state ^ active;  // pins differing from debounced state
+  db->ct0 = ~(db->ct0 & delta);
+  db->ct1 = db->ct0 ^ (db->ct1 & delta);
+  delta &= db->ct0 & db->ct1;  // counters rolled over
+  db->state ^= delta;
+  return delta;
 }
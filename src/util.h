@@ -20,13 +20,37 @@
 #define UTIL_H_INCLUDED
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// one field of a fixed width ascii record, layout tables live in PROGMEM
+typedef struct {
+  uint8_t offset;  // index of the first digit in the record
+  uint8_t width;   // number of zero padded digits, 1-5
+} tFixedField;
+
+// vertical counter debouncer of the 8 pins of a port
+typedef struct {
+  uint8_t state;  // debounced pin states, 1 = active
+  uint8_t ct0;    // bit 0 of the per pin vertical counters
+  uint8_t ct1;    // bit 1 of the per pin vertical counters
+} tDebounce;
+
 // proto's
 char* command_util_btob(uint8_t x, char* bstr);
 void fixed_ascii_uint8(char* buffer, uint8_t nr);
+void fixed_ascii_uint16(char* buffer, uint16_t nr, uint8_t width);
+void fixed_ascii_fields(char* buffer, const tFixedField* layout,
+                        const uint16_t* values, uint8_t count);
+void fixed_ascii_fields_changed(char* buffer, const tFixedField* layout,
+                                const uint16_t* values, uint16_t* cache,
+                                uint8_t count);
+uint8_t fixed_ascii_parse(const char* buffer, const tFixedField* layout,
+                          uint16_t* values, uint8_t count);
+void debounce_init(tDebounce* db);
+uint8_t debounce_port(tDebounce* db, uint8_t active);
 
 #endif
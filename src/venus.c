@@ -18,36 +18,244 @@
  */
 #include "venus.h"
 
-uint16_t SWAP16(uint16_t x) { return ((x&0xff)<<8 | (x>>8)); }
-uint32_t SWAP32(uint32_t x) { return ((x&0xff)<<24 | ((x&0xff00)<<8) | ((x&0xff0000)>>8) | ((x&0xff000000)>>24)); }
+// destination of each big-endian navigation data byte in the little-endian
+// venus_location: the fields are assembled as the bytes come in, no swapping
+// afterwards. Fields nobody uses (gps week/tow, ellipsoid altitude, dilutions,
+// ECEF coordinates) are skipped
+#define VENUS_SKIP 0xFF
+#define LOC_1(field) offsetof(venus_location, field)
+#define LOC_2(field) LOC_1(field) + 1, LOC_1(field)
+#define LOC_4(field) LOC_1(field) + 3, LOC_1(field) + 2, LOC_2(field)
+#define SKIP_2 VENUS_SKIP, VENUS_SKIP
+#define SKIP_4 SKIP_2, SKIP_2
+
+static const uint8_t g_location_map[] PROGMEM = {
+    LOC_1(fix),          LOC_1(sv_count),
+    SKIP_2,              // gps_week
+    SKIP_4,              // gps_tow
+    LOC_4(latitude),     LOC_4(longitude),
+    SKIP_4,              // ellipsoid_alt
+    LOC_4(sealevel_alt),
+    SKIP_2,              SKIP_2, SKIP_2, SKIP_2, SKIP_2,  // dilutions
+    SKIP_4,              SKIP_4, SKIP_4,                  // ecef_coor
+    LOC_4(ecef_vel.x),   LOC_4(ecef_vel.y), LOC_4(ecef_vel.z)};
+
+#define VENUS_CMD_QUEUE 4     // pending commands, power of 2
+#define VENUS_CMD_SIZE 4      // maximum payload of a command, message id incl.
+#define VENUS_CMD_TIMEOUT 5   // ticks to wait for the ACK/NACK
+#define VENUS_CMD_RETRIES 2   // resends before a command is dropped
+#define VENUS_PROBE_TICKS 15  // listening window after startup
+#define VENUS_PROBE_NAVS 10   // navigation messages in that window: the GPS
+                              // is configured already
+
+// a command to the GPS, waiting for its ACK/NACK
+typedef struct {
+  uint8_t length;                   // payload length, message id incl.
+  uint8_t payload[VENUS_CMD_SIZE];  // message id and its parameters
+} tVenusCmd;
+
+// registry of the handled output messages
+typedef struct {
+  uint8_t id;              // message id
+  uint8_t length;          // minimum payload length, message id excl.
+  void (*handler)(void);   // decodes gps_msg
+} tVenusMsg;
 
 uint8_t gps_read(uint8_t c);
 void gps_csv(void);
 void process_location(void);
+static void process_ack(void);
+static void process_nack(void);
+static void venus_dispatch(void);
+static void venus_send(void);
+static void venus_done(uint8_t acked);
+static void venus_link(t_venus_link link);
 
-// one time setup to configure GPS Venus chip
+static const tVenusMsg g_venus_msgs[] PROGMEM = {
+    {VENUS_GPS_LOCATION, sizeof(venus_location), process_location},
+    {VENUS_ACK, 1, process_ack},
+    {VENUS_NACK, 1, process_nack}};
+
+static tVenusCmd g_cmds[VENUS_CMD_QUEUE];  // command queue
+static uint8_t g_cmd_head;     // next free slot
+static uint8_t g_cmd_tail;     // command being sent/acknowledged
+static uint8_t g_cmd_timer;    // ticks left for the ACK, 0 when not sent yet
+static uint8_t g_cmd_retries;  // resends of the tail command
+static uint8_t g_cmd_failed;   // commands dropped in the current link state
+static t_venus_link g_link;    // configuration state
+static uint8_t g_link_timer;   // ticks in the current link state
+static uint8_t g_link_navs;    // navigation messages in the current link state
+static uint8_t g_link_acks;    // ACKs in the current link state
+
+// brings the GPS up at USART_BAUDRATE with binary output at VENUS_RATE, no
+// manual setup needed: a GPS that doesn't answer is assumed to be at its
+// factory baud rate and gets reconfigured, the settings go to its flash
 void gps_setup() {
+  venus_link(VENUS_LINK_PROBE);
+}
+
+// true once the GPS is configured
+uint8_t gps_ready() { return g_link == VENUS_LINK_READY; }
+
+// queues a command (message id and its parameters), it's sent when the ones
+// before are acknowledged. Returns 0 when the queue is full
+uint8_t gps_command(const uint8_t *payload, uint8_t length) {
+  if (length > VENUS_CMD_SIZE ||
+      ((g_cmd_head + 1) & (VENUS_CMD_QUEUE - 1)) == g_cmd_tail) {
+    return 0;
+  }
+  g_cmds[g_cmd_head].length = length;
+  memcpy(g_cmds[g_cmd_head].payload, payload, length);
+  g_cmd_head = (g_cmd_head + 1) & (VENUS_CMD_QUEUE - 1);
+  return 1;
+}
+
+// enters a configuration state and queues its commands
+static void venus_link(t_venus_link link) {
+  static const uint8_t query[] = {VENUS_QUERY_VERSION, 1};  // system code
+  static const uint8_t serial[] = {VENUS_CONFIG_SERIAL, 0, VENUS_BAUD_57600,
+                                   VENUS_ATTR_FLASH};  // COM1
+  static const uint8_t output[] = {VENUS_CONFIG_OUTPUT, VENUS_OUTPUT_BINARY,
+                                   VENUS_ATTR_FLASH};
+  static const uint8_t rate[] = {VENUS_CONFIG_RATE, VENUS_RATE,
+                                 VENUS_ATTR_FLASH};
+  g_link = link;
+  g_link_timer = g_link_navs = g_link_acks = 0;
+  g_cmd_head = g_cmd_tail = g_cmd_timer = g_cmd_retries = g_cmd_failed = 0;
+  switch (link) {
+    case VENUS_LINK_PROBE:
+      uart_set_baud_0(USART_BAUDRATE);
+      gps_command(query, sizeof(query));
+      break;
+    case VENUS_LINK_BAUD:
+      uart_flush_tx_0();
+      uart_set_baud_0(VENUS_DEFAULT_BAUD);
+      gps_command(serial, sizeof(serial));
+      break;
+    case VENUS_LINK_CONFIG:
+      uart_set_baud_0(USART_BAUDRATE);
+      gps_command(output, sizeof(output));
+      gps_command(rate, sizeof(rate));
+      break;
+    case VENUS_LINK_READY:
+      break;
+  }
+#ifdef EASY_TRACE
+  uart_put_str_1("VENUS_LINK: ");
+  uart_put_int_1(link);
+  uart_put_str_1("\r\n");
+#endif
+}
+
+// time keeping of the command queue and the configuration, called every
+// VENUS_TICK_MS
+void gps_tick() {
+  if (g_cmd_timer && !--g_cmd_timer) {  // no answer on the tail command
+    if (g_cmd_retries < VENUS_CMD_RETRIES) {
+      g_cmd_retries++;  // resent by gps_process()
+    } else {
+      venus_done(0);
+    }
+  }
+  g_link_timer++;
+  switch (g_link) {
+    case VENUS_LINK_PROBE:
+      if (g_link_timer >= VENUS_PROBE_TICKS) {
+        if (g_link_navs >= VENUS_PROBE_NAVS) {
+          venus_link(VENUS_LINK_READY);  // set up before, no flash writes
+        } else if (g_link_acks) {
+          venus_link(VENUS_LINK_CONFIG);  // right baud rate, wrong output
+        } else {
+          venus_link(VENUS_LINK_BAUD);
+        }
+      }
+      break;
+    case VENUS_LINK_BAUD:  // no ACK at the factory baud rate either: retry
+    case VENUS_LINK_CONFIG:
+      if (g_cmd_head == g_cmd_tail) {
+        venus_link(g_cmd_failed ? VENUS_LINK_PROBE : VENUS_LINK_READY);
+      }
+      break;
+    case VENUS_LINK_READY:
+      break;
+  }
 }
 
-// swap little-endian to big-endian for better number processing
+// sends the tail command when the uart has room for it:
+// 0xA0 0xA1 - length (2 bytes) - payload - checksum - CR LF
+static void venus_send() {
+  tVenusCmd *cmd = &g_cmds[g_cmd_tail];
+  uint8_t frame[VENUS_CMD_SIZE + 7];
+  uint8_t checksum = 0;
+  uint8_t i;
+  if (uart_writable_0() < cmd->length + 7) {
+    return;
+  }
+  frame[0] = 0xA0;
+  frame[1] = 0xA1;
+  frame[2] = 0;
+  frame[3] = cmd->length;
+  for (i = 0; i < cmd->length; i++) {
+    frame[4 + i] = cmd->payload[i];
+    checksum ^= cmd->payload[i];
+  }
+  frame[4 + i] = checksum;
+  frame[5 + i] = 0x0D;
+  frame[6 + i] = 0x0A;
+  uart_write_0(frame, cmd->length + 7);
+  g_cmd_timer = VENUS_CMD_TIMEOUT;
+}
+
+// removes the tail command from the queue
+static void venus_done(uint8_t acked) {
+  if (!acked) {
+    g_cmd_failed++;
+  }
+  g_cmd_tail = (g_cmd_tail + 1) & (VENUS_CMD_QUEUE - 1);
+  g_cmd_timer = 0;
+  g_cmd_retries = 0;
+}
+
+// ACK of a command: the GPS answers at the old baud rate, then switches
+static void process_ack() {
+  if (g_cmd_timer && gps_msg.body[0] == g_cmds[g_cmd_tail].payload[0]) {
+    venus_done(1);
+    g_link_acks++;
+    if (g_link == VENUS_LINK_BAUD) {
+      venus_link(VENUS_LINK_CONFIG);
+    }
+  }
+}
+
+// NACK of a command, it's not retried
+static void process_nack() {
+  if (g_cmd_timer && gps_msg.body[0] == g_cmds[g_cmd_tail].payload[0]) {
+    venus_done(0);
+    g_link_acks++;  // it does answer at this baud rate
+  }
+}
+
+// hands a complete message to its registered handler, others are ignored
+static void venus_dispatch() {
+  uint8_t i;
+  void (*handler)(void);
+  for (i = 0; i < sizeof(g_venus_msgs) / sizeof(g_venus_msgs[0]); i++) {
+    if (pgm_read_byte(&g_venus_msgs[i].id) == gps_msg.id) {
+      if (gps_msg.length >= pgm_read_byte(&g_venus_msgs[i].length)) {
+        handler = (void (*)(void))pgm_read_word(&g_venus_msgs[i].handler);
+        handler();
+      }
+      return;
+    }
+  }
+}
+
+// navigation data is decoded already, as it came in
 void process_location() {
-  gps_msg.location.gps_week = SWAP16(gps_msg.location.gps_week);
-  gps_msg.location.gps_tow = SWAP32(gps_msg.location.gps_tow);
-  gps_msg.location.latitude = SWAP32(gps_msg.location.latitude);
-  gps_msg.location.longitude = SWAP32(gps_msg.location.longitude);
-  gps_msg.location.ellipsoid_alt = SWAP32(gps_msg.location.ellipsoid_alt);
-  gps_msg.location.sealevel_alt = SWAP32(gps_msg.location.sealevel_alt);
-  gps_msg.location.gdop = SWAP16(gps_msg.location.gdop);
-  gps_msg.location.pdop = SWAP16(gps_msg.location.pdop);
-  gps_msg.location.hdop = SWAP16(gps_msg.location.hdop);
-  gps_msg.location.vdop = SWAP16(gps_msg.location.vdop);
-  gps_msg.location.tdop = SWAP16(gps_msg.location.tdop);
-  gps_msg.location.ecef_coor.x = SWAP32(gps_msg.location.ecef_coor.x);
-  gps_msg.location.ecef_coor.y = SWAP32(gps_msg.location.ecef_coor.y);
-  gps_msg.location.ecef_coor.z = SWAP32(gps_msg.location.ecef_coor.z);
-  gps_msg.location.ecef_vel.x = SWAP32(gps_msg.location.ecef_vel.x);
-  gps_msg.location.ecef_vel.y = SWAP32(gps_msg.location.ecef_vel.y);
-  gps_msg.location.ecef_vel.z = SWAP32(gps_msg.location.ecef_vel.z);
+  gps_csv();
+  gps_status++;
+  if (!gps_status) gps_status = 1;
+  g_link_navs++;
 }
 
 // reads and processes the incoming binary messages byte by byte (from GPS -> mcu via uart)
@@ -84,7 +292,14 @@ uint8_t gps_read(uint8_t c) {
       }
       break;
     case 5: // read bytes of the payload
-      if (payload_idx < VENUS_MAX_PAYLOAD) {
+      if (gps_msg.id == VENUS_GPS_LOCATION) {  // decode in place
+        if (payload_idx < sizeof(g_location_map)) {
+          uint8_t dest = pgm_read_byte(&g_location_map[payload_idx]);
+          if (dest != VENUS_SKIP) {
+            gps_msg.body[dest] = c;
+          }
+        }
+      } else if (payload_idx < VENUS_MAX_PAYLOAD) {
         gps_msg.body[payload_idx] = c;
       }
       checksum ^= c; // update checksum
@@ -104,10 +319,6 @@ uint8_t gps_read(uint8_t c) {
       break;
     case 8: 
       state = 0;
-      if (gps_msg.id == VENUS_GPS_LOCATION) { // post-process binary message to a usable format
-        process_location();
-        gps_csv();
-      }
       return (c == 0x0A) ? ( (payload_idx <= VENUS_MAX_PAYLOAD) ? VENUS_OK : VENUS_CLIPPED) : VENUS_INCOMPLETE; 
     default: 
       state = 0; 
@@ -128,25 +339,25 @@ void gps_csv() {
   uint8_t idx = 0;
   utoa(gps_msg.location.fix, &gps_ascii[idx], 10);            // #total chars: 1
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 2
+  gps_ascii[idx++] = ',';                                     // #total chars: 2
   utoa(gps_msg.location.sv_count, &gps_ascii[idx], 10);       // #total chars: 34
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 5
+  gps_ascii[idx++] = ',';                                     // #total chars: 5
   ltoa(gps_msg.location.latitude, &gps_ascii[idx], 10);       // #total chars: 6789 10 11 12 13 14 15 16
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 17
+  gps_ascii[idx++] = ',';                                     // #total chars: 17
   ltoa(gps_msg.location.longitude, &gps_ascii[idx], 10);      // #total chars: 18 19 20 21 22 23 24 25 26 27 28
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 29
+  gps_ascii[idx++] = ',';                                     // #total chars: 29
   ultoa(gps_msg.location.sealevel_alt, &gps_ascii[idx], 10);  // #total chars: 30 31 32 33 34 35 36 37 38 39
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 40
+  gps_ascii[idx++] = ',';                                     // #total chars: 40
   ltoa(gps_msg.location.ecef_vel.x, &gps_ascii[idx], 10);     // #total chars: 41 42 43 44 45 46 47 48 49 50 51
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 52
+  gps_ascii[idx++] = ',';                                     // #total chars: 52
   ltoa(gps_msg.location.ecef_vel.y, &gps_ascii[idx], 10);     // #total chars: 53 54 55 56 57 58 59 60 61 62 63
   idx = strlen(gps_ascii);
-  gps_ascii[idx] = ',';                                       // #total chars: 64
+  gps_ascii[idx++] = ',';                                     // #total chars: 64
   ltoa(gps_msg.location.ecef_vel.z, &gps_ascii[idx], 10);     // #total chars: 65 66 67 68 69 70 71 72 73 74 75
 }
 
@@ -156,12 +367,14 @@ void gps_process() {
   if (uart_available_0()) {
     status = gps_read(uart_get_0());
     if (status == VENUS_OK) { // complete message received
-      gps_status++;
-      if (!gps_status) gps_status = 1;
+      venus_dispatch();  // post-process binary message to a usable format
 #ifdef EASY_TRACE
       uart_put_str_1("VENUS_OK\r\n");
 #endif
     }
   }
+  if (g_cmd_head != g_cmd_tail && !g_cmd_timer) {  // next command or resend
+    venus_send();
+  }
 }
 
@@ -19,23 +19,53 @@
 #ifndef VENUS_H_INCLUDED
 #define VENUS_H_INCLUDED
 
+#include <avr/pgmspace.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include "usart_0.h"  // UART0 for GPS (mcu2)
-#include "usart_1.h"  // UART1 for DEBUG
+#include "usart.h"  // UART0 for GPS (mcu2), UART1 for DEBUG
 
 void gps_process(void);
 void gps_setup(void);
+void gps_tick(void);
+uint8_t gps_command(const uint8_t *payload, uint8_t length);
+uint8_t gps_ready(void);
 
 #define VENUS_MAX_PAYLOAD 255
 #define VENUS_MAX_ASCII 80
 
+#define VENUS_TICK_MS 100  // gps_tick() call interval
+
+// message ids, input (configuration)
+#define VENUS_QUERY_VERSION 0x02  // query software version
+#define VENUS_CONFIG_SERIAL 0x05  // configure serial port
+#define VENUS_CONFIG_OUTPUT 0x09  // configure message type
+#define VENUS_CONFIG_RATE 0x0E    // configure position update rate
+// message ids, output
+#define VENUS_SW_VERSION 0x80    // software version
+#define VENUS_ACK 0x83           // command accepted
+#define VENUS_NACK 0x84          // command rejected
 #define VENUS_GPS_LOCATION 0xA8  // GPS message id for binary data output
 
+// configuration values
+#define VENUS_DEFAULT_BAUD 9600  // factory default baud rate
+#define VENUS_BAUD_57600 4       // baud rate index of VENUS_CONFIG_SERIAL
+#define VENUS_OUTPUT_BINARY 2    // binary messages only, no NMEA
+#define VENUS_RATE 10            // position updates per second
+#define VENUS_ATTR_FLASH 1       // update SRAM and flash, survives power cycles
+
+// states of the automatic configuration at startup
+typedef enum {
+  VENUS_LINK_PROBE,   // listening at USART_BAUDRATE, querying the version
+  VENUS_LINK_BAUD,    // no answer: switching the GPS from its factory baud rate
+  VENUS_LINK_CONFIG,  // binary output at VENUS_RATE
+  VENUS_LINK_READY    // configured, navigation data coming in
+} t_venus_link;
+
 char gps_ascii[VENUS_MAX_ASCII];  // GPS ascii format, comma-seperated
-uint8_t gps_status;  // 0 = no binary message yet or # of msgs received (rolls
-                     // over at 255 to 1)
+uint8_t gps_status;  // 0 = no location message yet or # of location msgs
+                     // received (rolls over at 255 to 1)
 
 typedef struct {
   int32_t x;
@@ -43,6 +73,8 @@ typedef struct {
   int32_t z;
 } xyz32_t;
 
+// navigation data (0xA8), little-endian: decoded while it comes in, the fields
+// skipped in venus.c's g_location_map aren't filled
 typedef struct {
   uint8_t fix;             // fix mode: 0 = no fix, 1,2,3 = 2D,3D,3D+DGPS
   uint8_t sv_count;        // # of satellites in view
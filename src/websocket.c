@@ -19,13 +19,19 @@
 #include "websocket.h"
 // NOTE: limitations opposed to RFC: http://tools.ietf.org/html/rfc6455:
 //
-// - only uses text frames consisting of bytes (no UTF-8), no binary frames
-// supported
-// - only final frames allowed, no frame fragmentation support
-// - maximum of 125 bytes as length of data (only using the first byte length
-// indicator of the RFC spec)
+// - text frames consist of bytes (no UTF-8), binary frames are only sent
+// (telemetry records), incoming messages have to be text
+// - maximum of 65535 bytes as length of an incoming frame (7 and 16-bit
+// lengths of the RFC spec, no 64-bit lengths), an incoming message (all its
+// fragments) has to fit in WS_IN_SIZE - 1 bytes
+// - outgoing frames are sent whole or skipped, their payload is limited to
+// WS_OUT_MAX bytes: the uart's tx ring. 16-bit lengths are used from 126 bytes
+// on. Outgoing messages can be fragmented: the telemetry records of a tick go
+// out as the fragments of one message, a new message ends an open one first
 // - no extensions support
-// - no ping/pong frames support
+// - pings are sent by the server every WS_PING_TICKS, a client that stays
+// silent for WS_TIMEOUT_TICKS is closed. The payload of a client's ping has to
+// fit in the incoming message buffer next to a message being received
 // - handles only 1 client at a time (Wifly module supports only 1 active tcp/ip
 // connection at a time)
 //
@@ -57,46 +63,90 @@
 #define HAS_ORIGIN_HDR 8
 #define HAS_HOST_HDR 16
 #define HAS_KEY_HDR 32
+#define WS_ALL_HDRS 63
+#define WS_HDR_COUNT 6
+
+#define WS_KEY_SIZE 24     // base64 encoded 16 byte key of the client
+#define WS_SECRET_SIZE 36  // the RFC's GUID
 
 static uint8_t g_valid_handshake;  // needs all header bits to be set for a
                                    // valid handshake is recognized
-static char g_buffer[256];         // store incoming data from client
-static char g_received_key[128];   // store incoming websocket key from client
-static uint8_t g_current;          // pointer of current buffer position
+static uint8_t g_hdr_candidates;   // header names still matching the line
+static uint8_t g_hdr_found;        // header bit of the value being received
+static uint8_t g_hdr_pos;  // position in the header name or value, 0xFF when
+                           // the value is invalid
+static char g_received_key[WS_KEY_SIZE + WS_SECRET_SIZE +
+                           1];  // incoming websocket key from client, the
+                                // secret appended, later the accept key
 static uint16_t g_errors;  // number of invalid bytes received, when expecting
                            // valid ws frames
+static uint8_t g_idle_ticks;  // ticks since the last frame from the client
 
 typedef enum { CLOSE, CONNECTING, OPEN, CLOSING } t_ws_state;
 
 typedef enum {
-  WS_TEXT_FRAME = 0x01,  // utf-8 text frame
-  WS_CLOSE_FRAME = 0x08  // close connection frame
+  WS_CONTINUATION_FRAME = 0x00,  // next fragment of a message
+  WS_TEXT_FRAME = 0x01,          // utf-8 text frame
+  WS_BINARY_FRAME = 0x02,        // binary frame
+  WS_CLOSE_FRAME = 0x08,         // close connection frame
+  WS_PING_FRAME = 0x09,          // ping, to be answered with a pong
+  WS_PONG_FRAME = 0x0A           // pong, answer on a ping
 } t_ws_opcode;
 
-enum g_first_byte { WS_FINAL_TXT = 0x81, WS_FINAL_CLOSE = 0x88 };
+enum g_first_byte {
+  WS_FIN = 0x80,
+  WS_FINAL_TXT = 0x81,
+  WS_FINAL_BIN = 0x82,
+  WS_FINAL_CLOSE = 0x88,
+  WS_FINAL_PING = 0x89,
+  WS_FINAL_PONG = 0x8A
+};
+
+#define WS_CONTROL 0x08  // opcode bit of the control frames (close/ping/pong)
+
+#define WS_LENGTH_16 126  // 7-bit length value announcing a 16-bit length
+#define WS_LENGTH_64 127  // 7-bit length value announcing a 64-bit length
+#define WS_HEADER_SIZE(length) \
+  ((length) > 125 ? 4 : 2)  // size of an unmasked (server) frame header
+
+// receiving states of an incoming frame
+typedef enum {
+  WS_RX_HEADER,     // FIN bit and opcode
+  WS_RX_LENGTH,     // mask bit and 7-bit length
+  WS_RX_LENGTH_HI,  // 16-bit extended length, MSB
+  WS_RX_LENGTH_LO,  // 16-bit extended length, LSB
+  WS_RX_MASK,       // 4 mask bytes
+  WS_RX_DATA        // masked payload
+} t_ws_rx_state;
 
 typedef struct {
   uint8_t isFinal;
   uint8_t isMasked;
   t_ws_opcode opcode;
-  uint8_t length;
+  t_ws_opcode control;    // ping/pong frame in between, 0 for data frames
+  uint16_t length;        // payload length of the current frame
+  uint16_t received;      // payload bytes received of the current frame
   uint8_t mask[4];
-  char data[126];
+  char data[WS_IN_SIZE];  // message data, the fragments appended
   uint8_t data_pointer;
+  t_ws_rx_state rx_state;
 } t_ws_frame;
 
 static t_ws_state g_state = CLOSE;
 static t_ws_frame g_in_frame;
-static t_ws_frame g_out_frame;
 static const t_ws_frame g_empty_frame;
+static uint8_t g_out_fragmented;  // a fragmented outgoing message is open
+static uint8_t g_out_binary;      // and it's a binary one
 
 static void ws_listen(void);
 static uint8_t get_ws_handshake(void);
 static uint8_t send_ws_handhake(void);
 static uint8_t get_ws_frame(void);
 static void send_ws_close_frame(void);
-static void send_ws_frame(void);
-void send_ws_text_frame(const char *data);
+static uint8_t send_ws_frame(uint8_t first, uint16_t length);
+static uint8_t send_ws_fragment(uint8_t binary, uint16_t length,
+                                uint8_t final);
+static void send_ws_header(uint8_t first, uint16_t length);
 
 // usart function pointers
 static void (*ws_send)(const char *str);
@@ -104,22 +154,28 @@ static void (*ws_send_byte)(uint8_t c);
 static uint8_t (*ws_get_byte)(void);
 static uint8_t (*ws_available)(void);
 static void (*ws_flush)(void);
+static uint16_t (*ws_write)(const uint8_t *buf, uint16_t len);
+static uint8_t (*ws_writable)(void);
 
-// websocket handshake header strings
-static const char *g_host_field = "Host: ";
-static const char *g_upgrade_field = "Upgrade: ";
-static const char *g_connection_field = "Connection: ";
-static const char *g_key_field = "Sec-WebSocket-Key: ";
-static const char *g_origin_field = "Origin: ";
-static const char *g_version_field = "Sec-WebSocket-Version: ";
-static const char *g_versionnumber_field = "13";
+// websocket handshake header names, lower case, indexed by bit of HAS_*_HDR
+static const char g_upgrade_field[] PROGMEM = "upgrade:";
+static const char g_connection_field[] PROGMEM = "connection:";
+static const char g_version_field[] PROGMEM = "sec-websocket-version:";
+static const char g_origin_field[] PROGMEM = "origin:";
+static const char g_host_field[] PROGMEM = "host:";
+static const char g_key_field[] PROGMEM = "sec-websocket-key:";
+static PGM_P const g_header_fields[WS_HDR_COUNT] PROGMEM = {
+    g_upgrade_field, g_connection_field, g_version_field,
+    g_origin_field,  g_host_field,       g_key_field};
+static const char g_versionnumber_field[] PROGMEM = "13";
 
 static const char *g_return_status_field =
     "HTTP/1.1 101 Switching Protocols\r\n";
 static const char *g_return_upgrade_field = "Upgrade: websocket\r\n";
 static const char *g_return_connection_field = "Connection: Upgrade\r\n";
 static const char *g_return_key_field = "Sec-WebSocket-Accept: ";
-static const char *g_secret_key = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char g_secret_key[] PROGMEM =
+    "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 void ws_init(void) {
   ws_send = uart_put_str_0;
@@ -127,26 +183,118 @@ void ws_init(void) {
   ws_get_byte = uart_get_0;
   ws_available = uart_available_0;
   ws_flush = uart_flush_rx_0;
+  ws_write = uart_write_0;
+  ws_writable = uart_writable_0;
 }
 
 // function called from command.c repetitively, handles all incoming websocket
 // data
 void ws_process(void) { ws_listen(); }
 
-// function called from command.c, handles all outgoing websocket data
-void ws_dispatch(const char *data) {
-  if (g_state == OPEN) {
-    send_ws_text_frame(data);
+// called from the main loop every WS_TICK_MS: ends the message with the
+// telemetry records of this tick, an empty final fragment. Keepalive: pings an
+// idle client and drops a client that stopped answering, e.g. walked out of
+// WiFi range
+void ws_tick(void) {
+  if (g_state != OPEN) {
+    return;
+  }
+  if (g_out_fragmented && send_ws_frame(WS_FIN | WS_CONTINUATION_FRAME, 0)) {
+    g_out_fragmented = 0;  // else it stays open, the next tick ends it
+  }
+  g_idle_ticks++;
+  if (g_idle_ticks >= WS_TIMEOUT_TICKS) {
+    g_state = CLOSING;  // ws_listen() sends the close frame
+  } else if (g_idle_ticks % WS_PING_TICKS == 0) {
+    send_ws_frame(WS_FINAL_PING, 0);
+  }
+}
+
+// returns 1 while a client is connected, telemetry producers skip building
+// their records otherwise
+uint8_t ws_connected(void) { return g_state == OPEN; }
+
+// returns 1 when a data frame of length bytes fits in the uart's tx ring right
+// now, so a producer can pace itself instead of having its frames skipped
+uint8_t ws_room(uint8_t length) {
+  return ws_writable() >= length + WS_HEADER_SIZE(length);
+}
+
+// function called from command.c, handles all outgoing websocket data: sends
+// a string as one text frame, straight from the caller's buffer into the uart's
+// tx ring. Returns 0 when skipped
+uint8_t ws_dispatch(const char *data) {
+  uint16_t length = strlen(data);
+  if (!send_ws_frame(WS_FINAL_TXT, length)) {
+    return 0;
+  }
+  ws_write((const uint8_t *)data, length);
+  return 1;
+}
+
+// like ws_dispatch(), for a string in Flash (PROGMEM)
+uint8_t ws_dispatch_P(const char *data) {
+  uint16_t length = strlen_P(data);
+  if (!send_ws_frame(WS_FINAL_TXT, length)) {
+    return 0;
+  }
+  while (length--) {  // fits, checked by send_ws_frame(): never waits
+    ws_send_byte(pgm_read_byte(data++));
+  }
+  return 1;
+}
+
+// sends the next fragment of a text or binary message, the first call opens
+// the message, a call with final set closes it. Lets data go out as it comes
+// in without buffering the whole message first. A fragment of the other type
+// ends the open message and starts a new one. Returns 0 when skipped, the
+// message stays as it was then
+uint8_t ws_dispatch_fragment(const char *data, uint8_t length, uint8_t binary,
+                             uint8_t final) {
+  if (!send_ws_fragment(binary, length, final)) {
+    return 0;
+  }
+  ws_write((const uint8_t *)data, length);
+  return 1;
+}
+
+// sends a telemetry record as a fragment of the message ws_tick() ends: the
+// records of a tick reach the app as one message, without a RAM buffer to
+// collect them in. Text records end with a newline, binary records (command
+// byte + fixed size record) are concatenated as they are. Returns 0 when
+// skipped
+uint8_t ws_dispatch_batch(const char *data, uint8_t length, uint8_t binary) {
+  if (binary) {
+    return ws_dispatch_fragment(data, length, 1, 0);
+  }
+  if (!send_ws_fragment(0, length + 1, 0)) {
+    return 0;
+  }
+  ws_write((const uint8_t *)data, length);
+  ws_send_byte(LF_CHAR);
+  return 1;
+}
+
+// sends a binary record as one binary frame: the command byte followed by the
+// packed tCmdData/tCmdState/tCmdGps record, exactly as it came in over SPI
+// from mcu2. No ascii digits and no escaping, so the app gets 2-3x fewer bytes
+// per sample. Returns 0 when skipped, i.e. the frame doesn't fit in the uart's
+// tx ring as a whole
+uint8_t ws_dispatch_bin(const char *data, uint8_t length) {
+  if (!send_ws_frame(WS_FINAL_BIN, length)) {
+    return 0;
   }
+  ws_write((const uint8_t *)data, length);
+  return 1;
 }
 
 static void ws_listen() {
   if (g_state == CLOSE) {
     if (get_ws_handshake()) {  // keep checking for valid handshake headers from
                                // client
-                               /*#ifdef EASY_TRACE*/
+#ifdef EASY_TRACE
       uart_put_str_1("g_state: CLOSE -> CONNECTING\n");
-      /*#endif*/
+#endif
       g_state = CONNECTING;
     }
   } else if (g_state == CONNECTING) {
@@ -159,31 +307,31 @@ static void ws_listen() {
       // after the flush
       // get_ws_frame keep ignoring everything until the first real ws byte
       ws_flush();
+      g_in_frame = g_empty_frame;
+      g_out_fragmented = 0;
+      g_idle_ticks = 0;
       g_state = OPEN;  // HTTP is upgraded to ws at this point, time for
                        // websocket frame communication
-                       /*#ifdef EASY_TRACE*/
+#ifdef EASY_TRACE
       uart_put_str_1("g_state: CONNECTING -> OPEN\n");
-      /*#endif*/
+#endif
     } else {
       g_state = CLOSE;
-      /*#ifdef EASY_TRACE*/
+#ifdef EASY_TRACE
       uart_put_str_1("g_state: CONNECTING -> CLOSE\n");
-      /*#endif*/
+#endif
     }
   } else if (g_state == OPEN) {
     if (get_ws_frame()) {  // keep checking for valid frames from client
       // handle data as command
       command_dispatch(g_in_frame.data);
-      /*#ifdef EASY_TRACE*/
+#ifdef EASY_TRACE
       uart_put_str_1("command received: ");
       uart_put_str_1(g_in_frame.data);
-      send_ws_text_frame(g_in_frame.data);
-      /*#endif*/
+      uart_put_str_1("\n");
+#endif
       // reset to process next frame
       g_in_frame = g_empty_frame;
-      /*#ifdef EASY_TRACE*/
-      uart_put_str_1("g_state: OPEN\n");
-      /*#endif*/
     }
   } else if (g_state == CLOSING) {
     // close request frame from client received or invalid frame data, send
@@ -191,13 +339,14 @@ static void ws_listen() {
     send_ws_close_frame();
     ws_flush();
     g_state = CLOSE;
-    /*#ifdef EASY_TRACE*/
+#ifdef EASY_TRACE
     uart_put_str_1("g_state: CLOSING -> CLOSE\n");
-    /*#endif*/
+#endif
   }
 }
 
-// checks for a valid handshake
+// checks for a valid handshake, the headers are matched byte by byte as they
+// come in: no line buffer, only the key value is stored
 // Example header:
 /* GET /chat HTTP/1.1*/
 /* Host: server.example.com*/
@@ -208,46 +357,66 @@ static void ws_listen() {
 /* Sec-WebSocket-Protocol: chat, superchat*/
 /* Sec-WebSocket-Version: 13*/
 static uint8_t get_ws_handshake() {
+  uint8_t cbyte;  // current byte
+  uint8_t i;
+  PGM_P name;
   if (ws_available()) {
-    uint8_t cbyte;  // current byte
     cbyte = ws_get_byte();
-    g_buffer[g_current++] = cbyte;
-    // reached end of a possible header line or maximum of buffer
-    if (cbyte == CR_CHAR || cbyte == LF_CHAR || g_current > 255) {
-      g_buffer[g_current - 1] = '\0';  // terminate properly for strstr function
-      g_current = 0;                   // reset for next http header line
-      if (!(g_valid_handshake & HAS_HOST_HDR) &&
-          strstr(g_buffer, g_host_field)) {
-        g_valid_handshake |= HAS_HOST_HDR;
-      } else if (!(g_valid_handshake & HAS_UPGRADE_HDR) &&
-                 strstr(g_buffer, g_upgrade_field)) {
-        g_valid_handshake |= HAS_UPGRADE_HDR;
-      } else if (!(g_valid_handshake & HAS_CONNECTION_HDR) &&
-                 strstr(g_buffer, g_connection_field)) {
-        g_valid_handshake |= HAS_CONNECTION_HDR;
-      } else if (!(g_valid_handshake & HAS_KEY_HDR) &&
-                 strstr(g_buffer, g_key_field)) {
-        g_valid_handshake |= HAS_KEY_HDR;
-        // save incoming websocket key
-        strtok(g_buffer, " ");
-        strcpy(g_received_key, strtok(NULL, " "));
-      } else if (!(g_valid_handshake & HAS_ORIGIN_HDR) &&
-                 strstr(g_buffer, g_origin_field)) {
-        g_valid_handshake |= HAS_ORIGIN_HDR;
-      } else if (!(g_valid_handshake & HAS_VERSION_HDR) &&
-                 strstr(g_buffer, g_version_field) &&
-                 strstr(g_buffer, g_versionnumber_field)) {
-        g_valid_handshake |= HAS_VERSION_HDR;
-        ;
+    if (cbyte == CR_CHAR || cbyte == LF_CHAR) {  // end of a header line
+      if (g_hdr_found == HAS_KEY_HDR) {
+        if (g_hdr_pos == WS_KEY_SIZE) {  // longer/shorter keys are invalid
+          g_received_key[WS_KEY_SIZE] = '\0';
+          g_valid_handshake |= HAS_KEY_HDR;
+        }
+      } else if (g_hdr_found == HAS_VERSION_HDR) {
+        if (g_hdr_pos == sizeof(g_versionnumber_field) - 1) {
+          g_valid_handshake |= HAS_VERSION_HDR;
+        }
+      } else {  // only the presence of the other headers counts
+        g_valid_handshake |= g_hdr_found;
+      }
+      // next line: match the header names not found yet
+      g_hdr_candidates = WS_ALL_HDRS & ~g_valid_handshake;
+      g_hdr_found = 0;
+      g_hdr_pos = 0;
+    } else if (g_hdr_found) {  // header value, spaces are skipped
+      if (cbyte != ' ' && g_hdr_pos != 0xFF) {
+        if (g_hdr_found == HAS_KEY_HDR) {
+          if (g_hdr_pos < WS_KEY_SIZE) {
+            g_received_key[g_hdr_pos] = cbyte;
+          }
+        } else if (g_hdr_found == HAS_VERSION_HDR &&
+                   (g_hdr_pos >= sizeof(g_versionnumber_field) - 1 ||
+                    cbyte != pgm_read_byte(&g_versionnumber_field[g_hdr_pos]))) {
+          g_hdr_pos = 0xFE;  // wrong version, ends up as invalid
+        }
+        g_hdr_pos++;
+      }
+    } else if (g_hdr_candidates) {  // header name, case insensitive
+      if (cbyte >= 'A' && cbyte <= 'Z') {
+        cbyte |= 0x20;  // to lower case
+      }
+      for (i = 0; i < WS_HDR_COUNT; i++) {
+        if (g_hdr_candidates & (1 << i)) {
+          name = (PGM_P)pgm_read_word(&g_header_fields[i]);
+          if (cbyte != pgm_read_byte(&name[g_hdr_pos])) {
+            g_hdr_candidates &= ~(1 << i);  // not this one
+          } else if (!pgm_read_byte(&name[g_hdr_pos + 1])) {
+            g_hdr_found = 1 << i;  // complete name, the value follows
+            g_hdr_candidates = 0;
+          }
+        }
       }
+      g_hdr_pos = g_hdr_found ? 0 : g_hdr_pos + 1;
     }
+    // else: request line or a header we don't need, skip until end of line
   }
   // found complete handshake
-  if (g_valid_handshake ==
-      (HAS_HOST_HDR | HAS_UPGRADE_HDR | HAS_CONNECTION_HDR | HAS_KEY_HDR |
-       HAS_ORIGIN_HDR | HAS_VERSION_HDR)) {
-    // reset first
-    g_current = 0;
+  if (g_valid_handshake == WS_ALL_HDRS) {
+    // reset first, the request line of the next handshake is skipped
+    g_hdr_candidates = 0;
+    g_hdr_found = 0;
+    g_hdr_pos = 0;
     g_valid_handshake = 0;
     return 1;
   }
@@ -262,7 +431,7 @@ static uint8_t get_ws_handshake() {
 /* Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=*/
 static uint8_t send_ws_handhake() {
   // concatenate server key
-  strcat(g_received_key, g_secret_key);
+  strcat_P(g_received_key, g_secret_key);
   // sha1 hash it
   char sha_hash[20];
   memset(sha_hash, 0, sizeof(sha_hash));
@@ -278,58 +447,99 @@ static uint8_t send_ws_handhake() {
   return 1;
 }
 
-// prepares a close frame and delegates it to send_ws_frame
+// sends a close frame, ends an open fragmented message as well
 static void send_ws_close_frame() {
-  g_out_frame.opcode = WS_CLOSE_FRAME;
-  send_ws_frame();
+  if ((g_state == OPEN) || (g_state == CLOSING)) {
+    send_ws_header(WS_FINAL_CLOSE, 0);
+    g_out_fragmented = 0;
+  }
 }
 
-// prepares a text frame and delegates it to send_ws_frame
-void send_ws_text_frame(const char *data) {
-  g_out_frame.opcode = WS_TEXT_FRAME;
-  while (*data) {
-    g_out_frame.data[g_out_frame.data_pointer++] = *data;
-    data++;
+// sends a frame header, payloads longer than 125 bytes get the 16-bit
+// extended length, server frames are never masked
+static void send_ws_header(uint8_t first, uint16_t length) {
+  ws_send_byte(first);
+  if (length > 125) {
+    ws_send_byte(WS_LENGTH_16);
+    ws_send_byte(length >> 8);
+    ws_send_byte(length & 0xFF);
+  } else {
+    ws_send_byte(length);
   }
-  g_out_frame.data[g_out_frame.data_pointer] = '\0';
-  g_out_frame.length = g_out_frame.data_pointer;
-  send_ws_frame();
 }
 
-// main websocket frame
-static void send_ws_frame() {
-  if ((g_out_frame.opcode == WS_TEXT_FRAME) && (g_out_frame.length <= 125) &&
-      (g_state == OPEN)) {
-    // send final text frame
-    ws_send_byte(WS_FINAL_TXT);
-    ws_send_byte(g_out_frame.length);
-    for (int i = 0; i < g_out_frame.length; i++) {
-      ws_send_byte(g_out_frame.data[i]);
-    }
-    g_out_frame = g_empty_frame;
-    // send close frame
-  } else if ((g_out_frame.opcode == WS_CLOSE_FRAME) &&
-             ((g_state == OPEN) || (g_state == CLOSING))) {
-    ws_send_byte(WS_FINAL_CLOSE);
-    g_out_frame = g_empty_frame;
+// starts a data frame: sends its header when the whole frame fits in the
+// uart's tx ring, the caller streams the payload from its own buffer right
+// after. The first frame of a new message ends an open fragmented one with an
+// empty final fragment, control frames can go in between. Returns 0 when the
+// frame has to be skipped, telemetry is resent anyway and a wait here would
+// stall the main loop
+static uint8_t send_ws_frame(uint8_t first, uint16_t length) {
+  uint8_t end = g_out_fragmented && !(first & WS_CONTROL) &&
+                (first & 0x0F) != WS_CONTINUATION_FRAME;
+  if (g_state != OPEN || length > WS_OUT_MAX) {
+    return 0;
+  }
+  if (ws_writable() < length + WS_HEADER_SIZE(length) + (end ? 2 : 0)) {
+    return 0;
+  }
+  if (end) {
+    send_ws_header(WS_FIN | WS_CONTINUATION_FRAME, 0);
+    g_out_fragmented = 0;
+  }
+  send_ws_header(first, length);
+  return 1;
+}
+
+// starts the next fragment of a message: a continuation of the open message
+// of the same type, else the first fragment of a new one
+static uint8_t send_ws_fragment(uint8_t binary, uint16_t length,
+                                uint8_t final) {
+  uint8_t first;
+  if (g_out_fragmented && binary == g_out_binary) {
+    first = WS_CONTINUATION_FRAME;
+  } else {
+    first = binary ? WS_BINARY_FRAME : WS_TEXT_FRAME;
   }
+  if (final) {
+    first |= WS_FIN;
+  }
+  if (!send_ws_frame(first, length)) {
+    return 0;
+  }
+  g_out_fragmented = !final;
+  g_out_binary = binary;
+  return 1;
 }
 
-// keep processing valid websocket frames from the client
+// keep processing valid websocket frames from the client, a message can be
+// fragmented over several frames, returns 1 when a complete message is in
+// g_in_frame.data
 static uint8_t get_ws_frame() {
-  if (ws_available()) {
-    uint8_t cbyte;  // current byte
-    cbyte = ws_get_byte();
-    // 1st byte check
-    if (!g_in_frame
-             .isFinal) {  // keep parsing bytes to reach a first valid ws byte
+  uint8_t cbyte;  // current byte
+  if (!ws_available()) {
+    return 0;
+  }
+  cbyte = ws_get_byte();
+  switch (g_in_frame.rx_state) {
+    case WS_RX_HEADER:  // FIN bit and opcode, the RSV bits must be 0
       if (cbyte == WS_FINAL_CLOSE) {
         // reset and close
         g_in_frame = g_empty_frame;
         g_state = CLOSING;
-      } else if (cbyte == WS_FINAL_TXT) {
-        g_in_frame.isFinal = 1;
+      } else if (cbyte == WS_FINAL_PING || cbyte == WS_FINAL_PONG) {
+        // control frames can come in between the fragments of a message
+        g_idle_ticks = 0;
+        g_in_frame.control = cbyte & 0x0F;
+        g_in_frame.rx_state = WS_RX_LENGTH;
+      } else if (((cbyte & 0x7F) == WS_TEXT_FRAME && !g_in_frame.opcode) ||
+                 ((cbyte & 0x7F) == WS_CONTINUATION_FRAME &&
+                  g_in_frame.opcode)) {
+        // a text frame starts a message, continuation frames extend it
+        g_idle_ticks = 0;
         g_in_frame.opcode = WS_TEXT_FRAME;
+        g_in_frame.isFinal = cbyte & WS_FIN;
+        g_in_frame.rx_state = WS_RX_LENGTH;
       } else {  // still receiving invalid bytes, bailout if it's too much
         g_errors++;
         if (g_errors > 1024) {
@@ -340,36 +550,75 @@ static uint8_t get_ws_frame() {
         }
       }
       return 0;
-      // 2nd byte checks
-    } else if (!g_in_frame.isMasked) {
-      // mask bit is mandatory and data <= 125 bytes
+    case WS_RX_LENGTH:  // mask bit is mandatory, no 64-bit lengths, control
+                        // frames have 125 bytes at most
       g_in_frame.isMasked = cbyte & 0x80;
       g_in_frame.length = cbyte & 0x7F;
-      if (!(g_in_frame.isMasked) || (g_in_frame.length > 125)) {
+      if (!g_in_frame.isMasked || g_in_frame.length == WS_LENGTH_64 ||
+          (g_in_frame.control && g_in_frame.length > 125)) {
         // reset and close
         g_in_frame = g_empty_frame;
         g_state = CLOSING;
-      } else {
-        g_in_frame.isMasked = 1;
+        return 0;
       }
+      g_in_frame.isMasked = 0;  // counts the mask bytes from now on
+      if (g_in_frame.length == WS_LENGTH_16) {
+        g_in_frame.rx_state = WS_RX_LENGTH_HI;
+        return 0;
+      }
+      break;
+    case WS_RX_LENGTH_HI:
+      g_in_frame.length = (uint16_t)cbyte << 8;
+      g_in_frame.rx_state = WS_RX_LENGTH_LO;
       return 0;
-      // 4 mask bytes needed, by reading each mask byte, increment isMasked
-    } else if (g_in_frame.isMasked < 5) {
-      g_in_frame.mask[g_in_frame.isMasked - 1] = cbyte;
-      g_in_frame.isMasked++;
-      return 0;
-      // all mask bytes received, start gathering data bytes and unmask them
-    } else if (g_in_frame.data_pointer < g_in_frame.length) {
-      g_in_frame.data[g_in_frame.data_pointer] =
-          cbyte ^ g_in_frame.mask[g_in_frame.data_pointer % 4];
-      g_in_frame.data_pointer++;
-      if (g_in_frame.data_pointer == g_in_frame.length) {
-        // all data received, terminate string and start handling this command
-        g_in_frame.data[g_in_frame.data_pointer] = '\0';
-        return 1;
+    case WS_RX_LENGTH_LO:
+      g_in_frame.length |= cbyte;
+      break;
+    case WS_RX_MASK:  // 4 mask bytes needed
+      g_in_frame.mask[g_in_frame.isMasked++] = cbyte;
+      if (g_in_frame.isMasked < 4) {
+        return 0;
       }
+      g_in_frame.received = 0;
+      g_in_frame.rx_state = WS_RX_DATA;
+      break;
+    case WS_RX_DATA:  // gather data bytes and unmask them, behind the
+                      // message data received so far
+      g_in_frame.data[g_in_frame.data_pointer + g_in_frame.received] =
+          cbyte ^ g_in_frame.mask[g_in_frame.received & 3];
+      g_in_frame.received++;
+      break;
+  }
+  if (g_in_frame.rx_state != WS_RX_DATA) {  // frame length known
+    if (g_in_frame.data_pointer + g_in_frame.length > WS_IN_SIZE - 1) {
+      // message doesn't fit: reset and close
+      g_in_frame = g_empty_frame;
+      g_state = CLOSING;
+    } else {
+      g_in_frame.rx_state = WS_RX_MASK;
+    }
+    return 0;
+  }
+  if (g_in_frame.received == g_in_frame.length) {  // frame complete
+    g_in_frame.rx_state = WS_RX_HEADER;
+    if (g_in_frame.control) {
+      // answer a ping with a pong carrying the same payload, the payload isn't
+      // appended to the message. A pong only proves the client is alive
+      if (g_in_frame.control == WS_PING_FRAME) {
+        if (send_ws_frame(WS_FINAL_PONG, g_in_frame.length)) {
+          ws_write((const uint8_t *)&g_in_frame.data[g_in_frame.data_pointer],
+                   g_in_frame.length);
+        }
+      }
+      g_in_frame.control = 0;
       return 0;
     }
+    g_in_frame.data_pointer += g_in_frame.length;
+    if (g_in_frame.isFinal) {
+      // all data received, terminate string and start handling this command
+      g_in_frame.data[g_in_frame.data_pointer] = '\0';
+      return 1;
+    }
   }
   return 0;
 }
@@ -22,29 +22,53 @@
 // avr websocket server implementation
 // NOTE: limitations opposed to RFC: http://tools.ietf.org/html/rfc6455:
 //
-// - only uses text frames consisting of bytes (no UTF-8), no binary frames
-// supported
-// - only final frames allowed, no frame fragmentation support
-// - maximum of 125 bytes as length of data (only using the first byte length
-// indicator of the RFC spec)
+// - text frames consist of bytes (no UTF-8), binary frames are only sent
+// (telemetry records), incoming messages have to be text
+// - maximum of 65535 bytes as length of an incoming frame (7 and 16-bit
+// lengths of the RFC spec, no 64-bit lengths), an incoming message (all its
+// fragments) has to fit in WS_IN_SIZE - 1 bytes
+// - outgoing frames are sent whole or skipped, their payload is limited to
+// WS_OUT_MAX bytes: the uart's tx ring. 16-bit lengths are used from 126 bytes
+// on. Outgoing messages can be fragmented: the telemetry records of a tick go
+// out as the fragments of one message, a new message ends an open one first
 // - no extensions support
-// - no ping/pong frames support
+// - pings are sent by the server every WS_PING_TICKS, a client that stays
+// silent for WS_TIMEOUT_TICKS is closed. The payload of a client's ping has to
+// fit in the incoming message buffer next to a message being received
 // - handles only 1 client at a time (Wifly module supports only 1 active tcp/ip
 // connection at a time)
 
+#include <avr/pgmspace.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "base64_enc.h"
 #include "sha1.h"
-#include "usart_0.h"
-#include "usart_1.h"
+#include "usart.h"
 
 #include "command.h"
 
+#define WS_IN_SIZE 126  // incoming message buffer, the string terminator incl.
+// largest outgoing payload: the tx ring holds UART0_TX_SIZE - 1 bytes, minus a
+// 4 byte header
+#define WS_OUT_MAX (UART0_TX_SIZE - 1 - 4)
+
+// keepalive, in ticks of ws_tick()
+#define WS_TICK_MS 100        // ws_tick() call interval
+#define WS_PING_TICKS 50      // ping the client after 5s without frames from it
+#define WS_TIMEOUT_TICKS 150  // close after 15s: no pong on 2 pings
+
 // proto's
 void ws_init(void);
 void ws_process(void);
-void ws_dispatch(const char *data);
+void ws_tick(void);
+uint8_t ws_connected(void);
+uint8_t ws_room(uint8_t length);
+uint8_t ws_dispatch(const char *data);
+uint8_t ws_dispatch_P(const char *data);
+uint8_t ws_dispatch_fragment(const char *data, uint8_t length, uint8_t binary,
+                             uint8_t final);
+uint8_t ws_dispatch_batch(const char *data, uint8_t length, uint8_t binary);
+uint8_t ws_dispatch_bin(const char *data, uint8_t length);
 
 #endif
@@ -16,8 +16,71 @@
  *  limitations under the License.
  *
  */
+#include <util/crc16.h>
+
 #include "wifi.h"
 
+static uint16_t g_skipped;  // outgoing frames skipped, no room in the tx ring
+
+#ifdef WIFI_WEBSOCKET
+// websocket transport: the app connects with a websocket handshake, commands
+// come in as text messages and go out as text or binary frames
+
+void wifi_init(void) { ws_init(); }
+
+// function called from command.c repetitively, handles all incoming wifi data
+void wifi_process(void) { ws_process(); }
+
+// called from the main loop every WS_TICK_MS: keepalive and the end of the
+// message with the telemetry records of this tick
+void wifi_tick(void) { ws_tick(); }
+
+// returns 1 while a client is connected, telemetry isn't passed on otherwise
+uint8_t wifi_connected(void) { return ws_connected(); }
+
+// returns 1 when a binary frame of length bytes won't be skipped right now
+uint8_t wifi_room(uint8_t length) { return ws_room(length); }
+
+// passes outgoing data over wifi as one text frame, skipped when it doesn't
+// fit in the uart's tx ring as a whole: returns 0 when skipped
+uint8_t wifi_dispatch(const char *data) {
+  if (!ws_dispatch(data)) {
+    g_skipped++;
+    return 0;
+  }
+  return 1;
+}
+
+// passes an outgoing telemetry record over wifi, a fragment of the text message
+// with the other records of this tick. Returns 0 when skipped
+uint8_t wifi_dispatch_record(const char *data) {
+  if (!ws_dispatch_batch(data, strlen(data), 0)) {
+    g_skipped++;
+    return 0;
+  }
+  return 1;
+}
+
+// binary telemetry record (command byte + record), a fragment of the binary
+// message with the other binary records of this tick. Returns 0 when skipped
+uint8_t wifi_dispatch_record_bin(const char *data, uint8_t length) {
+  if (!ws_dispatch_batch(data, length, 1)) {
+    g_skipped++;
+    return 0;
+  }
+  return 1;
+}
+
+// passes outgoing binary data over wifi as one binary frame: the command byte
+// followed by the binary record. Skipped like wifi_dispatch(): returns 0
+uint8_t wifi_dispatch_bin(const char *data, uint8_t length) {
+  if (!ws_dispatch_bin(data, length)) {
+    g_skipped++;
+    return 0;
+  }
+  return 1;
+}
+#else
 // max size of a single command
 #define CMD_PAYLOAD_SIZE 125
 
@@ -27,18 +90,22 @@ static char g_in_payload[CMD_PAYLOAD_SIZE];  // command bytes without start/stop
                                              // bytes: [CMD] byte followed by
                                              // [1..n] data bytes
 // usart function pointers
-static void (*wifi_send)(const char *str);
 static void (*wifi_send_byte)(uint8_t c);
 static uint8_t (*wifi_get_byte)(void);
 static uint8_t (*wifi_available)(void);
 static void (*wifi_flush)(void);
+static uint16_t (*wifi_write)(const uint8_t *buf, uint16_t len);
+static uint8_t (*wifi_writable)(void);
+
+static void wifi_send_escaped(uint8_t c);
 
 void wifi_init(void) {
-  wifi_send = uart_put_str_0;
   wifi_send_byte = uart_put_0;
   wifi_get_byte = uart_get_0;
   wifi_available = uart_available_0;
   wifi_flush = uart_flush_rx_0;
+  wifi_write = uart_write_0;
+  wifi_writable = uart_writable_0;
 }
 
 // function called from command.c repetitively, handles all incoming wifi data
@@ -85,9 +152,84 @@ void wifi_process(void) {
   }
 }
 
-// function called from command.c, passes outgoing data over wifi
-void wifi_dispatch(const char *data) {
+// raw command frames over the Wifly's tcp stream: no connection state to keep
+// alive, the frames are passed on whether or not somebody listens
+void wifi_tick(void) {}
+
+uint8_t wifi_connected(void) { return 1; }
+
+// returns 1 when a binary frame of length bytes won't be skipped right now:
+// start, length, data and crc bytes, all of them escaped at worst
+uint8_t wifi_room(uint8_t length) {
+  return wifi_writable() >= 1 + 2 * (length + 2);
+}
+
+// telemetry records go out one frame each
+uint8_t wifi_dispatch_record(const char *data) { return wifi_dispatch(data); }
+
+uint8_t wifi_dispatch_record_bin(const char *data, uint8_t length) {
+  return wifi_dispatch_bin(data, length);
+}
+
+// function called from command.c, passes outgoing data over wifi. The frame is
+// only sent when it fits in the uart's tx ring as a whole, else it's skipped
+// so the main loop never waits for the Wifly: returns 0 when skipped
+uint8_t wifi_dispatch(const char *data) {
+  uint16_t length = strlen(data);
+  if (wifi_writable() < length + 2) {  // data + start/stop bytes
+    g_skipped++;
+    return 0;
+  }
   wifi_send_byte(CMD_START);
-  wifi_send(data);
+  wifi_write((const uint8_t *)data, length);
   wifi_send_byte(CMD_STOP);
+  return 1;
+}
+
+// passes outgoing binary framed data over wifi, data holds the command byte
+// followed by the binary record, same frame layout as on the SPI link. Skipped
+// like wifi_dispatch() when the escaped frame doesn't fit: returns 0
+uint8_t wifi_dispatch_bin(const char *data, uint8_t length) {
+  uint8_t crc = _crc_ibutton_update(0, length);
+  uint16_t size = 3 + length;  // start, length and crc bytes + data
+  uint8_t i;
+  if (WIFI_ESCAPED(length)) {
+    size++;
+  }
+  for (i = 0; i < length; i++) {  // first pass: frame size after escaping
+    if (WIFI_ESCAPED(data[i])) {
+      size++;
+    }
+    crc = _crc_ibutton_update(crc, data[i]);
+  }
+  if (WIFI_ESCAPED(crc)) {
+    size++;
+  }
+  if (wifi_writable() < size) {
+    g_skipped++;
+    return 0;
+  }
+  crc = _crc_ibutton_update(0, length);
+  wifi_send_byte(CMD_BSTART);
+  wifi_send_escaped(length);
+  for (i = 0; i < length; i++) {
+    wifi_send_escaped(data[i]);
+    crc = _crc_ibutton_update(crc, data[i]);
+  }
+  wifi_send_escaped(crc);
+  return 1;
 }
+
+// sends a single byte of a binary frame, escaping the flag bytes
+void wifi_send_escaped(uint8_t c) {
+  if (WIFI_ESCAPED(c)) {
+    wifi_send_byte(CMD_ESC);
+    c ^= CMD_ESC_XOR;
+  }
+  wifi_send_byte(c);
+}
+#endif
+
+// number of outgoing frames skipped since startup because the Wifly couldn't
+// keep up
+uint16_t wifi_skipped(void) { return g_skipped; }
@@ -21,14 +21,27 @@
 
 #include <stdint.h>
 #include <string.h>
-#include "usart_0.h"
-#include "usart_1.h"
+#include "usart.h"
 
 #include "command.h"
+#ifdef WIFI_WEBSOCKET
+#include "websocket.h"  // websocket framing of the wifi data (mcu1)
+#endif
+
+// flag bytes that are escaped in a binary frame
+#define WIFI_ESCAPED(c) \
+  ((c) == CMD_NOOP || (c) == CMD_ESC || (c) == CMD_BSTART)
 
 // proto's
 void wifi_init(void);
 void wifi_process(void);
-void wifi_dispatch(const char *data);
+void wifi_tick(void);
+uint8_t wifi_connected(void);
+uint8_t wifi_room(uint8_t length);
+uint8_t wifi_dispatch(const char *data);
+uint8_t wifi_dispatch_record(const char *data);
+uint8_t wifi_dispatch_record_bin(const char *data, uint8_t length);
+uint8_t wifi_dispatch_bin(const char *data, uint8_t length);
+uint16_t wifi_skipped(void);
 
 #endif